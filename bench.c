@@ -0,0 +1,186 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+
+/*
+  The reference scenes of the benchmark. Each is rendered with every thread count and tile
+  size, with no output, so that only the calculation is timed. The deep view is rendered
+  both by perturbation and by the double-double kernel. The sweep of the imaginary
+  exponent is rendered both with its frames swept together and with each frame by itself.
+*/
+struct scene{
+  const char *name;
+  const char *args;
+};
+
+static const struct scene s_scenes[] = {
+  {"standard",    "-w 960 -h 540 -s 0.004"},
+  {"interior",    "-w 960 -h 540 -r -0.122 -i 0.745 -s 0.0002"},
+  {"deep",        "-w 480 -h 270 -r -0.743643887037158704752191506114774 "
+                  "-i 0.131825904205311970493132056385139 -s 1e-14 -z on"},
+  {"double-double", "-w 480 -h 270 -r -0.743643887037158704752191506114774 "
+                  "-i 0.131825904205311970493132056385139 -s 1e-14 -q double-double -z off"},
+  {"non-integer", "-w 960 -h 540 -s 0.004 -a 2.5"},
+  {"complex",     "-w 960 -h 540 -s 0.004 -a 2 -b 0.01"},
+  {"sweep",       "-w 480 -h 270 -s 0.008 -n 16 -b 0.001 -B 0.016"},
+  {"sweep-frames", "-w 480 -h 270 -s 0.008 -n 16 -b 0.001 -B 0.016 -e off"},
+};
+static const char *s_tiles[] = {"64x8", "128x8", "256x32"};
+
+#define SCENES (sizeof(s_scenes)/sizeof(s_scenes[0]))
+#define TILES  (sizeof(s_tiles)/sizeof(s_tiles[0]))
+#define MAX_ARGS 32
+
+// Pinning of the threads of each run (-u), so that the scaling across NUMA nodes is measured
+static const char *s_pin = "off";
+
+static int run_scene(const struct scene *sc, int threads, const char *tile, const char *part,
+                     double *seconds);
+
+int main(int argc, char **argv){
+  // For optarg()
+  extern char *optarg;
+  extern int optind, opterr, optopt;
+
+  char part[512], line[1024];
+  const char *path = "bench.json";
+  FILE *out, *fp;
+  double seconds;
+  int max, threads, i, j, first;
+
+  max = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while((opt=getopt(argc, argv, "t:j:u:")) != -1){
+    if (optarg == NULL){
+      printf("Optarg is null!!");
+      return -1;
+    }
+    switch(opt) {
+    case 't': max=(int)strtoul(optarg, (char **) NULL, 0);
+      break;
+    case 'j': path=optarg;
+      break;
+    case 'u': s_pin=optarg;
+      break;
+    default: printf("Bad user argument: %c", (char) opt);
+      break;
+    }
+  }
+  if (max < 1)
+    max = 1;
+
+  if ((out = fopen(path, "w")) == NULL){
+    printf("File error creating file: %s\n", path);
+    return -1;
+  }
+  snprintf(part, sizeof(part), "%s.part", path);
+
+  /*
+    Sweep the thread counts in powers of two up to max, along with max itself. Each run
+    writes its timing to the part file, which is copied into the array of results
+  */
+  fprintf(out, "[\n");
+  first = 1;
+  for (i=0; i < SCENES; i++){
+    for (threads=1; ; threads *= 2){
+      if (threads > max)
+        threads = max;
+      for (j=0; j < TILES; j++){
+        if (run_scene(&s_scenes[i], threads, s_tiles[j], part, &seconds) != 0){
+          printf("%s, %d threads, %s tiles: failed\n", s_scenes[i].name, threads, s_tiles[j]);
+          continue;
+        }
+        if ((fp = fopen(part, "r")) == NULL)
+          continue;
+        if (fgets(line, sizeof(line), fp) != NULL){
+          line[strcspn(line, "\n")] = '\0';
+          fprintf(out, "%s  {\"scene\": \"%s\", \"process_s\": %.6f, \"result\": %s}",
+                  first ? "" : ",\n", s_scenes[i].name, seconds, line);
+          first = 0;
+        }
+        fclose(fp);
+      }
+      if (threads == max)
+        break;
+    }
+  }
+  fprintf(out, "\n]\n");
+  fclose(out);
+  unlink(part);
+
+  printf("Results written to %s\n", path);
+  return 0;
+}
+
+
+/*
+  Function: run_scene
+
+  Renders a scene with ./mandel, with no output, and prints the timing it reports. The
+  JSON record of the run is written to the file part.
+
+  Input:
+        const struct scene *sc: the scene to render
+        int threads:            the number of calculating threads
+        const char *tile:       the tile size, as WxH
+        const char *part:       the file to receive the JSON record
+        double *seconds:        receives the time taken by the whole process
+  Output:
+        Returns 0 on success and -1 on failure
+*/
+static int run_scene(const struct scene *sc, int threads, const char *tile, const char *part,
+                     double *seconds){
+  struct timespec start, end;
+  char args[512], count[16], line[1024];
+  char *argv[MAX_ARGS+14], *tok;
+  int fd[2], n, status;
+  FILE *fp;
+  pid_t chPID;
+
+  unlink(part);
+  snprintf(args, sizeof(args), "%s", sc->args);
+  snprintf(count, sizeof(count), "%d", threads);
+  n = 0;
+  argv[n++] = "mandel";
+  for (tok = strtok(args, " "); (tok != NULL) && (n < MAX_ARGS); tok = strtok(NULL, " "))
+    argv[n++] = tok;
+  argv[n++] = "-t", argv[n++] = count;
+  argv[n++] = "-T", argv[n++] = (char *) tile;
+  argv[n++] = "-o", argv[n++] = "none";
+  argv[n++] = "-j", argv[n++] = (char *) part;
+  argv[n++] = "-u", argv[n++] = (char *) s_pin;
+  argv[n] = NULL;
+
+  if (pipe(fd) != 0){
+    printf("Pipe Failed!!\n");
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  switch(chPID=fork()){
+  case -1:
+    printf("Fork Failed!!\n");
+    return -1;
+  case 0:
+    close(fd[0]);
+    dup2(fd[1], STDOUT_FILENO);
+    close(fd[1]);
+    execv("./mandel", argv);
+    _exit(-1);
+  default:
+    close(fd[1]);
+    fp = fdopen(fd[0], "r");
+    while (fgets(line, sizeof(line), fp) != NULL)
+      if (strncmp(line, "Timing:", 7) == 0)
+        printf("%-12s %2d threads, %6s tiles: %s", sc->name, threads, tile, line+8);
+    fclose(fp);
+    waitpid(chPID, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+  }
+
+  *seconds = (end.tv_sec-start.tv_sec) + 1e-9*(end.tv_nsec-start.tv_nsec);
+  return (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : -1;
+}
@@ -1,15 +1,36 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <math.h>
+#include <float.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <png.h>
+#include <zlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "mandel_dd.h"
 
 /*
-  These Values are used to control the recursive fractal funtion. 
+  These Values are used to control the recursive fractal funtion. They are the defaults of
+  s_depth, s_escape and s_min_r, which can be set at runtime (-D, -E and -M).
 
   DEPTH:    The maximum number of steps used for testing
   ESCAPE:   The square of the largest absolute value allowed before ending testing
@@ -19,6 +40,48 @@
 #define   DEPTH       2000
 #define   ESCAPE      100.0
 #define   MIN_R       1E-12
+// The largest depth allowed, which bounds the reference orbit to a few hundred MB
+#define   MAX_DEPTH   10000000
+
+/*
+  PERIOD_EPS: The square of the distance below which two points of an orbit are taken to be
+              the same, used to find the attracting cycles of points inside the set
+  PERIOD_EPS_F: The same for the float kernel, a few ulps of a float
+*/
+#define   PERIOD_EPS  1E-20
+#define   PERIOD_EPS_F 1E-12
+
+/*
+  FLOAT_ULPS: The float kernel, when requested, is used if a pixel spans at least this 
+              many ulps of a float at the largest coordinate of the image (or 2)
+  DOUBLE_ULPS: The same for the double kernels, which auto uses down to this reach, and
+              below which a double-double kernel is used
+  DD_ULPS:    The same for the double-double kernel, below which the image is calculated by
+              perturbation when the deep zoom mode is auto (see calculate_escape_deep)
+  DD_EPSILON: The relative precision of a double-double, 2^-104
+  CHECK_ERROR: The error in escape value above which a pixel counts as wrong in the precision
+              check, about a step of an 8-bit color
+  CHECK_SHARE: The share of wrong pixels allowed by the precision check for the precision
+              chosen by auto
+  AUTO_SCALE: When the depth is auto, images with a smaller scale are given DEPTH more steps
+              for every factor of ten in scale, as a deeper zoom needs more steps to resolve
+  SA_EPS:     The largest relative error allowed by the series approximation used to skip
+              the first iterations of a deep zoom
+*/
+#define   FLOAT_ULPS  4096.0
+#define   DOUBLE_ULPS 256.0
+#define   DD_ULPS     256.0
+#define   DD_EPSILON  4.93038065763132e-32
+#define   CHECK_ERROR (1.0/256)
+#define   CHECK_SHARE 0.01
+#define   SA_EPS      1E-8
+#define   AUTO_SCALE  1E-6
+
+/*
+  MAX_INT_POWER: The largest integer exponent which will use the fast integer kernel.
+                 Larger exponents fall back to the polar form used by calculate_escape
+*/
+#define   MAX_INT_POWER 64
 
 
 
@@ -28,11 +91,12 @@
   The default is for both to not be set.
 
   EIGHT_BIT: If set, the PNG file will be encoded using a 8 bit encoding for pixel color, 
-             otherwise the default is 16 bit
+             otherwise the default is 16 bit. Either can also be chosen at runtime (-d)
   BRANCH:    If set, the branch cut for the arctangent function will be from 
              (theta-pi,theta+pi) where theta is the original argument of the point. Otherwise the branch cut
              will the (b-pi,b+pi), where b is the complex portion of the 
-             exponent in the recursive fractal definition
+             exponent in the recursive fractal definition. This is the default of the
+             branch mode, which can be chosen at runtime (-C point or exponent)
 */
 #ifdef EIGHT_BIT
 #undef EIGHT_BIT
@@ -55,14 +119,86 @@
 #define   BIT_DEPTH   16
 #endif
 
+/*
+  LUT_SIZE: The number of entries in the palette lookup table for the escape values in [0,1).
+            One more entry follows for the pixels inside the set
+*/
+#define   LUT_SIZE    4096
+
+/*
+  PNG_LEVEL:  The default zlib compression level of the image data
+*/
+#define   PNG_LEVEL   6
+
 #define   COLOR_TYPE  PNG_COLOR_TYPE_RGB
 #define   INTERLACING PNG_INTERLACE_NONE
 
 
 // Define the minimum dimension allowed for a single side
 #define   MIN_DIM  100   
+// The largest width and height of a frame a worker accepts from a coordinator
+#define   MAX_DIM  65536
+// The most pixels a worker calculates for one tile, or for the band of a tile when subdividing
+#define   MAX_JOB_PIXELS (1 << 24)
+// The default size of the tiles handed to the calculating threads
+#define   TILE_W   128
+#define   TILE_H   8
+/*
+  MS_TILE:  The default size of the square tiles used by the subdivision mode, which needs
+            tiles taller than TILE_H to find large uniform rectangles
+  MS_MIN:   Rectangles with a side of no more than this many pixels are calculated in full
+            rather than split again
+  MS_GUARD: The number of times a rectangle with a uniform border is split before it is 
+            filled, when the set may not be simply connected (see subdivide_rect)
+*/
+#define   MS_TILE  64
+#define   MS_MIN   16
+#define   MS_GUARD 2
+/*
+  FRAMES_QUEUED: The number of frames of a batch which may be calculated ahead of the frame
+                 being written, each holding the rows which are still to be written
+*/
+#define   FRAMES_QUEUED 2
+/*
+  SS_MAX:       The largest grid of samples, SS_MAX x SS_MAX, taken in a refined pixel
+  SS_THRESHOLD: The default difference in escape value between neighbouring pixels above
+                which they are refined
+*/
+#define   SS_MAX        8
+#define   SS_THRESHOLD  0.02
+/*
+  WINDOW_PER_THREAD: The default number of bands per calculating thread which may be held
+                     in memory ahead of the band being written (see wait_for_window)
+*/
+#define   WINDOW_PER_THREAD 4
 // Use a seperate folder for the 
 #define   FOLDER   "./Output"
+// The escape values of earlier images are kept here, named by a hash of their parameters
+#define   CACHE_FOLDER FOLDER "/Cache"
+#define   CACHE_MAGIC  "MANDESC2"
+#define   CACHE_LAST   CACHE_FOLDER "/last"
+/*
+  PREV_ZOOM: The largest zoom in or out, as a power of two, over which the pixels of the
+             previous frame are reused
+  PREV_EPS:  The largest distance, in pixels, from the grid of the previous frame at which
+             a pixel is taken to lie on it
+*/
+#define   PREV_ZOOM    4
+#define   PREV_EPS     1E-3
+/*
+  TILE_SIZE:     The width and height of the tiles of the tile server, in pixels
+  TILE_LEFT/TOP: The upper left corner of the single tile at zoom 0
+  TILE_SPAN:     The width and height of the plane covered by the tile at zoom 0
+  TILE_MAX:      The default number of tiles kept in memory by the tile server
+  TILE_ZOOM:     The deepest zoom served, at which a tile still has an exact center
+*/
+#define   TILE_SIZE     256
+#define   TILE_LEFT     -2.5
+#define   TILE_TOP      2.0
+#define   TILE_SPAN     4.0
+#define   TILE_MAX      4096
+#define   TILE_ZOOM     48
+#define   TILE_BUCKETS  4096
 
 /*
   Define the static variables which will uniquely describe the Mandelbrot image
@@ -71,45 +207,712 @@
 static uint32_t s_width;
 static uint32_t s_height;
 static uint32_t NUM_THREADS;
+static const char *s_threads_name;
+static uint32_t s_tile_w;
+static uint32_t s_tile_h;
 static double   s_scale;
 static double   s_center_r;
 static double   s_center_i;
 static double   s_power_r;
 static double   s_power_i;
 
-// The coorinates of the upper left corner of the image
-static double   cornerR;
-static double   cornerI;
+// The center of the image in double-double precision, used for deep zooms
+static dd_t     s_center_dd_r;
+static dd_t     s_center_dd_i;
+
+// The integer exponent used by the fast kernel, along with log(s_power_n) for the smooth coloring
+static int      s_power_n;
+static double   s_log_power;
+
+/*
+  The runtime values of DEPTH, ESCAPE and MIN_R. s_depth_name is either a number or "auto",
+  which sets s_depth from the scale of each frame (see AUTO_SCALE). s_branch is set for the
+  branch cut at the argument of the point (see BRANCH), and clear for the cut at -b.
+*/
+static const char *s_depth_name;
+static int      s_depth;
+static double   s_escape;
+static double   s_min_r;
+static const char *s_branch_name;
+static int      s_branch;
+
+/*
+  The kind of kernel needed by the exponent of the frame: an integer exponent, or a complex
+  exponent with the branch cut at the argument of the point or at -b. Every kernel is 
+  built for each kind, so that the iteration loop is specialized to it (see select_kernel)
+*/
+enum kernel_kind{
+  KIND_INT,
+  KIND_POINT,
+  KIND_EXPONENT,
+  KINDS
+};
+static enum kernel_kind s_kind;
+
+/*
+  The precision tier of the kernel, chosen for each frame from the size of a pixel against
+  the coordinates of the image (-q auto), or set by the user. The float and double-double 
+  kernels are built for integer exponents only, and other exponents use the double ones. 
+  "check" renders the view with each tier and compares it to a reference in quad precision
+  (see check_precision).
+*/
+enum precision{
+  PREC_FLOAT,
+  PREC_DOUBLE,
+  PREC_DD,
+  PRECISIONS
+};
+static const char *const s_precision_names[PRECISIONS] = {"float", "double", "double-double"};
+static const char *s_precision_mode;
+static enum precision s_precision;
+
+// The escape function chosen from the exponent, one of s_escape_fns or calculate_escape_deep
+static double (*escape_fn)(double x, double y);
+
+/*
+  The number of pixels found to be inside the set by each of the early tests, rather than
+  by reaching DEPTH. Each thread counts its own pixels, which are added to s_interior as the
+  thread finishes.
+*/
+struct interior_count{
+  uint64_t cardioid; // Inside the main cardioid (a=2, b=0 only)
+  uint64_t bulb;     // Inside the period-2 bulb (a=2, b=0 only)
+  uint64_t period;   // Orbit found to be periodic
+};
+static _Thread_local struct interior_count t_interior;
+static struct interior_count s_interior;
+
+/*
+  Deep zoom (perturbation) state. s_ref holds the reference orbit, REF_STRIDE doubles for 
+  each of its s_ref_n iterations. s_sa holds the coefficients A, B and C of the series 
+  approximation at iteration s_sa_skip. Each thread counts the glitches it rebases.
+*/
+#define REF_STRIDE 5
+static const char *s_deep_mode;
+static int      s_deep;
+static double  *s_ref;
+static int      s_ref_n;
+static int      s_ref_cap;
+static int      s_sa_skip;
+static double   s_sa[6];
+static double   s_binom[MAX_INT_POWER+4];
+static _Thread_local uint64_t t_rebases;
+static uint64_t s_rebases;
+
+/*
+  Mariani-Silver subdivision state. s_ms_guard is the number of times a rectangle with a 
+  uniform border is split before it is filled. Each thread counts the pixels it fills.
+*/
+static const char *s_ms_mode;
+static int      s_ms;
+static int      s_ms_guard;
+static _Thread_local uint64_t t_filled;
+static uint64_t s_filled;
+
+/*
+  Timing of the run, in nanoseconds, and the number of iterations calculated. Each 
+  calculating thread counts its own iterations and the time it spends calculating and 
+  encoding tiles, which are added to the totals as it finishes a frame, so these are 
+  summed over the threads. The reference orbits are timed by the main thread, and the 
+  writing of the images by the output thread, not counting the time it waits for bands.
+*/
+static _Thread_local uint64_t t_iters;
+static _Thread_local uint64_t t_compute_ns;
+static _Thread_local uint64_t t_encode_ns;
+static uint64_t s_iters;
+static uint64_t s_compute_ns;
+static uint64_t s_encode_ns;
+static uint64_t s_reference_ns;
+static uint64_t s_write_ns;
+
+/*
+  The statistics of each calculating thread, kept in its own cache line of s_stats and 
+  updated only by that thread, so that no atomics are needed. The counts of the thread
+  are added to them as it finishes each frame, and they are reported once the run is over.
+  Each thread finds its own record through t_stats.
+
+  The pixels calculated are counted by how they ended: escaped, inside the set by one of 
+  the early tests (interior), fallen below MIN_R, or reaching DEPTH. The escaped pixels are
+  also counted in a histogram of their iteration count, with bin k holding the counts in
+  [2^k, 2^(k+1)).
+*/
+#define HIST_BINS 32
+struct thread_stats{
+  _Alignas(64) uint64_t tiles;
+  uint64_t tile_min_ns;
+  uint64_t tile_max_ns;
+  uint64_t compute_ns;
+  uint64_t encode_ns;
+  uint64_t iterations;
+  uint64_t steals;
+  uint64_t steal_ns;    // Looking for tiles in the deques of the other threads
+  uint64_t window_ns;   // Waiting for a band to enter the window (see wait_for_window)
+  uint64_t idle_ns;     // Waiting for the other threads to finish a frame
+  uint64_t escaped;
+  uint64_t min_r;
+  uint64_t depth;
+  struct interior_count interior;
+  uint64_t hist[HIST_BINS];
+  uint64_t *band_ns;    // The time spent on the tiles of each band, over all frames
+  int cpu;              // The CPU the thread is bound to, or -1
+  int node;
+};
+static struct thread_stats *s_stats;
+static _Thread_local struct thread_stats *t_stats;
+static const char *s_stats_mode;
+static uint64_t s_out_wait_ns;  // The time the output thread waited for bands to be encoded
+
+/*
+  The output of the run. With no output ("none") the escape values are calculated but
+  neither encoded nor written, to time the kernels alone. The timing of the run is added
+  to the file s_json_path, when given, as a line of JSON.
+*/
+static const char *s_output_mode;
+static int      s_output;
+static const char *s_json_path;
+
+/*
+  Batch rendering. The parameters of the s_frames frames are interpolated from s_first to 
+  s_last, the scale geometrically so that a zoom runs at a constant speed, and the others
+  linearly. A single image is a batch of one frame.
+*/
+struct params{
+  double scale;
+  double center_r;
+  double center_i;
+  double power_r;
+  double power_i;
+  dd_t   center_dd_r;
+  dd_t   center_dd_i;
+};
+static struct params s_first;
+static struct params s_last;
+static uint32_t s_frames;
+
+/*
+  Exponent sweeps (-e). When the frames of a batch differ only in their exponent, up to
+  s_sweep_width frames are calculated together by sweep_fn, one exponent to a lane. The
+  exponents of the s_sweep_n frames being calculated are held in s_sweep_r and s_sweep_i,
+  and each frame has its own buffer in s_sweep_out. Frames s_sweep_first up to s_sweep_end
+  are then read from these buffers, through s_sweep_in, rather than calculated. These hold
+  whole frames, so their rows are limited to SWEEP_WINDOWS times the rows of the band
+  window (-W), and frames too large for two of them are not swept.
+*/
+#define MAX_SWEEP 8
+#define SWEEP_WINDOWS 64
+static const char *s_sweep_mode;
+static int      s_sweep;
+static int      s_sweep_width;
+static int      s_sweep_n;
+static double   s_sweep_r[MAX_SWEEP];
+static double   s_sweep_i[MAX_SWEEP];
+static float   *s_sweep_out[MAX_SWEEP];
+static const float *s_sweep_in;
+static uint32_t s_sweep_first;
+static uint32_t s_sweep_end;
+static void (*sweep_fn)(int y, int x0, int n);
+
+/*
+  The frames handed to the output thread, which writes them in order. Frame f is kept in
+  s_queue[f % FRAMES_QUEUED], and is only reused once it has been written. Both counts are
+  protected by s_out_lock.
+*/
+struct frame{
+  char name[256];
+  struct band *bands;
+  atomic_uint written;  // The number of bands of the frame written to the image
+  struct tile *tile;    // The tile requested from the tile server, written to memory
+  char *png;
+  size_t png_len;
+};
+static struct frame s_queue[FRAMES_QUEUED];
+static struct frame *s_frame;    // The frame being calculated
+static uint32_t s_frames_queued;
+static uint32_t s_frames_written;
+
+/*
+  The calculating threads may not start a band more than s_window bands past the band 
+  being written, which bounds the memory held by a frame to s_window bands whatever the 
+  size of the image
+*/
+static uint32_t s_window;
+
+// The calculating threads wait at s_start for each frame, and at s_done once it is finished
+static pthread_barrier_t s_start;
+static pthread_barrier_t s_done;
+static int s_quit;
+
+/*
+  Progressive rendering. Each frame is calculated in PASSES passes into s_progress, which
+  holds the escape values of the whole frame. The first pass takes every PASS_STEP'th pixel
+  of every PASS_STEP'th row, and each pass after it halves the step, so that the last pass
+  fills in the remaining pixels. The samples of the earlier passes are kept rather than 
+  calculated again. s_pass_step is the step of the pass being calculated, or 0 once the 
+  frame is being encoded, and s_order holds the tiles of a pass in the order they are 
+  calculated, those with the most detail in the last pass first.
+*/
+#define PASSES    3
+#define PASS_STEP 4
+static const char *s_progressive_mode;
+static int      s_progressive;
+static float   *s_progress;
+static int      s_pass_step;
+static uint32_t *s_order;
+
+/*
+  Adaptive supersampling. After a band has been calculated, each pixel whose escape value
+  differs from one of its neighbours in the band by more than s_ss_threshold, or which lies
+  on the edge of the set, is sampled again at s_ss x s_ss jittered points (see refine_band).
+  It is colored with the average of the colors of those samples. Each thread counts the 
+  pixels it refines.
+*/
+static int      s_ss;
+static double   s_ss_threshold;
+static _Thread_local uint64_t t_refined;
+static uint64_t s_refined;
+
+/*
+  Zoom videos (-V). Rather than calculating every frame of the zoom, only keyframes 
+  KEY_ZOOM times apart in scale are calculated, each KEY_ZOOM times the size of a frame so
+  that it has at least one pixel for every pixel of the frames made from it. Each frame is
+  resampled from the keyframe at or above its scale, except where the finer keyframe 
+  below it covers the frame (see resample_frame). The frames are written to standard 
+  output as raw 8-bit RGB for a video encoder, and the messages to standard error. The
+  escape values of the keyframe being calculated are gathered in s_keyframe.
+*/
+#define KEY_ZOOM 2
+static const char *s_video_mode;
+static int      s_video;
+static int      s_video_fd;
+static float   *s_keyframe;
+static uint64_t s_resample_ns;
+
+/*
+  The tile server (-L). Requests for /{exp}/{z}/{x}/{y}.png are answered with tiles of
+  TILE_SIZE pixels, where the plane covered at zoom 0 is split into 2^z by 2^z tiles. Each
+  tile is calculated as a frame by the calculating threads, and written to memory by the 
+  output thread.
+
+  Every tile known to the server is held in s_tile_hash. Those which are ready are kept in
+  a list from the most to the least recently used, which is trimmed to s_tile_max tiles,
+  and those still to be rendered in a list from the newest request to the oldest, which 
+  is the order they are rendered in. A tile requested again before it is ready is shared
+  by the requests, and moved to the front. With the cache on (-c), the tiles are also 
+  kept on disk, named by a hash of the tile and the options which change its pixels. All
+  of this is protected by s_tile_lock.
+*/
+enum tile_state {TILE_WAITING, TILE_RENDERING, TILE_READY};
+struct tile{
+  char key[96];           // The exponent, zoom and position, as in the request
+  double power_r;
+  double power_i;
+  int z;
+  uint64_t x, y;
+  enum tile_state state;
+  uint64_t start;         // The time rendering began
+  int refs;               // The requests holding the tile
+  int evicted;            // Set once dropped from the cache, for the last request to free
+  unsigned char *png;
+  size_t png_len;
+  struct tile *next;      // The next tile in the same bucket of s_tile_hash
+  struct tile *newer;     // The neighbours in the list of ready or of waiting tiles
+  struct tile *older;
+};
+struct tile_list{
+  struct tile *newest;
+  struct tile *oldest;
+};
+struct tile_counts{
+  uint64_t requests;      // Tiles requested
+  uint64_t hits;          // Found ready in memory
+  uint64_t disk_hits;     // Read from the disk cache
+  uint64_t coalesced;     // Joined a request for the same tile which was not yet ready
+  uint64_t rendered;
+  uint64_t render_ns;     // From the start of rendering to the PNG image being written
+};
+static const char *s_listen;
+static uint32_t s_tile_max;
+static int      s_tile_disk;
+static struct tile *s_tile_hash[TILE_BUCKETS];
+static struct tile_list s_tile_ready;
+static struct tile_list s_tile_waiting;
+static struct tile_counts s_tile_counts;
+static uint32_t s_tiles_cached;
+static size_t   s_tile_bytes;
+static uint64_t s_serve_start;
+static pthread_mutex_t s_tile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  s_tile_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  s_tile_done = PTHREAD_COND_INITIALIZER;
+
+/*
+  Distributed rendering. A worker (-N) calculates the tiles sent to it over a socket, 
+  answering each connection on a thread of its own. The coordinator (-G) calculates no
+  tiles itself: each of its calculating threads holds a connection to one of the workers,
+  dealt out in turn, and sends the tiles it takes, with the parameters of the frame, as a
+  remote_job. The escape values come back row by row into the band, which is then encoded
+  and written as usual. A worker sets itself up for a frame once, when the first tile of 
+  the frame arrives, and reports the iterations it made for each tile.
+
+  When a worker is lost the tile in flight is sent again, and the thread connects to the
+  next worker left. Once every worker is lost the coordinator calculates the rest of the
+  tiles itself. Both ends must be the same build on machines of the same byte order.
+*/
+#define REMOTE_MAGIC   "MANDJOB2"
+#define REMOTE_TIMEOUT 60
+struct remote_job{
+  char     magic[8];
+  uint32_t width;
+  uint32_t height;
+  double   scale;
+  double   center_r;
+  double   center_i;
+  dd_t     center_dd_r;
+  dd_t     center_dd_i;
+  double   power_r;
+  double   power_i;
+  double   escape;
+  double   min_r;
+  int32_t  depth;
+  int32_t  branch;
+  int32_t  deep;
+  int32_t  ms;
+  int32_t  precision;
+  uint32_t x0;        // The tile, which is not part of the frame
+  uint32_t y0;
+  uint32_t w;
+  uint32_t h;
+};
+struct worker{
+  char addr[108];
+  atomic_int lost;
+  atomic_uint_fast64_t tiles;
+  atomic_uint_fast64_t pixels;
+  atomic_uint_fast64_t iterations;
+  atomic_uint_fast64_t busy_ns;   // Summed over the connections to the worker
+};
+static const char *s_node;
+static const char *s_workers_list;
+static struct worker *s_workers;
+static int      s_workers_n;
+static _Thread_local int t_remote_fd;
+static _Thread_local int t_remote_worker;
+static struct remote_job s_job;  // The frame a worker is set up for
+static pthread_rwlock_t s_job_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+  The escape value cache. Each file holds a cache_header followed by the escape value of
+  every pixel as a float, row by row. The file for a frame is named by a hash of its 
+  header, so a repeat render finds it without a search. On a hit the file is mapped to 
+  s_cache_in, and the escape values are read from it rather than calculated. On a miss a 
+  new file is mapped to s_cache_out, which the threads fill as they calculate their tiles.
+  The header is written, and the file renamed into place, once the frame is complete.
+
+  The name of the last file completed is kept in CACHE_LAST. On a miss that frame is also
+  mapped, to s_prev, when it was calculated with the same exponent and limits, and its 
+  pixels lie on the grid of the new frame: a pan by whole pixels, or a zoom by a power of
+  two up to 2^PREV_ZOOM. Column X of the previous frame and column x of the new frame are
+  at the same point when s_prev_ox + s_prev_a*x = s_prev_b*X, counted in steps of the 
+  finer of the two scales, and likewise for the rows. Those pixels are copied rather than
+  calculated (see reuse_tile), and each thread counts the pixels it copies.
+*/
+struct cache_header{
+  char     magic[8];
+  uint32_t width;
+  uint32_t height;
+  double   center_r[2];  // The double-double center, high and low parts
+  double   center_i[2];
+  double   scale;
+  double   power_r;
+  double   power_i;
+  double   escape;
+  double   min_r;
+  uint32_t depth;
+  uint32_t branch;
+  uint32_t filled;       // Set if the values were found by subdivision, which fills some pixels
+  uint32_t deep;         // Set if the values were found by perturbation
+  uint32_t precision;    // The precision tier of the kernel
+  uint32_t unused;
+};
+static const char *s_cache_mode;
+static int      s_cache;
+static struct cache_header s_cache_key;
+static char     s_cache_path[64];
+static char     s_cache_temp[96];
+static void    *s_cache_map;
+static size_t   s_cache_size;
+static const float *s_cache_in;
+static float   *s_cache_out;
+static const float *s_prev;
+static void    *s_prev_map;
+static size_t   s_prev_size;
+static uint32_t s_prev_w;
+static uint32_t s_prev_h;
+static int64_t  s_prev_a;
+static int64_t  s_prev_b;
+static int64_t  s_prev_ox;
+static int64_t  s_prev_oy;
+static char     s_prev_path[64];
+static _Thread_local uint64_t t_reused;
+static uint64_t s_reused;
+
+/*
+  Symmetry of the view (-Y). With no imaginary exponent the set is symmetric about the real
+  axis, so row y is the mirror of row s_sym_my-y when the view is centered on the axis.
+  An odd integer exponent also gives the set a half turn symmetry, which with the mirror
+  maps column x to column s_sym_mx-x of the same row, when the view is centered on the
+  imaginary axis. Either is -1 when the view is not. The rows s_sym_y0 on which mirrored rows are copied from are kept in
+  s_sym_rows, as their bands may already have been written, and s_sym_done flags each row
+  of each column of tiles once it is finished. Each thread counts the pixels it copies.
+*/
+static const char *s_sym_mode;
+static int      s_sym;
+static int      s_mirror;
+static int64_t  s_sym_my;
+static int64_t  s_sym_mx;
+static int64_t  s_sym_y0;
+static float   *s_sym_rows;
+static size_t   s_sym_size;
+static atomic_uchar *s_sym_done;
+static size_t   s_sym_done_n;
+static _Thread_local uint64_t t_mirrored;
+static uint64_t s_mirrored;
+
+/*
+  The palette, and the bit depth of the image. Each entry of s_lut holds the bytes of one
+  pixel, in the order they are written to the row, so that a pixel can be colored with a
+  single lookup and an 8 byte store.
+*/
+struct palette{
+  const char *name;
+  void (*color)(double v, png_bytep px);  // Writes the pixel for escape value v in [0,1)
+};
+static const char *s_palette_name;
+static uint32_t s_bit_depth;
+static uint64_t s_lut[LUT_SIZE+1];
+
+/*
+  The compression of the image. s_filter is one of the PNG filter types, or PNG_ADAPTIVE
+  to choose the filter of each row by the sum of the absolute values it gives
+*/
+#define PNG_ADAPTIVE 5
+static const char *s_filter_name;
+static int      s_filter;
+static int      s_level;
+
+// The function used to compute a span of pixels in a row, along with the name of its instruction set
+// and the name requested by the user
+static void (*span_fn)(int y, int x0, int n, int dx, int dy, float *out);
+static const char *s_kernel;
+static const char *s_kernel_name;
 
 // The pointer for the PNG image
 static png_structp png_ptr;
 
 
 
-/* 
-   This struct is a single row of the image. 
-   Use this to keep track of the rows and ensure they are printed in the correct order 
+/*
+   A band is a strip of s_tile_h rows across the image. The tiles of a band are calculated
+   independently, and once the last one has finished the band is colored, filtered and
+   compressed (see encode_band) and passed to the thread writing the image
 */
-struct row_data{
-  int row_number;
-  png_bytep vals;
+struct band{
+  float * _Atomic escapes;   // Escape values of the band, allocated by the first tile started
+  struct pool *pool;         // The pool the escape values were taken from
+  atomic_int remaining;      // Number of tiles in the band still to be calculated
+  int ready;                 // Set under s_out_lock once the compressed rows are available
+  unsigned char *idat;       // The compressed rows, a piece of the zlib stream of the image
+  size_t idat_len;
+  size_t raw_len;            // The length of the filtered rows, before compression
+  uLong adler;               // The Adler-32 checksum of the filtered rows
+  size_t idat_size;          // The size of the buffer holding the compressed rows
+  uint32_t *refined;         // The pixels of the band which were supersampled, in order
+  uint32_t refined_n;
+  float *samples;            // The s_ss*s_ss escape values of each refined pixel
 };
 
-/* 
-   This struct saves the pipes that will be used by the threads that are calculating the image
-   The first pipe is read to find the row numbers and the second is used to write the row_data
+/*
+  Buffer pools. The escape values of each band, and its compressed rows, are held in 
+  buffers taken from a pool rather than allocated for the band. The escape values are given
+  back by the thread which encodes the band, and the compressed rows by the output thread 
+  once it has written them. A pool holds buffers of a single size, each aligned to a cache
+  line, and links its free buffers through the buffers themselves. The pools are filled 
+  before the first frame with as many buffers as the window lets be in use at once, so
+  that they only grow should the compressed rows of a band not fit in s_idat_size bytes.
+
+  The rows used to encode a band, the deflate stream, and the pixels to supersample are 
+  kept by each calculating thread in t_scratch for the whole run, and grown as needed.
+  Every buffer allocated while rendering is counted in s_allocs, and s_allocs_first holds
+  the count after the first frame, so that a run shows whether the frames after it made 
+  any allocation at all (see print_stats).
+*/
+struct pool{
+  pthread_mutex_t lock;
+  void *free;
+  size_t size;
+};
+struct scratch{
+  png_bytep raw;
+  png_bytep row;
+  png_bytep prev;
+  size_t size;          // The size of raw; row and prev hold one row and 8 spare bytes
+  z_stream z;
+  int z_ready;
+  uint32_t *refined;
+  uint32_t refined_cap;
+  float *samples;
+  size_t samples_cap;
+};
+static struct pool s_idat_pool = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+static _Thread_local struct scratch t_scratch;
+static size_t   s_idat_size;
+static atomic_uint_fast64_t s_allocs;
+static uint64_t s_allocs_first;
+
+/*
+  Thread placement. With -t auto there is a calculating thread for each CPU the process may
+  run on, limited by the CPU quota of its cgroup. With pinning on (-u), the CPUs allowed to
+  the process are listed in s_cpus in the order of their NUMA node, and calculating thread
+  i is bound to the i'th of them, so that a number of threads fills one node before it 
+  spans the next. The output thread is bound to the last CPU, when that is not taken by a
+  calculating thread, to keep it apart from them. 
+  
+  The escape values of the bands are taken from a pool for each node, which the calculating
+  threads of the node fill with s_escape_fill buffers each as they start. The buffers are
+  written as they are filled, so that their pages are placed on the node by the first touch,
+  and each band gives its buffer back to the pool it came from. Without pinning every
+  thread counts as node 0.
+*/
+#define   MAX_NODES     64
+static const char *s_pin_mode;
+static int      s_pin;
+static int     *s_cpus;
+static int     *s_cpu_nodes;     // The node of each CPU of s_cpus
+static uint32_t s_cpus_n;
+static uint32_t s_nodes_n;       // The nodes spanned by the calculating threads, 0 without pinning
+static uint32_t s_escape_fill;
+static struct pool s_escape_pools[MAX_NODES];
+static _Thread_local int t_node;
+
+/*
+   The deque of tile slots owned by one calculating thread. The range [first, last) is packed
+   into a single word so that the owner and the stealing threads can both update it with a
+   compare and swap. Each deque is given its own cache line.
 */
-struct pipes{
-  int pipeRN; // Row Numbers
-  int pipeRD; // Row Data
+struct deque{
+  _Alignas(64) _Atomic uint64_t range;
 };
 
+#define PACK_RANGE(first, last) (((uint64_t)(last) << 32) | (uint32_t)(first))
+#define RANGE_FIRST(range)      ((uint32_t)(range))
+#define RANGE_LAST(range)       ((uint32_t)((range) >> 32))
+
+// The tiles of the image and the deques of the calculating threads
+static struct band  *s_bands;
+static struct deque *s_deques;
+static uint32_t s_tiles_x;
+static uint32_t s_bands_n;
+static uint32_t s_tiles_n;
+static uint32_t s_slots_per;
+
+// Used by the calculating threads to tell the output thread a band is ready
+static pthread_mutex_t s_out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  s_out_cond = PTHREAD_COND_INITIALIZER;
+
 int create_image();
-void calc_image();
-void *handle_pthread(void *ptr_pipe);
-png_bytep calculate_row(int i);
-double calculate_escape(int x, int y);
-void *handle_output(void *row_data_pipe);
+static int start_threads(pthread_t *threads, int *index);
+static int serve_tiles();
+static int open_listener(const char *addr);
+static int run_worker();
+void *handle_worker(void *ptr_fd);
+static void setup_job(const struct remote_job *job);
+static int parse_workers(const char *list);
+static void remote_tile(float *escapes, int y0, int x0, int w, int h);
+static int connect_worker(const char *addr);
+static int send_all(int fd, const void *buf, size_t len);
+static int recv_all(int fd, void *buf, size_t len);
+static void print_workers(double seconds);
+void *handle_accept(void *ptr_fd);
+void *handle_client(void *ptr_fd);
+static void serve_path(int fd, const char *path, int keep);
+static int parse_tile(const char *path, struct tile *t);
+static struct tile *request_tile(const struct tile *req);
+static void release_tile(struct tile *t);
+static void finish_tile(struct frame *frame);
+static void trim_tiles();
+static void tile_file(const struct tile *t, char *path, size_t size);
+static int read_tile(const struct tile *t, unsigned char **png, size_t *len);
+static void send_response(int fd, const char *status, const char *type, const void *body,
+                          size_t len, int keep);
+static int create_video();
+static void render_keyframe(uint32_t k, png_bytep rgb);
+static void resample_frame(png_bytep out, uint32_t width, uint32_t height, double scale,
+                           png_const_bytep coarse, png_const_bytep fine, double key_scale);
+static inline int sample_keyframe(png_const_bytep key, double x, double y, int clamp, double *rgb);
+static void write_video(const png_byte *buf, size_t len);
+static void set_frame(uint32_t f);
+static int setup_frame();
+static void sweep_frames(uint32_t f);
+static void calculate_sweep_tile(int tile);
+void calc_image(struct frame *frame);
+void *handle_pthread(void *ptr_index);
+static int tile_of_slot(uint32_t slot);
+static int next_tile(int self);
+static void calculate_tile(int tile);
+static void calculate_passes(struct frame *frame, uint64_t start);
+static void order_tiles(int step);
+static void calculate_pass_tile(int tile);
+static void write_preview(struct frame *frame, int step, uint64_t start);
+static void run_tiles();
+static void wait_for_window(uint32_t b);
+static void subdivide_tile(float *escapes, int y0, int x0, int w, int h);
+static void subdivide_rect(float *escapes, int y0, int xa, int ya, int xb, int yb, int level);
+static int escape_band(double v);
+static void (*color_row)(const float *escapes, uint32_t n, png_bytep vals);
+static void color_row_8(const float *escapes, uint32_t n, png_bytep vals);
+static void color_row_16(const float *escapes, uint32_t n, png_bytep vals);
+static void encode_band(struct band *band, const float *escapes, uint32_t b, uint32_t h);
+static void refine_band(struct band *band, const float *escapes, uint32_t b, uint32_t h);
+static void *pool_get(struct pool *pool, size_t size);
+static void pool_put(struct pool *pool, void *buf);
+static void pool_fill(struct pool *pool, size_t size, uint32_t n);
+static void pool_free(struct pool *pool);
+static void *grow(void *buf, size_t size);
+static void free_scratch();
+static uint32_t count_cpus();
+static int find_cpus();
+static int parse_cpulist(const char *list, cpu_set_t *set);
+static void place_thread(int self);
+static void color_samples(const float *samples, png_bytep px);
+static uint64_t filter_row(png_const_bytep row, png_const_bytep prev, png_bytep out, int type);
+static int build_palette(const char *name);
+static void palette_classic(double v, png_bytep px);
+static void palette_gray(double v, png_bytep px);
+static void palette_fire(double v, png_bytep px);
+double calculate_escape_point(double x, double y);
+double calculate_escape_exponent(double x, double y);
+double calculate_escape_int(double x, double y);
+double calculate_escape_deep(double x, double y);
+double calculate_escape_dd(double x, double y);
+static double calculate_escape_quad(double x, double y);
+static int check_precision();
+static void build_reference();
+static void open_cache();
+static void open_previous();
+static void reuse_tile(float *escapes, int y0, int x0, int w, int h);
+static void find_symmetry();
+static int mirror_tile(float *escapes, int y0, int x0, int w, int h, int partial);
+static void keep_rows(const float *escapes, int y0, int x0, int w, int h);
+static void close_cache();
+static double escape_value(int i, double rsq, double log_p);
+static void calculate_span_scalar(int y, int x0, int n, int dx, int dy, float *out);
+static int select_kernel(const char *name);
+void *handle_output(void *unused);
+static void write_frame(struct frame *frame);
+static void discard_frame(struct frame *frame);
+static void write_json(double seconds);
+static void print_stats(double seconds);
+static uint64_t clock_ns();
+static inline void count_escape(int i);
 
 void   _abort(const char * s, ...);
 double _absolute(double d);
@@ -129,11 +932,52 @@ int main(int argc, char **argv){
   s_power_r = 2.0; // a
   s_power_i = 0.0; // b
 
-  NUM_THREADS = 4; // t
+  s_threads_name = "auto"; // t
+  s_pin_mode = "off"; // u
+  s_tile_w = TILE_W; // T
+  s_tile_h = TILE_H; // T
+  s_kernel_name = "auto"; // k
+  s_deep_mode = "auto"; // z
+  s_precision_mode = "auto"; // q
+  s_ms_mode = "off"; // m
+  s_sym_mode = "on"; // Y
+  s_frames = 1; // n
+  s_sweep_mode = "on"; // e
+  s_cache_mode = "off"; // c
+  s_palette_name = "classic"; // p
+  s_bit_depth = BIT_DEPTH; // d
+  s_window = 0; // W (0 picks WINDOW_PER_THREAD bands per thread)
+  s_level = PNG_LEVEL; // Z
+  s_filter_name = "adaptive"; // F
+  s_output_mode = "png"; // o
+  s_json_path = NULL; // j
+  s_stats_mode = "off"; // v
+  s_progressive_mode = "off"; // P
+  s_ss = 0; // x
+  s_ss_threshold = SS_THRESHOLD; // X
+  s_listen = NULL; // L
+  s_tile_max = TILE_MAX; // K
+  s_node = NULL; // N
+  s_workers_list = NULL; // G
+  s_video_mode = "off"; // V
+  s_depth_name = NULL; // D (DEPTH)
+  s_escape = ESCAPE; // E
+  s_min_r = MIN_R; // M
+#ifdef BRANCH
+  s_branch_name = "point"; // C
+#else
+  s_branch_name = "exponent"; // C
+#endif
+  s_center_dd_r = dd_from(s_center_r);
+  s_center_dd_i = dd_from(s_center_i);
+
+  // The end of each parameter in a batch, which defaults to its start (R, I, S, A, B)
+  s_last.scale = s_last.center_r = s_last.center_i = s_last.power_r = s_last.power_i = NAN;
 
   // Collect Command Line arguments
-  int opt;
-  while((opt=getopt(argc, argv, "w:h:s:r:i:a:b:t:")) != -1){
+  int opt, i, tile_set = 0;
+  long depth;
+  while((opt=getopt(argc, argv, "w:h:s:r:i:a:b:t:k:T:z:m:n:R:I:S:A:B:c:p:d:W:Z:F:o:j:v:D:E:M:C:P:x:X:L:K:V:N:G:u:q:Y:e:")) != -1){
     if (optarg == NULL){
       printf("Optarg is null!!");
       return -1;
@@ -143,559 +987,5621 @@ int main(int argc, char **argv){
       break;
     case 'h': s_height=(uint32_t)strtoul(optarg, NULL, 0);
       break;
-    case 't': NUM_THREADS=(uint32_t)strtoul(optarg, NULL, 0);
+    case 't': s_threads_name=optarg;
+      break;
+    case 'u': s_pin_mode=optarg;
       break;
     case 's': s_scale=strtod(optarg,(char **) NULL);
       break;
     case 'r': s_center_r=strtod(optarg,(char **) NULL);
+      s_center_dd_r=dd_parse(optarg);
       break;
     case 'i': s_center_i=strtod(optarg,(char **) NULL);
+      s_center_dd_i=dd_parse(optarg);
       break;
     case 'a': s_power_r=strtod(optarg,(char **) NULL);
       break;
     case 'b': s_power_i=strtod(optarg,(char **) NULL);
       break;
+    case 'k': s_kernel_name=optarg;
+      break;
+    case 'z': s_deep_mode=optarg;
+      break;
+    case 'q': s_precision_mode=optarg;
+      break;
+    case 'm': s_ms_mode=optarg;
+      break;
+    case 'Y': s_sym_mode=optarg;
+      break;
+    case 'n': s_frames=(uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'e': s_sweep_mode=optarg;
+      break;
+    case 'c': s_cache_mode=optarg;
+      break;
+    case 'p': s_palette_name=optarg;
+      break;
+    case 'd': s_bit_depth=(uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'W': s_window=(uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'Z': s_level=(int)strtol(optarg, NULL, 0);
+      break;
+    case 'F': s_filter_name=optarg;
+      break;
+    case 'o': s_output_mode=optarg;
+      break;
+    case 'j': s_json_path=optarg;
+      break;
+    case 'v': s_stats_mode=optarg;
+      break;
+    case 'D': s_depth_name=optarg;
+      break;
+    case 'E': s_escape=strtod(optarg,(char **) NULL);
+      break;
+    case 'M': s_min_r=strtod(optarg,(char **) NULL);
+      break;
+    case 'C': s_branch_name=optarg;
+      break;
+    case 'P': s_progressive_mode=optarg;
+      break;
+    case 'x': s_ss=(int)strtol(optarg,(char **) NULL, 0);
+      break;
+    case 'X': s_ss_threshold=strtod(optarg,(char **) NULL);
+      break;
+    case 'L': s_listen=optarg;
+      break;
+    case 'K': s_tile_max=(uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'V': s_video_mode=optarg;
+      break;
+    case 'N': s_node=optarg;
+      break;
+    case 'G': s_workers_list=optarg;
+      break;
+    case 'S': s_last.scale=strtod(optarg,(char **) NULL);
+      break;
+    case 'R': s_last.center_r=strtod(optarg,(char **) NULL);
+      s_last.center_dd_r=dd_parse(optarg);
+      break;
+    case 'I': s_last.center_i=strtod(optarg,(char **) NULL);
+      s_last.center_dd_i=dd_parse(optarg);
+      break;
+    case 'A': s_last.power_r=strtod(optarg,(char **) NULL);
+      break;
+    case 'B': s_last.power_i=strtod(optarg,(char **) NULL);
+      break;
+    case 'T': if (sscanf(optarg, "%ux%u", &s_tile_w, &s_tile_h) != 2){
+        printf("Tile size must be given as WxH: %s\n", optarg);
+        return -1;
+      }
+      tile_set = 1;
+      break;
     default: printf("Bad user argument: %c", (char) opt);
       break;
     }
   }
 
+  // The tile server renders square tiles of a fixed size
+  if (s_listen != NULL)
+    s_width = s_height = TILE_SIZE;
+
   // Test the parameters passed through the command line to confirm 
   // that the height and width are within the desired range
   if((s_width < MIN_DIM) || (s_height < MIN_DIM)){
     printf("Dimensions are too small: %d x %d\nMin: %d\n", s_width, s_height, MIN_DIM);
     return -1;
   }
-
-  // Now that the parameters of the set have been determined, create the fractal
-  return create_image();
-}
-
-
-/* 
-   This function will create the PNG image which is used to store the Mandelbrot set.  
-   After creating the empty PNG image, it will call the function calc_image to calculate the 
-   fractal. After the image has been calculated the PNG image is ended.
-
-   Input:
-              None
-   Output:    
-              Returns 0 on success and -1 on failure
-*/
-
-int create_image(){
-  png_FILE_p fp;
-  png_infop info_ptr;
-  char *name;
-  int saveError;
-
-
-  saveError = errno;
-  mkdir(FOLDER,
-        S_IRUSR|S_IWUSR|S_IXUSR|
-        S_IRGRP|S_IWGRP|S_IXGRP|
-        S_IROTH|S_IWOTH|S_IXOTH  );
-
-  errno = saveError;
-
-
-  // Create a filename based on the parameters given by the user
-  // Uniquely describes a Mandelbrot image (within the accuracy of the printed values)
-  if ((name = (char *)malloc(200*sizeof(char))) == NULL){
-    printf("Error allocating memory for image name!\n");
+  if (strcmp(s_threads_name, "auto") == 0)
+    NUM_THREADS = count_cpus();
+  else
+    NUM_THREADS = (uint32_t)strtoul(s_threads_name, NULL, 0);
+  if((NUM_THREADS < 1) || (s_tile_w < 1) || (s_tile_h < 1)){
+    printf("The number of threads and the tile size must be at least one\n");
     return -1;
   }
-#ifdef BRANCH
-  sprintf(name, "%s/Dimension: %dx%d, Center: %.4f%+.4fi, Scale: %.2e, Exp: %0.2e+%0.2ei, Branch set.png", 
-          FOLDER, s_width, s_height, s_center_r, s_center_i, s_scale, s_power_r, s_power_i);
-#else
-  sprintf(name, "%s/Dimension: %dx%d, Center: %.4f%+.4fi, Scale: %.2e, Exp: %0.2e+%0.2ei, Branch not set.png", 
-          FOLDER, s_width, s_height, s_center_r, s_center_i, s_scale, s_power_r, s_power_i);
-#endif
 
-  printf("Output Filename: %s\n", name);
-
-  if((fp = (png_FILE_p) fopen(name,"wb"))==NULL){
-    printf("File error creating file: %s\n", name);
+  if(s_frames < 1){
+    printf("The number of frames must be at least one\n");
     return -1;
   }
-
-  free(name);
-
-  // Initialize the PNG file which will hold the Mandelbrot image
-  if (!(png_ptr=png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp) NULL, (png_error_ptr) NULL, (png_error_ptr) NULL))) {
-    printf("Oh No!!! Bad pointer png_ptr\n");
+  if ((strcmp(s_deep_mode, "auto") != 0) && (strcmp(s_deep_mode, "on") != 0) &&
+      (strcmp(s_deep_mode, "off") != 0)){
+    printf("Deep zoom mode must be auto, on or off: %s\n", s_deep_mode);
     return -1;
   }
-  if (!(info_ptr=png_create_info_struct(png_ptr))) {
-    printf("Oh No!!! Bad pointer png_infop\n");
+  for (i=0; (i < PRECISIONS) && (strcmp(s_precision_mode, s_precision_names[i]) != 0); i++);
+  if ((i == PRECISIONS) && (strcmp(s_precision_mode, "auto") != 0) &&
+      (strcmp(s_precision_mode, "check") != 0)){
+    printf("Precision must be auto, float, double, double-double or check: %s\n", s_precision_mode);
     return -1;
   }
-  if (setjmp(png_jmpbuf(png_ptr)))
-    _abort("[write_png_file] Error during init_io");
-  png_init_io(png_ptr,fp);
-  if (setjmp(png_jmpbuf(png_ptr)))
-    _abort("[write_png_file] Error during set IHDR");
-  // Set the type of png file based on the defaults, the specified size, and bit depth
-  png_set_IHDR(png_ptr, info_ptr, s_width, s_height,
-               BIT_DEPTH, COLOR_TYPE, INTERLACING,
-               PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-  if (setjmp(png_jmpbuf(png_ptr)))
-    _abort("[write_png_file] Error during write info");
-  png_write_info(png_ptr,info_ptr);
-
-  // Capture the data required for the image
-  calc_image();
-
-  // Write the end of file for the PNG image
-  if (setjmp(png_jmpbuf(png_ptr)))
-    _abort("[write_png_file] Error during ending");
-  png_write_end(png_ptr,info_ptr);
-
-  // Close the file
-  fclose((FILE *) fp);
-  // Return zero on proper exit
-  return 0;
-}
-
-
-/*
-  Function: calc_image
-
-  Creates the threads which will calculate the fractal for each row 
-  and the thread which uses those values to write a row to the PNG
-
-  Input:
-          None
-  Output:
-          None (PNG data is computed during this time)
-*/
-void calc_image(){
-  pthread_t threads[NUM_THREADS+1];
-  int i, j;
-  int pipeRows[2], pipeRet[2];
-
-  struct pipes pipefd;
-
-  // Find the upper lefthand corner of the image
-  cornerR = s_center_r-s_scale*s_width/2;
-  cornerI = s_center_i+s_scale*s_height/2;
-
-  // Create a pipe to pass information to the pthreads
-  if(pipe(pipeRows) != 0) {
-    printf("Error Making Pipes!\n");
-    exit(-1);
+  if ((strcmp(s_ms_mode, "on") != 0) && (strcmp(s_ms_mode, "off") != 0)){
+    printf("Subdivision mode must be on or off: %s\n", s_ms_mode);
+    return -1;
   }
-  // Create a pipe to return the row data from the pthreads
-  if(pipe(pipeRet) != 0) {
-    printf("Error Making Pipes!\n");
-    exit(-1);
+  s_ms = (strcmp(s_ms_mode, "on") == 0);
+  if ((strcmp(s_sym_mode, "on") != 0) && (strcmp(s_sym_mode, "off") != 0)){
+    printf("Symmetry mode must be on or off: %s\n", s_sym_mode);
+    return -1;
   }
-  // Create the thread which will print the row data to the image
-  if(pthread_create(&threads[NUM_THREADS],NULL,handle_output,&(pipeRet[0])) != 0){
-    printf("thread Error!\n");
-    _exit(-1);
+  s_sym = (strcmp(s_sym_mode, "on") == 0);
+  if ((strcmp(s_sweep_mode, "on") != 0) && (strcmp(s_sweep_mode, "off") != 0)){
+    printf("Sweep mode must be on or off: %s\n", s_sweep_mode);
+    return -1;
+  }
+  if ((strcmp(s_cache_mode, "on") != 0) && (strcmp(s_cache_mode, "off") != 0)){
+    printf("Cache mode must be on or off: %s\n", s_cache_mode);
+    return -1;
+  }
+  s_cache = (strcmp(s_cache_mode, "on") == 0);
+  if ((strcmp(s_output_mode, "png") != 0) && (strcmp(s_output_mode, "none") != 0)){
+    printf("Output must be png or none: %s\n", s_output_mode);
+    return -1;
+  }
+  s_output = (strcmp(s_output_mode, "png") == 0);
+  if ((strcmp(s_stats_mode, "off") != 0) && (strcmp(s_stats_mode, "summary") != 0) &&
+      (strcmp(s_stats_mode, "json") != 0)){
+    printf("Statistics must be off, summary or json: %s\n", s_stats_mode);
+    return -1;
+  }
+  if ((strcmp(s_video_mode, "on") != 0) && (strcmp(s_video_mode, "off") != 0)){
+    printf("Video mode must be on or off: %s\n", s_video_mode);
+    return -1;
+  }
+  s_video = (strcmp(s_video_mode, "on") == 0);
+  if ((strcmp(s_pin_mode, "on") != 0) && (strcmp(s_pin_mode, "off") != 0)){
+    printf("Pinning must be on or off: %s\n", s_pin_mode);
+    return -1;
+  }
+  s_pin = (strcmp(s_pin_mode, "on") == 0);
+  if (s_pin && (find_cpus() != 0))
+    return -1;
+
+  // The frames of a video are always 8-bit RGB
+  if (s_video)
+    s_bit_depth = 8;
+  if ((s_bit_depth != 8) && (s_bit_depth != 16)){
+    printf("The bit depth must be 8 or 16: %u\n", s_bit_depth);
+    return -1;
+  }
+  color_row = (s_bit_depth == 8) ? color_row_8 : color_row_16;
+  s_depth = DEPTH;
+  if ((s_depth_name != NULL) && (strcmp(s_depth_name, "auto") != 0)){
+    depth = strtol(s_depth_name, NULL, 0);
+    if ((depth < 1) || (depth > MAX_DEPTH)){
+      printf("The depth must be auto or from 1 to %d: %s\n", MAX_DEPTH, s_depth_name);
+      return -1;
+    }
+    s_depth = (int) depth;
+  }
+  if ((s_escape <= 4.0) || (s_min_r < 0.0) || (s_min_r >= s_escape)){
+    printf("The escape value must be more than 4, and the minimum from 0 to the escape value\n");
+    return -1;
+  }
+  if ((strcmp(s_branch_name, "point") != 0) && (strcmp(s_branch_name, "exponent") != 0)){
+    printf("Branch mode must be point or exponent: %s\n", s_branch_name);
+    return -1;
+  }
+  s_branch = (strcmp(s_branch_name, "point") == 0);
+  if ((strcmp(s_progressive_mode, "on") != 0) && (strcmp(s_progressive_mode, "off") != 0)){
+    printf("Progressive mode must be on or off: %s\n", s_progressive_mode);
+    return -1;
+  }
+  s_progressive = (strcmp(s_progressive_mode, "on") == 0);
+  if ((s_ss < 0) || (s_ss == 1) || (s_ss > SS_MAX) || (s_ss_threshold <= 0.0)){
+    printf("Supersampling must be 0 (off) or a grid from 2 to %d, with a positive threshold\n", SS_MAX);
+    return -1;
+  }
+  if ((s_level < 0) || (s_level > 9)){
+    printf("The compression level must be from 0 to 9: %d\n", s_level);
+    return -1;
+  }
+  for (s_filter=0; s_filter <= PNG_ADAPTIVE; s_filter++){
+    static const char *filters[] = {"none", "sub", "up", "avg", "paeth", "adaptive"};
+    if (strcmp(s_filter_name, filters[s_filter]) == 0)
+      break;
+  }
+  if (s_filter > PNG_ADAPTIVE){
+    printf("Unknown filter: %s\n", s_filter_name);
+    return -1;
+  }
+  if (build_palette(s_palette_name) != 0){
+    printf("Unknown palette: %s\n", s_palette_name);
+    return -1;
+  }
+  if (s_ms && !tile_set)
+    s_tile_w = s_tile_h = MS_TILE;
+  if (s_window == 0)
+    s_window = WINDOW_PER_THREAD*NUM_THREADS;
+
+  // A worker takes the parameters of each frame from the coordinator
+  if (s_node != NULL)
+    return run_worker();
+  if (s_workers_list != NULL){
+    if (s_progressive){
+      printf("Distributed rendering can not be combined with progressive rendering\n");
+      return -1;
+    }
+    if (parse_workers(s_workers_list) != 0)
+      return -1;
+  }
+
+  /*
+    The tile server sets the parameters of each tile itself. Its tiles are always written
+    to memory, and with the cache on they are kept on disk as PNG images rather than as
+    escape values
+  */
+  if (s_listen != NULL){
+    if (!s_output || s_progressive || (s_tile_max < 1)){
+      printf("The tile server needs PNG output, no progressive rendering, and a cache of at least one tile\n");
+      return -1;
+    }
+    s_tile_disk = s_cache;
+    s_cache = 0;
+    return serve_tiles();
+  }
+
+  // The parameters of the first frame, and of the last frame where they have been given
+  s_first = (struct params){s_scale, s_center_r, s_center_i, s_power_r, s_power_i,
+                            s_center_dd_r, s_center_dd_i};
+  if (isnan(s_last.scale))
+    s_last.scale = s_first.scale;
+  if (isnan(s_last.center_r)){
+    s_last.center_r = s_first.center_r;
+    s_last.center_dd_r = s_first.center_dd_r;
+  }
+  if (isnan(s_last.center_i)){
+    s_last.center_i = s_first.center_i;
+    s_last.center_dd_i = s_first.center_dd_i;
+  }
+  if (isnan(s_last.power_r))
+    s_last.power_r = s_first.power_r;
+  if (isnan(s_last.power_i))
+    s_last.power_i = s_first.power_i;
+  if ((s_first.scale <= 0.0) || (s_last.scale <= 0.0)){
+    printf("The scale must be positive\n");
+    return -1;
+  }
+
+  /*
+    Only a batch with a fixed view can be swept, and only when every frame is calculated 
+    whole on these threads: not read from the cache, in passes, subdivided or by workers
+  */
+  s_sweep = (strcmp(s_sweep_mode, "on") == 0) && (s_frames > 1) &&
+            (s_last.scale == s_first.scale) && (s_last.center_r == s_first.center_r) &&
+            (s_last.center_i == s_first.center_i) && !s_cache && !s_progressive && !s_ms &&
+            (s_workers_n == 0);
+
+  /*
+    A zoom video keeps the center and exponent, so that each keyframe holds the ones after
+    it. Standard output is kept for the frames, and the messages are sent to standard error
+  */
+  if (s_video){
+    if ((s_last.scale > s_first.scale) || (s_last.center_r != s_first.center_r) ||
+        (s_last.center_i != s_first.center_i) || (s_last.power_r != s_first.power_r) ||
+        (s_last.power_i != s_first.power_i) || s_progressive || s_ss){
+      printf("A zoom video needs a fixed center and exponent, a scale which does not grow, and no progressive rendering or supersampling\n");
+      return -1;
+    }
+    if (isatty(STDOUT_FILENO)){
+      printf("The frames of a zoom video are written to standard output, which should be piped to a video encoder\n");
+      return -1;
+    }
+    fflush(stdout);
+    s_video_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+  }
+
+  // Set up the first frame here, so that a bad kernel is reported before any file is made
+  set_frame(0);
+  if (setup_frame() != 0)
+    return -1;
+
+  if (strcmp(s_precision_mode, "check") == 0)
+    return check_precision();
+
+  // Now that the parameters of the set have been determined, create the fractal
+  return s_video ? create_video() : create_image();
+}
+
+
+/*
+  Function: set_frame
+
+  Sets the scale, center and exponent of frame f of the batch, interpolating between the 
+  first and last frames. The scale is interpolated geometrically. When the scale changes,
+  the center moves in proportion to the change in scale rather than to f, so that the
+  center of the last frame stays at the same place in each image during a zoom.
+
+  Input: 
+        uint32_t f: the frame number, from 0 to s_frames-1
+  Output:
+        None
+*/
+static void set_frame(uint32_t f){
+  double t, c;
+
+  t = (s_frames > 1) ? (double) f/(s_frames-1) : 0.0;
+
+  s_scale = s_first.scale*pow(s_last.scale/s_first.scale, t);
+  c = (s_first.scale != s_last.scale) ? (s_first.scale-s_scale)/(s_first.scale-s_last.scale) : t;
+  if ((f > 0) && (f == s_frames-1))
+    s_scale = s_last.scale, c = 1.0;
+
+  s_power_r = s_first.power_r + (s_last.power_r-s_first.power_r)*t;
+  s_power_i = s_first.power_i + (s_last.power_i-s_first.power_i)*t;
+  s_center_r = s_first.center_r + (s_last.center_r-s_first.center_r)*c;
+  s_center_i = s_first.center_i + (s_last.center_i-s_first.center_i)*c;
+  s_center_dd_r = dd_add(s_first.center_dd_r,
+                         dd_mul_d(dd_sub(s_last.center_dd_r, s_first.center_dd_r), c));
+  s_center_dd_i = dd_add(s_first.center_dd_i,
+                         dd_mul_d(dd_sub(s_last.center_dd_i, s_first.center_dd_i), c));
+}
+
+
+/*
+  Function: int_power
+
+  Finds whether the exponent of the frame is an integer the fast kernel can raise points
+  to, a real number from 2 to MAX_INT_POWER.
+
+  Input: 
+        None
+  Output:
+        Returns the exponent as an int, or 0 if the fast kernel can not be used
+*/
+static int int_power(){
+  if ((s_power_i == 0.0) && (s_power_r == floor(s_power_r)) && 
+      (s_power_r >= 2.0) && (s_power_r <= MAX_INT_POWER))
+    return (int) s_power_r;
+  return 0;
+}
+
+
+/*
+  Function: setup_frame
+
+  Chooses the escape function and kernel for the parameters of the current frame, as these
+  can change during a batch, and the depth when it is auto.
+
+  Input: 
+        None
+  Output:
+        Returns 0 on success and -1 if the requested kernel can not be used
+*/
+static int setup_frame(){
+  /*
+    Choose the escape function. Integer exponents with no imaginary component can be 
+    computed with plain complex multiplication, which avoids the transcendental 
+    functions required by the polar form
+  */
+  static double (*const escape_fns[KINDS])(double x, double y) = {
+    calculate_escape_int, calculate_escape_point, calculate_escape_exponent
+  };
+  // The smallest scale each precision can calculate, relative to the largest coordinate
+  static const double reach[PRECISIONS] = {
+    FLOAT_ULPS*FLT_EPSILON, DOUBLE_ULPS*DBL_EPSILON, DD_ULPS*DD_EPSILON
+  };
+  double mag;
+  int p;
+
+  s_kind = s_branch ? KIND_POINT : KIND_EXPONENT;
+  s_power_n = int_power();
+  if (s_power_n != 0)
+    s_kind = KIND_INT;
+  s_log_power = log(s_power_r);
+  escape_fn = escape_fns[s_kind];
+
+  // Deeper zooms need more steps, when the depth is auto
+  if ((s_depth_name != NULL) && (strcmp(s_depth_name, "auto") == 0))
+    s_depth = DEPTH*(1 + (int) fmax(0.0, floor(log10(AUTO_SCALE/s_scale))));
+
+  /*
+    Choose the precision from the number of ulps of the largest coordinate of the image 
+    spanned by a pixel, unless the user requested one. Only integer exponents have the 
+    float and double-double kernels. The float kernel gains too little over the double one,
+    and changes too many pixels, for auto to pick it. A view beyond the reach of the 
+    precision chosen, or requested, is calculated by perturbation, when the deep zoom mode
+    is auto
+  */
+  mag = fmax(2.0, fmax(fabs(s_center_r) + 0.5*s_scale*s_width,
+                       fabs(s_center_i) + 0.5*s_scale*s_height));
+  for (p=0; (p < PRECISIONS) && (strcmp(s_precision_mode, s_precision_names[p]) != 0); p++);
+  if (p == PRECISIONS){
+    if (s_scale >= reach[PREC_DOUBLE]*mag)
+      p = PREC_DOUBLE;
+    else
+      p = PREC_DD;
+  }
+  s_precision = (s_kind == KIND_INT) ? (enum precision) p : PREC_DOUBLE;
+  s_deep = (s_scale < reach[s_precision]*mag);
+  if (s_precision == PREC_DD)
+    escape_fn = calculate_escape_dd;
+
+  // Choose the widest vector kernel supported by this CPU, unless the user requested one
+  if (select_kernel(s_kernel_name) != 0){
+    printf("Unknown or unsupported kernel: %s\n", s_kernel_name);
+    return -1;
+  }
+
+  // Deep zooms are beyond the precision of a double-double, so use perturbation instead
+  if (strcmp(s_deep_mode, "auto") != 0)
+    s_deep = (strcmp(s_deep_mode, "on") == 0);
+  if (s_deep){
+    escape_fn = calculate_escape_deep;
+    span_fn = calculate_span_scalar;
+    s_kernel = "perturbation";
+    s_precision = PREC_DOUBLE;
+  }
+  if (s_listen == NULL){
+    if (s_deep)
+      printf("Kernel: %s, depth %d\n", s_kernel, s_depth);
+    else
+      printf("Kernel: %s, %s precision, depth %d\n", s_kernel, s_precision_names[s_precision], s_depth);
+  }
+
+  /*
+    Mariani-Silver subdivision fills rectangles whose borders are uniform. The sets with an 
+    integer exponent are connected, so the lines through the center of a rectangle guard
+    against a rectangle holding the whole set. Other exponents can give sets which are not 
+    simply connected, so the lines through the quarters of the rectangle must also agree
+  */
+  s_ms_guard = (s_power_n != 0) ? 1 : MS_GUARD;
+  return 0;
+}
+
+
+/* 
+   This function renders the frames of the batch, each to its own PNG image. The threads 
+   which calculate the tiles, and the thread which writes the images, are created once 
+   for the whole batch. Each frame is set up and calculated by calc_image while the output
+   thread is still writing the frames before it, so the calculation of one frame overlaps
+   the encoding of the last. Once every frame has been written, the number of frames per
+   second is reported.
+
+   Input:
+              None
+   Output:    
+              Returns 0 on success and -1 on failure
+*/
+
+int create_image(){
+  pthread_t threads[NUM_THREADS+1];
+  int index[NUM_THREADS];
+  struct timespec start, end;
+  struct frame *frame;
+  double seconds;
+  uint32_t f;
+  int i, saveError;
+
+
+  saveError = errno;
+  mkdir(FOLDER,
+        S_IRUSR|S_IWUSR|S_IXUSR|
+        S_IRGRP|S_IWGRP|S_IXGRP|
+        S_IROTH|S_IWOTH|S_IXOTH  );
+
+  if (s_cache)
+    mkdir(CACHE_FOLDER,
+          S_IRUSR|S_IWUSR|S_IXUSR|
+          S_IRGRP|S_IWGRP|S_IXGRP|
+          S_IROTH|S_IWOTH|S_IXOTH  );
+
+  errno = saveError;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (start_threads(threads, index) != 0)
+    return -1;
+
+  for (f=0; f < s_frames; f++){
+    // The first frame has already been set up by main
+    if (f > 0){
+      set_frame(f);
+      if (setup_frame() != 0)
+        _exit(-1);
+    }
+
+    // The first frame past the last sweep starts the next, if it can be swept
+    if (s_sweep && (f >= s_sweep_end))
+      sweep_frames(f);
+    s_sweep_in = (f < s_sweep_end) ? s_sweep_out[f-s_sweep_first] : NULL;
+
+    // Wait for the output thread to finish with the frame which used this place in the queue
+    pthread_mutex_lock(&s_out_lock);
+    while (f - s_frames_written >= FRAMES_QUEUED)
+      pthread_cond_wait(&s_out_cond, &s_out_lock);
+    pthread_mutex_unlock(&s_out_lock);
+    frame = &s_queue[f % FRAMES_QUEUED];
+
+    // Create a filename based on the parameters given by the user
+    // Uniquely describes a Mandelbrot image (within the accuracy of the printed values)
+    // The frames of a batch are also numbered, so that they sort in order
+    if (s_frames > 1)
+      i = snprintf(frame->name, sizeof(frame->name), "%s/Frame %05u, ", FOLDER, f);
+    else
+      i = snprintf(frame->name, sizeof(frame->name), "%s/", FOLDER);
+    snprintf(frame->name+i, sizeof(frame->name)-i, "Dimension: %dx%d, Center: %.4f%+.4fi, Scale: %.2e, Exp: %0.2e+%0.2ei, Branch %s.png", 
+             s_width, s_height, s_center_r, s_center_i, s_scale, s_power_r, s_power_i,
+             s_branch ? "set" : "not set");
+
+    printf("Output Filename: %s\n", frame->name);
+
+    // Capture the data required for the image
+    calc_image(frame);
+
+    if (s_cache_in != NULL)
+      printf("Escape values read from the cache: %s\n", s_cache_path);
+    else if (s_sweep_in != NULL)
+      printf("Escape values calculated with frames %u to %u, one exponent to a lane\n",
+             s_sweep_first, s_sweep_end-1);
+    else
+      printf("Interior pixels found early: %llu cardioid, %llu bulb, %llu periodic\n",
+             (unsigned long long) s_interior.cardioid, (unsigned long long) s_interior.bulb,
+             (unsigned long long) s_interior.period);
+    if (s_ms && (s_cache_in == NULL))
+      printf("Subdivision: %llu of %llu pixels filled\n", (unsigned long long) s_filled,
+             (unsigned long long) s_width*s_height);
+    if (s_prev != NULL)
+      printf("Reused %llu of %llu pixels from the previous frame: %s\n",
+             (unsigned long long) s_reused, (unsigned long long) s_width*s_height, s_prev_path);
+    if (s_mirror)
+      printf("Symmetry: %llu of %llu pixels copied from their mirror\n",
+             (unsigned long long) s_mirrored, (unsigned long long) s_width*s_height);
+    if (s_ss)
+      printf("Supersampling: %llu of %llu pixels refined with %d samples each\n",
+             (unsigned long long) s_refined, (unsigned long long) s_width*s_height, s_ss*s_ss);
+    if (s_deep && (s_cache_in == NULL))
+      printf("Deep zoom: reference orbit of %d iterations, %d skipped by series, %llu rebases\n",
+             s_ref_n-1, s_sa_skip, (unsigned long long) s_rebases);
+    s_interior = (struct interior_count){0};
+    s_filled = s_rebases = s_refined = s_reused = s_mirrored = 0;
+    close_cache();
+  }
+
+  // Release the calculating threads, and await the termination of all the threads
+  s_quit = 1;
+  pthread_barrier_wait(&s_start);
+  for (i=0; i<NUM_THREADS+1; i++){
+    if(pthread_join(threads[i],NULL)!=0){
+      printf("Error during thread join!\n");
+      _exit(-1);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec-start.tv_sec) + 1e-9*(end.tv_nsec-start.tv_nsec);
+  printf("Rendered %u frames in %.3f seconds: %.2f frames per second\n",
+         s_frames, seconds, s_frames/seconds);
+  printf("Timing: %.3f s compute, %.3f s encode, %.3f s write, %.3f s reference; "
+         "%.2f Mpixels/s, %.2f Miterations/s\n",
+         1e-9*s_compute_ns, 1e-9*s_encode_ns, 1e-9*s_write_ns, 1e-9*s_reference_ns,
+         1e-6*s_frames*s_width*s_height/seconds, 1e-6*s_iters/seconds);
+  if (s_workers_n > 0)
+    print_workers(seconds);
+  if (s_json_path != NULL)
+    write_json(seconds);
+  if (strcmp(s_stats_mode, "off") != 0)
+    print_stats(seconds);
+
+  pthread_barrier_destroy(&s_start);
+  pthread_barrier_destroy(&s_done);
+  for (i=0; i < NUM_THREADS; i++)
+    free(s_stats[i].band_ns);
+  free(s_stats);
+  free(s_deques);
+  for (i=0; i < FRAMES_QUEUED; i++)
+    free(s_queue[i].bands);
+  for (i=0; i < MAX_NODES; i++)
+    pool_free(&s_escape_pools[i]);
+  pool_free(&s_idat_pool);
+  for (i=0; i < MAX_SWEEP; i++)
+    free(s_sweep_out[i]);
+  // Return zero on proper exit
+  return 0;
+}
+
+
+/*
+  Function: start_threads
+
+  Allocates the deques, statistics, bands and barriers used by the calculating threads, and 
+  creates the calculating threads and the output thread. The calculating threads fill the
+  pools of escape values of their nodes, and wait at s_start for the first frame.
+
+  Input:
+        pthread_t *threads: receives the NUM_THREADS calculating threads, then the output thread
+        int *index:         the NUM_THREADS indices passed to the calculating threads
+  Output:
+        Returns 0 on success and -1 on failure
+*/
+static int start_threads(pthread_t *threads, int *index){
+  z_stream z;
+  uint32_t n;
+  int i;
+
+  // Find the number of tiles across and down the image, which is the same for every frame
+  s_tiles_x = (s_width+s_tile_w-1)/s_tile_w;
+  s_bands_n = (s_height+s_tile_h-1)/s_tile_h;
+  s_tiles_n = s_tiles_x*s_bands_n;
+
+  if ((s_deques = (struct deque *)aligned_alloc(64, NUM_THREADS*sizeof(struct deque))) == NULL){
+    printf("Error allocating the tiles!\n");
+    return -1;
+  }
+  if ((s_stats = (struct thread_stats *)aligned_alloc(64, NUM_THREADS*sizeof(struct thread_stats))) == NULL){
+    printf("Error allocating the statistics!\n");
+    return -1;
+  }
+  memset(s_stats, 0, NUM_THREADS*sizeof(struct thread_stats));
+  for (i=0; i < NUM_THREADS; i++){
+    s_stats[i].tile_min_ns = UINT64_MAX;
+    if ((s_stats[i].band_ns = (uint64_t *)calloc(s_bands_n, sizeof(uint64_t))) == NULL){
+      printf("Error allocating the statistics!\n");
+      return -1;
+    }
+  }
+  for (i=0; i < FRAMES_QUEUED; i++){
+    if ((s_queue[i].bands = (struct band *)calloc(s_bands_n, sizeof(struct band))) == NULL){
+      printf("Error allocating the tiles!\n");
+      return -1;
+    }
+  }
+
+  /*
+    Only the bands within the window hold their escape values, along with a band which a
+    thread may take from the pool and give back as it loses the race to start it. The
+    compressed rows are held until they are written, which may be during the next frame
+  */
+  n = (s_window < s_bands_n) ? s_window : s_bands_n;
+  s_escape_fill = (n + NUM_THREADS-1)/NUM_THREADS + 1;
+  for (i=0; i < MAX_NODES; i++)
+    pthread_mutex_init(&s_escape_pools[i].lock, NULL);
+  if (s_output){
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, s_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+      printf("Error starting the compression!\n");
+      return -1;
+    }
+    s_idat_size = deflateBound(&z, (uLong) s_tile_h*((size_t) s_width*3*s_bit_depth/8 + 1)) + 16;
+    deflateEnd(&z);
+    pool_fill(&s_idat_pool, s_idat_size, FRAMES_QUEUED*n);
+  }
+  if ((pthread_barrier_init(&s_start, NULL, NUM_THREADS+1) != 0) ||
+      (pthread_barrier_init(&s_done, NULL, NUM_THREADS+1) != 0)){
+    printf("Error creating the barriers!\n");
+    return -1;
+  }
+
+  // Create the thread which will print the row data to the images
+  if(pthread_create(&threads[NUM_THREADS],NULL,handle_output,NULL) != 0){
+    printf("thread Error!\n");
+    _exit(-1);
+  }
+  // Create the pthreads, which wait at s_start for each frame
+  for (i=0; i < NUM_THREADS; i++){
+    index[i] = i;
+    if(pthread_create(&threads[i],NULL,handle_pthread,&index[i]) != 0){
+      printf("thread Error!\n");
+      _exit(-1);
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+  Function: create_video
+
+  Renders a zoom video from keyframes (see KEY_ZOOM), writing each frame to standard 
+  output as raw 8-bit RGB. The keyframes are calculated as the frames of a batch, at 
+  KEY_ZOOM times the size of the video, and colored once they are finished. Only the two 
+  keyframes around the scale of the frame being made are kept, and the next is calculated 
+  once the zoom passes the finer of them. The work of the kernels is that of a few frames 
+  for each factor of KEY_ZOOM in scale, however many frames the video has.
+
+  Input:
+              None
+  Output:    
+              Returns 0 on success and -1 on failure
+*/
+static int create_video(){
+  pthread_t threads[NUM_THREADS+1];
+  int index[NUM_THREADS];
+  struct timespec start, end;
+  png_bytep keys[2], out;
+  double seconds, octaves, scale, t;
+  uint32_t width, height, frames, keys_n, rendered, f, k;
+  uint64_t ns;
+  int i, saveError;
+
+  saveError = errno;
+  if (s_cache){
+    mkdir(FOLDER,
+          S_IRUSR|S_IWUSR|S_IXUSR|
+          S_IRGRP|S_IWGRP|S_IXGRP|
+          S_IROTH|S_IWOTH|S_IXOTH  );
+    mkdir(CACHE_FOLDER,
+          S_IRUSR|S_IWUSR|S_IXUSR|
+          S_IRGRP|S_IWGRP|S_IXGRP|
+          S_IROTH|S_IWOTH|S_IXOTH  );
+  }
+  errno = saveError;
+
+  // The keyframes are the frames of the batch seen by the calculating and output threads
+  width = s_width;
+  height = s_height;
+  frames = s_frames;
+  octaves = log(s_first.scale/s_last.scale)/log(KEY_ZOOM);
+  keys_n = 1 + (uint32_t) ceil(octaves - 1E-9);
+  s_width *= KEY_ZOOM;
+  s_height *= KEY_ZOOM;
+  s_frames = keys_n;
+
+  if (((s_keyframe = (float *) malloc((size_t) s_width*s_height*sizeof(float))) == NULL) ||
+      ((keys[0] = (png_bytep) malloc((size_t) s_width*s_height*3 + sizeof(uint64_t))) == NULL) ||
+      ((keys[1] = (png_bytep) malloc((size_t) s_width*s_height*3 + sizeof(uint64_t))) == NULL) ||
+      ((out = (png_bytep) malloc((size_t) width*height*3)) == NULL)){
+    printf("Error allocating the keyframes!\n");
+    return -1;
+  }
+  printf("Video: %u frames of %ux%u from %u keyframes of %ux%u, as raw rgb24 on standard output\n",
+         frames, width, height, keys_n, s_width, s_height);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (start_threads(threads, index) != 0)
+    return -1;
+
+  rendered = 0;
+  for (f=0; f < frames; f++){
+    t = (frames > 1) ? (double) f/(frames-1) : 0.0;
+    scale = (f == frames-1) ? s_last.scale : s_first.scale*pow(s_last.scale/s_first.scale, t);
+
+    // The keyframe at or above the scale of the frame, calculating it and the one below if needed
+    k = (uint32_t) fmax(0.0, floor(log(s_first.scale/scale)/log(KEY_ZOOM) + 1E-9));
+    if (k > keys_n-1)
+      k = keys_n-1;
+    for (; (rendered < keys_n) && (rendered <= k+1); rendered++)
+      render_keyframe(rendered, keys[rendered % 2]);
+
+    ns = clock_ns();
+    resample_frame(out, width, height, scale, keys[k % 2],
+                   (k+1 < keys_n) ? keys[(k+1) % 2] : NULL,
+                   s_first.scale*pow(KEY_ZOOM, -(double) k)/KEY_ZOOM);
+    s_resample_ns += clock_ns() - ns;
+
+    ns = clock_ns();
+    write_video(out, (size_t) width*height*3);
+    s_write_ns += clock_ns() - ns;
+  }
+
+  // Release the calculating threads, and await the termination of all the threads
+  s_quit = 1;
+  pthread_barrier_wait(&s_start);
+  for (i=0; i<NUM_THREADS+1; i++){
+    if(pthread_join(threads[i],NULL)!=0){
+      printf("Error during thread join!\n");
+      _exit(-1);
+    }
+  }
+  close(s_video_fd);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec-start.tv_sec) + 1e-9*(end.tv_nsec-start.tv_nsec);
+  printf("Rendered %u frames from %u keyframes in %.3f seconds: %.2f frames per second\n",
+         frames, keys_n, seconds, frames/seconds);
+  printf("Timing: %.3f s compute, %.3f s resample, %.3f s write, %.3f s reference; "
+         "%.2f Mpixels/s, %.2f Miterations/s\n",
+         1e-9*s_compute_ns, 1e-9*s_resample_ns, 1e-9*s_write_ns, 1e-9*s_reference_ns,
+         1e-6*frames*width*height/seconds, 1e-6*s_iters/seconds);
+  if (s_workers_n > 0)
+    print_workers(seconds);
+  if (s_json_path != NULL)
+    write_json(seconds);
+  if (strcmp(s_stats_mode, "off") != 0)
+    print_stats(seconds);
+
+  pthread_barrier_destroy(&s_start);
+  pthread_barrier_destroy(&s_done);
+  for (i=0; i < NUM_THREADS; i++)
+    free(s_stats[i].band_ns);
+  free(s_stats);
+  free(s_deques);
+  for (i=0; i < FRAMES_QUEUED; i++)
+    free(s_queue[i].bands);
+  for (i=0; i < MAX_NODES; i++)
+    pool_free(&s_escape_pools[i]);
+  pool_free(&s_idat_pool);
+  free(s_keyframe);
+  free(keys[0]);
+  free(keys[1]);
+  free(out);
+  return 0;
+}
+
+
+/*
+  Function: render_keyframe
+
+  Calculates keyframe k of a zoom video, which covers the frame at KEY_ZOOM^k times 
+  smaller a scale than the first, and colors it into rgb.
+
+  Input:
+        uint32_t k:   the keyframe, from 0 for the first frame
+        png_bytep rgb: receives the 8-bit RGB pixels of the keyframe
+  Output:
+        None
+*/
+static void render_keyframe(uint32_t k, png_bytep rgb){
+  struct frame *frame;
+  uint32_t y;
+
+  s_scale = s_first.scale*pow(KEY_ZOOM, -(double) k)/KEY_ZOOM;
+  s_center_r = s_first.center_r;
+  s_center_i = s_first.center_i;
+  s_center_dd_r = s_first.center_dd_r;
+  s_center_dd_i = s_first.center_dd_i;
+  if (setup_frame() != 0)
+    _exit(-1);
+
+  // Wait for the output thread to finish with the frame which used this place in the queue
+  pthread_mutex_lock(&s_out_lock);
+  while (k - s_frames_written >= FRAMES_QUEUED)
+    pthread_cond_wait(&s_out_cond, &s_out_lock);
+  pthread_mutex_unlock(&s_out_lock);
+  frame = &s_queue[k % FRAMES_QUEUED];
+  snprintf(frame->name, sizeof(frame->name), "Keyframe %u", k);
+  printf("Keyframe %u: Scale: %.2e\n", k, s_scale);
+
+  calc_image(frame);
+  if (s_cache_in != NULL)
+    printf("Escape values read from the cache: %s\n", s_cache_path);
+  if (s_prev != NULL)
+    printf("Reused %llu of %llu pixels from the previous keyframe: %s\n",
+           (unsigned long long) s_reused, (unsigned long long) s_width*s_height, s_prev_path);
+  s_interior = (struct interior_count){0};
+  s_filled = s_rebases = s_refined = s_reused = s_mirrored = 0;
+  close_cache();
+
+  for (y=0; y < s_height; y++)
+    color_row(&s_keyframe[(size_t) y*s_width], s_width, &rgb[(size_t) y*s_width*3]);
+}
+
+
+/*
+  Function: resample_frame
+
+  Makes a frame of a zoom video from the keyframes around its scale. Each pixel is the 
+  average of four samples at the quarters of the pixel, each interpolated bilinearly from
+  the finer keyframe where it lies inside it, and from the coarser keyframe otherwise.
+
+  Input:
+        png_bytep out:          receives the 8-bit RGB pixels of the frame
+        uint32_t width:         the width of the frame
+        uint32_t height:        the height of the frame
+        double scale:           the scale of the frame
+        png_const_bytep coarse: the keyframe at or above the scale of the frame
+        png_const_bytep fine:   the keyframe below it, or NULL after the last keyframe
+        double key_scale:       the scale of the coarse keyframe
+  Output:
+        None
+*/
+static void resample_frame(png_bytep out, uint32_t width, uint32_t height, double scale,
+                           png_const_bytep coarse, png_const_bytep fine, double key_scale){
+  double rgb[3], kx[2*width], ky[2], ratio;
+  uint32_t i, j, c, q;
+
+  // The keyframes share the center of the frame, so a sample is only scaled about it
+  ratio = scale/key_scale;
+  for (i=0; i < 2*width; i++)
+    kx[i] = (0.5*i - 0.25 - 0.5*width)*ratio;
+  for (j=0; j < height; j++){
+    ky[0] = (j - 0.25 - 0.5*height)*ratio;
+    ky[1] = (j + 0.25 - 0.5*height)*ratio;
+    for (i=0; i < width; i++){
+      rgb[0] = rgb[1] = rgb[2] = 0.0;
+      for (q=0; q < 4; q++)
+        if ((fine == NULL) ||
+            !sample_keyframe(fine, kx[2*i+(q & 1)]*KEY_ZOOM + 0.5*s_width,
+                             ky[q >> 1]*KEY_ZOOM + 0.5*s_height, 0, rgb))
+          sample_keyframe(coarse, kx[2*i+(q & 1)] + 0.5*s_width, ky[q >> 1] + 0.5*s_height, 1, rgb);
+      for (c=0; c < 3; c++)
+        out[((size_t) j*width+i)*3+c] = (png_byte)(0.25*rgb[c] + 0.5);
+    }
+  }
+}
+
+
+/*
+  Function: sample_keyframe
+
+  Adds the color of a keyframe at a point between its pixels, interpolated bilinearly 
+  from the four pixels around it.
+
+  Input:
+        png_const_bytep key: the keyframe, of s_width by s_height pixels
+        double x:            the column of the point
+        double y:            the row of the point
+        int clamp:           whether a point outside the keyframe takes its nearest edge
+        double *rgb:         the color to which the sample is added
+  Output:
+        Returns 1 if the sample was added, and 0 if the point lies outside the keyframe
+*/
+static inline int sample_keyframe(png_const_bytep key, double x, double y, int clamp, double *rgb){
+  png_const_bytep p;
+  double fx, fy;
+  uint32_t ix, iy, c, row;
+
+  if ((x < 0.0) || (y < 0.0) || (x > s_width-1) || (y > s_height-1)){
+    if (!clamp)
+      return 0;
+    x = (x < 0.0) ? 0.0 : (x > s_width-1) ? s_width-1 : x;
+    y = (y < 0.0) ? 0.0 : (y > s_height-1) ? s_height-1 : y;
+  }
+  ix = (uint32_t) x;
+  iy = (uint32_t) y;
+  if (ix > s_width-2)
+    ix = s_width-2;
+  if (iy > s_height-2)
+    iy = s_height-2;
+  fx = x - ix;
+  fy = y - iy;
+
+  row = s_width*3;
+  p = &key[((size_t) iy*s_width+ix)*3];
+  for (c=0; c < 3; c++)
+    rgb[c] += (1.0-fy)*((1.0-fx)*p[c] + fx*p[3+c]) + fy*((1.0-fx)*p[row+c] + fx*p[row+3+c]);
+  return 1;
+}
+
+
+/*
+  Function: write_video
+
+  Writes a frame of a zoom video to the encoder reading standard output. The process ends
+  if the encoder has gone.
+
+  Input:
+        const png_byte *buf: the pixels of the frame
+        size_t len:          the number of bytes to write
+  Output:
+        None
+*/
+static void write_video(const png_byte *buf, size_t len){
+  ssize_t n;
+
+  while (len > 0){
+    if ((n = write(s_video_fd, buf, len)) < 0){
+      if (errno == EINTR)
+        continue;
+      printf("Error writing the video: %s\n", strerror(errno));
+      _exit(-1);
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+
+/*
+  Function: serve_tiles
+
+  Runs the tile server (-L) until the process is killed. The calculating threads and the 
+  output thread are started as for a batch, with no end to the frames. A thread accepts 
+  the connections, each of which is answered by a thread of its own (see handle_client),
+  while this thread renders the tiles which have been requested, the newest request first.
+  Each tile is calculated by calc_image as the next frame, and passed on by the output
+  thread once it has been written (see finish_tile).
+
+  Input:
+        None
+  Output:
+        Returns -1 on failure, and does not return otherwise
+*/
+static int serve_tiles(){
+  pthread_t threads[NUM_THREADS+1], accept_thread;
+  int index[NUM_THREADS];
+  struct frame *frame;
+  struct tile *t;
+  double span;
+  uint32_t f;
+  int fd, saveError;
+
+  saveError = errno;
+  mkdir(FOLDER,
+        S_IRUSR|S_IWUSR|S_IXUSR|
+        S_IRGRP|S_IWGRP|S_IXGRP|
+        S_IROTH|S_IWOTH|S_IXOTH  );
+
+  if (s_tile_disk)
+    mkdir(CACHE_FOLDER,
+          S_IRUSR|S_IWUSR|S_IXUSR|
+          S_IRGRP|S_IWGRP|S_IXGRP|
+          S_IROTH|S_IWOTH|S_IXOTH  );
+
+  errno = saveError;
+
+  if ((fd = open_listener(s_listen)) < 0)
+    return -1;
+
+  // The server runs until it is killed, so its output should not wait in a buffer
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  s_frames = UINT32_MAX;
+  s_serve_start = clock_ns();
+  if (start_threads(threads, index) != 0)
+    return -1;
+  if (pthread_create(&accept_thread, NULL, handle_accept, (void *)(intptr_t) fd) != 0){
+    printf("thread Error!\n");
+    _exit(-1);
+  }
+  printf("Serving tiles of %dx%d pixels on %s\n", TILE_SIZE, TILE_SIZE, s_listen);
+
+  for (f=0; ; f++){
+    // Take the most recently requested tile
+    pthread_mutex_lock(&s_tile_lock);
+    while ((t = s_tile_waiting.newest) == NULL)
+      pthread_cond_wait(&s_tile_work, &s_tile_lock);
+    s_tile_waiting.newest = t->older;
+    if (t->older != NULL)
+      t->older->newer = NULL;
+    else
+      s_tile_waiting.oldest = NULL;
+    t->state = TILE_RENDERING;
+    t->start = clock_ns();
+    pthread_mutex_unlock(&s_tile_lock);
+
+    // The center of the tile is exact in double-double precision at every zoom served
+    span = ldexp(TILE_SPAN, -t->z);
+    s_center_dd_r = dd_add_d(dd_from(TILE_LEFT), (t->x + 0.5)*span);
+    s_center_dd_i = dd_add_d(dd_from(TILE_TOP), -(t->y + 0.5)*span);
+    s_center_r = dd_to_d(s_center_dd_r);
+    s_center_i = dd_to_d(s_center_dd_i);
+    s_scale = span/TILE_SIZE;
+    s_power_r = t->power_r;
+    s_power_i = t->power_i;
+    if (setup_frame() != 0)
+      _exit(-1);
+
+    // Wait for the output thread to finish with the frame which used this place in the queue
+    pthread_mutex_lock(&s_out_lock);
+    while (f - s_frames_written >= FRAMES_QUEUED)
+      pthread_cond_wait(&s_out_cond, &s_out_lock);
+    pthread_mutex_unlock(&s_out_lock);
+    frame = &s_queue[f % FRAMES_QUEUED];
+    snprintf(frame->name, sizeof(frame->name), "%s", t->key);
+    frame->tile = t;
+
+    calc_image(frame);
+    s_interior = (struct interior_count){0};
+    s_filled = s_rebases = s_refined = s_mirrored = 0;
+  }
+  return 0;
+}
+
+
+/*
+  Function: open_listener
+
+  Opens the socket of the tile server or a worker. An address holding a '/' is the path 
+  of a Unix socket, which replaces any file already there. Otherwise it is a port on 
+  localhost, or on the IPv4 address given before it as address:port.
+
+  Input:
+        const char *addr: the port, address:port or path to listen on
+  Output:
+        Returns the listening socket, or -1 on failure
+*/
+static int open_listener(const char *addr){
+  struct sockaddr_un un;
+  struct sockaddr_in in;
+  char host[64];
+  const char *port;
+  int fd, one = 1;
+
+  if (strchr(addr, '/') != NULL){
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    if (strlen(addr) >= sizeof(un.sun_path)){
+      printf("The socket path is too long: %s\n", addr);
+      return -1;
+    }
+    strcpy(un.sun_path, addr);
+    unlink(addr);
+    if (((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+        (bind(fd, (struct sockaddr *) &un, sizeof(un)) != 0) || (listen(fd, SOMAXCONN) != 0)){
+      printf("Error listening on %s: %s\n", addr, strerror(errno));
+      return -1;
+    }
+    return fd;
+  }
+
+  memset(&in, 0, sizeof(in));
+  in.sin_family = AF_INET;
+  in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((port = strrchr(addr, ':')) != NULL){
+    snprintf(host, sizeof(host), "%.*s", (int)(port-addr), addr);
+    if (inet_pton(AF_INET, host, &in.sin_addr) != 1){
+      printf("Bad address to listen on: %s\n", addr);
+      return -1;
+    }
+    addr = port+1;
+  }
+  in.sin_port = htons((uint16_t) strtoul(addr, NULL, 0));
+  if (((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) ||
+      (bind(fd, (struct sockaddr *) &in, sizeof(in)) != 0) || (listen(fd, SOMAXCONN) != 0)){
+    printf("Error listening on port %s: %s\n", addr, strerror(errno));
+    return -1;
+  }
+  return fd;
+}
+
+
+/*
+  Function: handle_accept
+
+  Accepts the connections to the tile server, or to a worker, and starts a detached thread
+  to answer each.
+
+  Input:
+        void *ptr_fd: the listening socket
+  Output:
+        NULL
+*/
+void *handle_accept(void *ptr_fd){
+  pthread_attr_t attr;
+  pthread_t thread;
+  int fd, client;
+
+  fd = (int)(intptr_t) ptr_fd;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for(;;){
+    if ((client = accept(fd, NULL, NULL)) < 0)
+      continue;
+    if (pthread_create(&thread, &attr, (s_node != NULL) ? handle_worker : handle_client,
+                       (void *)(intptr_t) client) != 0)
+      close(client);
+  }
+  return NULL;
+}
+
+
+/*
+  Function: handle_client
+
+  Answers the HTTP requests on one connection, which is kept open between requests unless
+  the client asks for it to be closed. Only the request line is read from the headers.
+
+  Input:
+        void *ptr_fd: the socket of the connection
+  Output:
+        NULL
+*/
+void *handle_client(void *ptr_fd){
+  char buf[4096], path[256];
+  char *end;
+  size_t len, used;
+  ssize_t n;
+  int fd, minor, keep;
+
+  fd = (int)(intptr_t) ptr_fd;
+  len = 0;
+  for(;;){
+    // Read until the end of the headers
+    buf[len] = '\0';
+    while ((end = strstr(buf, "\r\n\r\n")) == NULL){
+      if ((len == sizeof(buf)-1) || ((n = recv(fd, buf+len, sizeof(buf)-1-len, 0)) <= 0)){
+        close(fd);
+        return NULL;
+      }
+      len += n;
+      buf[len] = '\0';
+    }
+    used = end + 4 - buf;
+    *end = '\0';
+
+    if ((sscanf(buf, "GET %255s HTTP/1.%d", path, &minor) != 2)){
+      send_response(fd, "400 Bad Request", "text/plain", "Bad request\n", 12, 0);
+      break;
+    }
+    keep = (minor > 0) && (strstr(buf, "Connection: close") == NULL) &&
+           (strstr(buf, "connection: close") == NULL);
+    serve_path(fd, path, keep);
+    if (!keep)
+      break;
+
+    memmove(buf, buf+used, len-used);
+    len -= used;
+  }
+  close(fd);
+  return NULL;
+}
+
+
+/*
+  Function: serve_path
+
+  Answers a request for a tile, or for the statistics of the server at /stats as JSON: 
+  the tiles rendered and requested each second since the server started, and the share
+  of the requests found in memory, on disk, or shared with another request.
+
+  Input:
+        int fd:           the socket of the connection
+        const char *path: the path requested
+        int keep:         set if the connection is kept open
+  Output:
+        None
+*/
+static void serve_path(int fd, const char *path, int keep){
+  struct tile req, *t;
+  struct tile_counts c;
+  char body[1024];
+  double seconds, r;
+  uint32_t cached;
+  size_t bytes;
+  int n;
+
+  if ((strcmp(path, "/stats") == 0) || (strcmp(path, "/stats.json") == 0)){
+    pthread_mutex_lock(&s_tile_lock);
+    c = s_tile_counts;
+    cached = s_tiles_cached;
+    bytes = s_tile_bytes;
+    pthread_mutex_unlock(&s_tile_lock);
+
+    seconds = 1e-9*(clock_ns() - s_serve_start);
+    r = (c.requests > 0) ? 1.0/c.requests : 0.0;
+    n = snprintf(body, sizeof(body),
+                 "{\"uptime_s\": %.3f, \"requests\": %llu, \"rendered\": %llu, "
+                 "\"tiles_per_s\": %.3f, \"requests_per_s\": %.3f, \"render_ms\": %.3f, "
+                 "\"hit_rate\": %.4f, \"disk_hit_rate\": %.4f, \"coalesced_rate\": %.4f, "
+                 "\"cached\": %u, \"cached_bytes\": %zu, \"cache_max\": %u}\n",
+                 seconds, (unsigned long long) c.requests, (unsigned long long) c.rendered,
+                 c.rendered/seconds, c.requests/seconds,
+                 (c.rendered > 0) ? 1e-6*c.render_ns/c.rendered : 0.0,
+                 c.hits*r, c.disk_hits*r, c.coalesced*r, cached, bytes, s_tile_max);
+    send_response(fd, "200 OK", "application/json", body, n, keep);
+    return;
+  }
+
+  if (parse_tile(path, &req) != 0){
+    send_response(fd, "404 Not Found", "text/plain", "Not found\n", 10, keep);
+    return;
+  }
+  t = request_tile(&req);
+  send_response(fd, "200 OK", "image/png", t->png, t->png_len, keep);
+  release_tile(t);
+}
+
+
+/*
+  Function: parse_tile
+
+  Reads the exponent, zoom and position of a tile from a path /{exp}/{z}/{x}/{y}.png, where 
+  the exponent is either real (2.5) or complex (2+0.01i). The tile is given a key which 
+  is the same for every way of writing the exponent.
+
+  Input:
+        const char *path: the path requested
+        struct tile *t:   receives the tile
+  Output:
+        Returns 0 for a valid tile and -1 otherwise
+*/
+static int parse_tile(const char *path, struct tile *t){
+  char exp[64], *end, *imag;
+  int n = 0;
+
+  memset(t, 0, sizeof(*t));
+  if ((sscanf(path, "/%63[^/]/%d/%" SCNu64 "/%" SCNu64 ".png%n", exp, &t->z, &t->x, &t->y, &n) != 4) ||
+      (n == 0) || ((path[n] != '\0') && (path[n] != '?')))
+    return -1;
+
+  t->power_r = strtod(exp, &end);
+  if (end == exp)
+    return -1;
+  if ((*end == '+') || (*end == '-')){
+    t->power_i = strtod(end, &imag);
+    if ((imag == end) || (*imag != 'i'))
+      return -1;
+    end = imag+1;
+  }
+  if ((*end != '\0') || !isfinite(t->power_r) || !isfinite(t->power_i))
+    return -1;
+  if ((t->z < 0) || (t->z > TILE_ZOOM) || (t->x >> t->z) || (t->y >> t->z))
+    return -1;
+
+  snprintf(t->key, sizeof(t->key), "%.17g%+.17gi/%d/%" PRIu64 "/%" PRIu64, t->power_r, t->power_i, t->z,
+           t->x, t->y);
+  return 0;
+}
+
+
+/*
+  Function: request_tile
+
+  Finds a tile for a request, and holds it until release_tile. A tile which is ready in
+  memory is moved to the front of the cache. A tile which is being rendered for another
+  request is waited for, and one still waiting to be rendered is also moved to the front of
+  the queue. Otherwise the tile is read from the disk cache, or queued for rendering and 
+  waited for.
+
+  Input:
+        const struct tile *req: the tile requested, as found by parse_tile
+  Output:
+        Returns the tile, which is ready
+*/
+static struct tile *request_tile(const struct tile *req){
+  struct tile *t, **bucket;
+  unsigned char *png = NULL;
+  size_t len = 0;
+  uint64_t hash;
+  const char *k;
+  int tried = 0;
+
+  // FNV-1a hash of the key
+  hash = 14695981039346656037ull;
+  for (k=req->key; *k; k++)
+    hash = (hash ^ (unsigned char) *k)*1099511628211ull;
+  bucket = &s_tile_hash[hash % TILE_BUCKETS];
+
+  pthread_mutex_lock(&s_tile_lock);
+  s_tile_counts.requests++;
+  for(;;){
+    for (t=*bucket; t != NULL; t=t->next)
+      if (strcmp(t->key, req->key) == 0)
+        break;
+    if ((t != NULL) || (png != NULL) || !s_tile_disk || tried)
+      break;
+
+    // Look in the disk cache without holding the lock, and then look again in memory
+    pthread_mutex_unlock(&s_tile_lock);
+    read_tile(req, &png, &len);
+    tried = 1;
+    pthread_mutex_lock(&s_tile_lock);
+  }
+
+  if (t != NULL){
+    free(png);
+    t->refs++;
+    if (t->state == TILE_READY)
+      s_tile_counts.hits++;
+    else
+      s_tile_counts.coalesced++;
+
+    // Move the tile to the front of its list
+    if (t->state != TILE_RENDERING){
+      struct tile_list *list = (t->state == TILE_READY) ? &s_tile_ready : &s_tile_waiting;
+      if (t->newer != NULL){
+        t->newer->older = t->older;
+        if (t->older != NULL)
+          t->older->newer = t->newer;
+        else
+          list->oldest = t->newer;
+        t->newer = NULL;
+        t->older = list->newest;
+        list->newest->newer = t;
+        list->newest = t;
+      }
+    }
+  }
+  else{
+    if ((t = (struct tile *) malloc(sizeof(struct tile))) == NULL){
+      printf("Error allocating a tile!\n");
+      _exit(-1);
+    }
+    *t = *req;
+    t->refs = 1;
+    t->next = *bucket;
+    *bucket = t;
+
+    // A tile from the disk is ready at once, and any other is queued at the front
+    t->newer = NULL;
+    if (png != NULL){
+      s_tile_counts.disk_hits++;
+      t->state = TILE_READY;
+      t->png = png;
+      t->png_len = len;
+      t->older = s_tile_ready.newest;
+      if (s_tile_ready.newest != NULL)
+        s_tile_ready.newest->newer = t;
+      else
+        s_tile_ready.oldest = t;
+      s_tile_ready.newest = t;
+      s_tiles_cached++;
+      s_tile_bytes += len;
+      trim_tiles();
+    }
+    else{
+      t->state = TILE_WAITING;
+      t->older = s_tile_waiting.newest;
+      if (s_tile_waiting.newest != NULL)
+        s_tile_waiting.newest->newer = t;
+      else
+        s_tile_waiting.oldest = t;
+      s_tile_waiting.newest = t;
+      pthread_cond_signal(&s_tile_work);
+    }
+  }
+
+  while (t->state != TILE_READY)
+    pthread_cond_wait(&s_tile_done, &s_tile_lock);
+  pthread_mutex_unlock(&s_tile_lock);
+  return t;
+}
+
+
+/*
+  Function: release_tile
+
+  Lets go of a tile held by request_tile, freeing it if it has left the cache meanwhile 
+  and this was the last request holding it.
+
+  Input:
+        struct tile *t: the tile
+  Output:
+        None
+*/
+static void release_tile(struct tile *t){
+  pthread_mutex_lock(&s_tile_lock);
+  if ((--t->refs == 0) && t->evicted){
+    free(t->png);
+    free(t);
+  }
+  pthread_mutex_unlock(&s_tile_lock);
+}
+
+
+/*
+  Function: finish_tile
+
+  Called by the output thread once the PNG image of a tile has been written to memory. The
+  tile is put at the front of the cache, the requests waiting for it are woken, and the
+  image is also written to the disk cache when it is in use.
+
+  Input:
+        struct frame *frame: the frame holding the tile
+  Output:
+        None
+*/
+static void finish_tile(struct frame *frame){
+  struct tile *t = frame->tile;
+  char path[128], temp[160];
+  FILE *fp;
+
+  if (s_tile_disk){
+    tile_file(t, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int) getpid());
+    if ((fp = fopen(temp, "wb")) != NULL){
+      if ((fwrite(frame->png, 1, frame->png_len, fp) == frame->png_len) && (fclose(fp) == 0))
+        rename(temp, path);
+      else
+        unlink(temp);
+    }
+  }
+
+  pthread_mutex_lock(&s_tile_lock);
+  t->png = (unsigned char *) frame->png;
+  t->png_len = frame->png_len;
+  t->state = TILE_READY;
+  t->newer = NULL;
+  t->older = s_tile_ready.newest;
+  if (s_tile_ready.newest != NULL)
+    s_tile_ready.newest->newer = t;
+  else
+    s_tile_ready.oldest = t;
+  s_tile_ready.newest = t;
+  s_tiles_cached++;
+  s_tile_bytes += t->png_len;
+  s_tile_counts.rendered++;
+  s_tile_counts.render_ns += clock_ns() - t->start;
+  trim_tiles();
+  pthread_cond_broadcast(&s_tile_done);
+  pthread_mutex_unlock(&s_tile_lock);
+
+  frame->tile = NULL;
+  frame->png = NULL;
+  frame->png_len = 0;
+}
+
+
+/*
+  Function: trim_tiles
+
+  Drops the least recently used tiles from the cache until it holds at most s_tile_max.
+  A tile still held by a request is only freed once it is released. Called with 
+  s_tile_lock held.
+
+  Input:
+        None
+  Output:
+        None
+*/
+static void trim_tiles(){
+  struct tile *t, **p;
+  uint64_t hash;
+  const char *k;
+
+  while ((s_tiles_cached > s_tile_max) && ((t = s_tile_ready.oldest) != NULL)){
+    s_tile_ready.oldest = t->newer;
+    if (t->newer != NULL)
+      t->newer->older = NULL;
+    else
+      s_tile_ready.newest = NULL;
+
+    hash = 14695981039346656037ull;
+    for (k=t->key; *k; k++)
+      hash = (hash ^ (unsigned char) *k)*1099511628211ull;
+    for (p=&s_tile_hash[hash % TILE_BUCKETS]; *p != t; p=&(*p)->next)
+      ;
+    *p = t->next;
+
+    s_tiles_cached--;
+    s_tile_bytes -= t->png_len;
+    if (t->refs == 0){
+      free(t->png);
+      free(t);
+    }
+    else
+      t->evicted = 1;
+  }
+}
+
+
+/*
+  Function: tile_file
+
+  Names the file of a tile in the disk cache by a hash of the tile and of every option 
+  which changes its pixels.
+
+  Input:
+        const struct tile *t: the tile
+        char *path:           receives the name of the file
+        size_t size:          the size of path
+  Output:
+        None
+*/
+static void tile_file(const struct tile *t, char *path, size_t size){
+  char key[512];
+  uint64_t hash;
+  const char *k;
+
+  snprintf(key, sizeof(key), "%s %s %d %.17g %.17g %d %s %u %d %.17g %s %d %s",
+           t->key, s_depth_name ? s_depth_name : "-", s_depth, s_escape, s_min_r, s_branch,
+           s_palette_name, s_bit_depth, s_ss, s_ss_threshold, s_deep_mode, s_ms,
+           s_precision_mode);
+  hash = 14695981039346656037ull;
+  for (k=key; *k; k++)
+    hash = (hash ^ (unsigned char) *k)*1099511628211ull;
+  snprintf(path, size, "%s/%016llx.png", CACHE_FOLDER, (unsigned long long) hash);
+}
+
+
+/*
+  Function: read_tile
+
+  Reads the PNG image of a tile from the disk cache.
+
+  Input:
+        const struct tile *t: the tile
+        unsigned char **png:  receives the image, allocated here
+        size_t *len:          receives the length of the image
+  Output:
+        Returns 0 if the tile was found and -1 otherwise
+*/
+static int read_tile(const struct tile *t, unsigned char **png, size_t *len){
+  char path[128];
+  struct stat st;
+  FILE *fp;
+
+  tile_file(t, path, sizeof(path));
+  if ((fp = fopen(path, "rb")) == NULL)
+    return -1;
+  if ((fstat(fileno(fp), &st) != 0) || (st.st_size == 0) ||
+      ((*png = (unsigned char *) malloc(st.st_size)) == NULL)){
+    fclose(fp);
+    return -1;
+  }
+  if (fread(*png, 1, st.st_size, fp) != (size_t) st.st_size){
+    fclose(fp);
+    free(*png);
+    *png = NULL;
+    return -1;
+  }
+  fclose(fp);
+  *len = st.st_size;
+  return 0;
+}
+
+
+/*
+  Function: send_response
+
+  Sends an HTTP response with its body. Errors are ignored, as the connection is then
+  closed when the next request is read.
+
+  Input:
+        int fd:             the socket of the connection
+        const char *status: the status line, such as "200 OK"
+        const char *type:   the content type of the body
+        const void *body:   the body
+        size_t len:         the length of the body
+        int keep:           set if the connection is kept open
+  Output:
+        None
+*/
+static void send_response(int fd, const char *status, const char *type, const void *body,
+                          size_t len, int keep){
+  char head[256];
+  const char *p;
+  ssize_t n;
+  size_t left;
+  int i, h;
+
+  h = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+               "Connection: %s\r\n\r\n", status, type, len, keep ? "keep-alive" : "close");
+  for (i=0; i < 2; i++){
+    p = (i == 0) ? head : (const char *) body;
+    left = (i == 0) ? h : len;
+    while (left > 0){
+      if ((n = send(fd, p, left, MSG_NOSIGNAL)) <= 0)
+        return;
+      p += n;
+      left -= n;
+    }
+  }
+}
+
+
+/*
+  Function: run_worker
+
+  Runs a worker (-N) until the process is killed. Each connection from a coordinator is
+  answered by a thread of its own (see handle_worker).
+
+  Input:
+        None
+  Output:
+        Returns -1 on failure, and does not return otherwise
+*/
+static int run_worker(){
+  int fd;
+
+  // Report a kernel this machine can not run before listening
+  if (setup_frame() != 0)
+    return -1;
+  if ((fd = open_listener(s_node)) < 0)
+    return -1;
+
+  // The worker runs until it is killed, so its output should not wait in a buffer
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("Worker listening on %s\n", s_node);
+  handle_accept((void *)(intptr_t) fd);
+  return 0;
+}
+
+
+/*
+  Function: handle_worker
+
+  Calculates the tiles sent by a coordinator on one connection, until it is closed. The
+  worker is set up for the frame of each tile unless it already is (see setup_job), and
+  the frame is held by a read lock while the tile is calculated. Each tile is answered
+  with the number of iterations made, then its escape values row by row.
+
+  Input:
+        void *ptr_fd: the socket of the connection
+  Output:
+        NULL
+*/
+void *handle_worker(void *ptr_fd){
+  struct thread_stats stats;
+  struct remote_job job;
+  char *reply;
+  float *out, *band;
+  size_t size, need, len;
+  uint64_t tiles;
+  uint32_t y;
+  int fd;
+
+  fd = (int)(intptr_t) ptr_fd;
+  memset(&stats, 0, sizeof(stats));
+  t_stats = &stats;
+  reply = NULL;
+  size = 0;
+  tiles = 0;
+
+  while (recv_all(fd, &job, sizeof(job)) == 0){
+    /*
+      The tile comes from the network, so it must lie inside a frame of a sane size, with
+      limits main would accept, and must not take more memory than a sane tile
+    */
+    if ((memcmp(job.magic, REMOTE_MAGIC, sizeof(job.magic)) != 0) ||
+        (job.width < 1) || (job.width > MAX_DIM) || (job.height < 1) || (job.height > MAX_DIM) ||
+        (job.x0 >= job.width) || (job.w < 1) || (job.w > job.width-job.x0) ||
+        (job.y0 >= job.height) || (job.h < 1) || (job.h > job.height-job.y0) ||
+        ((uint64_t)(job.ms ? job.width : job.w)*job.h > MAX_JOB_PIXELS) ||
+        (job.depth < 1) || (job.depth > MAX_DEPTH) || !isfinite(job.scale) || (job.scale <= 0.0) ||
+        !isfinite(job.center_r) || !isfinite(job.center_i) ||
+        !isfinite(job.power_r) || !isfinite(job.power_i) || !isfinite(job.escape) ||
+        !isfinite(job.min_r) || (job.escape <= 4.0) || (job.min_r < 0.0) ||
+        (job.min_r >= job.escape)){
+      printf("Bad tile from the coordinator\n");
+      break;
+    }
+
+    // Set up for the frame of the tile, unless this or another connection already has
+    pthread_rwlock_rdlock(&s_job_lock);
+    while (memcmp(&job, &s_job, offsetof(struct remote_job, x0)) != 0){
+      pthread_rwlock_unlock(&s_job_lock);
+      pthread_rwlock_wrlock(&s_job_lock);
+      if (memcmp(&job, &s_job, offsetof(struct remote_job, x0)) != 0)
+        setup_job(&job);
+      pthread_rwlock_unlock(&s_job_lock);
+      pthread_rwlock_rdlock(&s_job_lock);
+    }
+
+    // Subdivision works on the rows of a whole band, after the values sent back
+    len = sizeof(uint64_t) + (size_t) job.w*job.h*sizeof(float);
+    need = len + (job.ms ? (size_t) job.width*job.h*sizeof(float) : 0);
+    if (need > size){
+      free(reply);
+      if ((reply = (char *) malloc(need)) == NULL){
+        printf("Error allocating the tile!\n");
+        _exit(-1);
+      }
+      size = need;
+    }
+    out = (float *)(reply + sizeof(uint64_t));
+
+    t_iters = 0;
+    if (job.ms){
+      band = out + (size_t) job.w*job.h;
+      subdivide_tile(band, job.y0, job.x0, job.w, job.h);
+      for (y=0; y < job.h; y++)
+        memcpy(&out[y*job.w], &band[(size_t) y*job.width+job.x0], job.w*sizeof(float));
+    }
+    else
+      for (y=0; y < job.h; y++)
+        span_fn(job.y0+y, job.x0, job.w, 1, 0, &out[y*job.w]);
+    pthread_rwlock_unlock(&s_job_lock);
+
+    memcpy(reply, &t_iters, sizeof(uint64_t));
+    if (send_all(fd, reply, len) != 0)
+      break;
+    tiles++;
+  }
+
+  printf("Connection closed after %llu tiles\n", (unsigned long long) tiles);
+  close(fd);
+  free(reply);
+  return NULL;
+}
+
+
+/*
+  Function: setup_job
+
+  Sets a worker up for the frame of a tile, as main and calc_image do for a frame, with 
+  the exponent, limits and deep zoom mode of the coordinator. The kernel is the one chosen
+  by the worker. Called with the write lock of s_job_lock held.
+
+  Input:
+        const struct remote_job *job: the tile, holding the parameters of its frame
+  Output:
+        None
+*/
+static void setup_job(const struct remote_job *job){
+  s_width = job->width;
+  s_height = job->height;
+  s_scale = job->scale;
+  s_center_r = job->center_r;
+  s_center_i = job->center_i;
+  s_center_dd_r = job->center_dd_r;
+  s_center_dd_i = job->center_dd_i;
+  s_power_r = job->power_r;
+  s_power_i = job->power_i;
+  s_escape = job->escape;
+  s_min_r = job->min_r;
+  s_depth = job->depth;
+  s_depth_name = NULL;
+  s_branch = job->branch;
+  s_deep_mode = job->deep ? "on" : "off";
+  s_precision_mode = s_precision_names[(job->precision >= 0) && (job->precision < PRECISIONS) ? job->precision : PREC_DOUBLE];
+  s_ms = job->ms;
+  if (setup_frame() != 0)
+    _exit(-1);
+
+  if (s_deep)
+    build_reference();
+
+  s_job = *job;
+  printf("Frame: %ux%u, Center: %.4f%+.4fi, Scale: %.2e\n", s_width, s_height,
+         s_center_r, s_center_i, s_scale);
+}
+
+
+/*
+  Function: parse_workers
+
+  Reads the comma separated addresses of the workers (-G) into s_workers.
+
+  Input:
+        const char *list: the addresses, each a path, port or host:port
+  Output:
+        Returns 0 on success and -1 on failure
+*/
+static int parse_workers(const char *list){
+  char *copy, *addr, *save;
+  const char *p;
+
+  s_workers_n = 1;
+  for (p=list; *p; p++)
+    s_workers_n += (*p == ',');
+  if (((s_workers = (struct worker *) calloc(s_workers_n, sizeof(struct worker))) == NULL) ||
+      ((copy = strdup(list)) == NULL)){
+    printf("Error allocating the workers!\n");
+    return -1;
+  }
+
+  s_workers_n = 0;
+  for (addr = strtok_r(copy, ",", &save); addr != NULL; addr = strtok_r(NULL, ",", &save)){
+    if (strlen(addr) >= sizeof(s_workers[0].addr)){
+      printf("The address of the worker is too long: %s\n", addr);
+      return -1;
+    }
+    strcpy(s_workers[s_workers_n++].addr, addr);
+  }
+  free(copy);
+  if (s_workers_n == 0){
+    printf("No workers given: %s\n", list);
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+  Function: remote_tile
+
+  Has a tile calculated by the worker of this thread, connecting to it first if need be.
+  Should the worker be lost, it is marked as lost for every thread, and the tile is sent
+  to the next worker left. With none left the tile is calculated here.
+
+  Input:
+        float *escapes:  the escape values of the band holding the tile
+        int y0:          the first row of the band, and of the tile
+        int x0:          the first column of the tile
+        int w, h:        the size of the tile
+  Output:
+        None
+*/
+static void remote_tile(float *escapes, int y0, int x0, int w, int h){
+  struct remote_job job;
+  struct worker *worker;
+  uint64_t start, iters;
+  float *row;
+  int i, x, y, ok;
+
+  memset(&job, 0, sizeof(job));
+  memcpy(job.magic, REMOTE_MAGIC, sizeof(job.magic));
+  job.width = s_width;
+  job.height = s_height;
+  job.scale = s_scale;
+  job.center_r = s_center_r;
+  job.center_i = s_center_i;
+  job.center_dd_r = s_center_dd_r;
+  job.center_dd_i = s_center_dd_i;
+  job.power_r = s_power_r;
+  job.power_i = s_power_i;
+  job.escape = s_escape;
+  job.min_r = s_min_r;
+  job.depth = s_depth;
+  job.branch = s_branch;
+  job.deep = s_deep;
+  job.ms = s_ms;
+  job.precision = s_precision;
+  job.x0 = x0;
+  job.y0 = y0;
+  job.w = w;
+  job.h = h;
+
+  for(;;){
+    // Connect to the worker of this thread, or the next one which has not been lost
+    for (i=0; (t_remote_fd < 0) && (i < s_workers_n); i++){
+      worker = &s_workers[t_remote_worker];
+      if (!atomic_load(&worker->lost) && ((t_remote_fd = connect_worker(worker->addr)) >= 0))
+        break;
+      if (atomic_exchange(&worker->lost, 1) == 0)
+        printf("Worker %s lost, its tiles go to the other workers\n", worker->addr);
+      t_remote_worker = (t_remote_worker+1) % s_workers_n;
+    }
+
+    // Every worker has been lost
+    if (t_remote_fd < 0){
+      if (s_ms)
+        subdivide_tile(escapes, y0, x0, w, h);
+      else
+        for (y=0; y < h; y++)
+          span_fn(y0+y, x0, w, 1, 0, &escapes[y*s_width+x0]);
+      return;
+    }
+
+    worker = &s_workers[t_remote_worker];
+    start = clock_ns();
+    ok = (send_all(t_remote_fd, &job, sizeof(job)) == 0) &&
+         (recv_all(t_remote_fd, &iters, sizeof(iters)) == 0);
+    for (y=0; ok && (y < h); y++)
+      ok = (recv_all(t_remote_fd, &escapes[y*s_width+x0], w*sizeof(float)) == 0);
+    if (ok){
+      // The values come from the network, so keep them to [0,1] for the colorizer, NaN as 0
+      for (y=0; y < h; y++){
+        row = &escapes[y*s_width+x0];
+        for (x=0; x < w; x++)
+          row[x] = (row[x] >= 0.0f) ? ((row[x] <= 1.0f) ? row[x] : 1.0f) : 0.0f;
+      }
+      t_iters += iters;
+      atomic_fetch_add(&worker->tiles, 1);
+      atomic_fetch_add(&worker->pixels, (uint64_t) w*h);
+      atomic_fetch_add(&worker->iterations, iters);
+      atomic_fetch_add(&worker->busy_ns, clock_ns() - start);
+      return;
+    }
+
+    if (atomic_exchange(&worker->lost, 1) == 0)
+      printf("Worker %s lost, its tiles go to the other workers\n", worker->addr);
+    close(t_remote_fd);
+    t_remote_fd = -1;
+  }
+}
+
+
+/*
+  Function: connect_worker
+
+  Connects to a worker. An address holding a '/' is the path of a Unix socket, and 
+  otherwise it is host:port, or a port on localhost. A worker which does not answer 
+  within REMOTE_TIMEOUT seconds is taken to be lost.
+
+  Input:
+        const char *addr: the address of the worker
+  Output:
+        Returns the connected socket, or -1 on failure
+*/
+static int connect_worker(const char *addr){
+  struct sockaddr_un un;
+  struct addrinfo hints, *res;
+  struct timeval tv = {REMOTE_TIMEOUT, 0};
+  char host[64];
+  const char *port;
+  int fd;
+
+  if (strchr(addr, '/') != NULL){
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    snprintf(un.sun_path, sizeof(un.sun_path), "%s", addr);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      return -1;
+    if (connect(fd, (struct sockaddr *) &un, sizeof(un)) != 0){
+      close(fd);
+      return -1;
+    }
+  }
+  else{
+    if ((port = strrchr(addr, ':')) != NULL)
+      snprintf(host, sizeof(host), "%.*s", (int)(port++ - addr), addr);
+    else
+      snprintf(host, sizeof(host), "127.0.0.1"), port = addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+      return -1;
+    if ((fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) < 0){
+      freeaddrinfo(res);
+      return -1;
+    }
+    if (connect(fd, res->ai_addr, res->ai_addrlen) != 0){
+      freeaddrinfo(res);
+      close(fd);
+      return -1;
+    }
+    freeaddrinfo(res);
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+
+/*
+  Function: send_all
+
+  Sends the whole of a buffer on a socket.
+
+  Input:
+        int fd:          the socket
+        const void *buf: the bytes to send
+        size_t len:      the number of bytes
+  Output:
+        Returns 0 on success and -1 if the connection failed
+*/
+static int send_all(int fd, const void *buf, size_t len){
+  const char *p = (const char *) buf;
+  ssize_t n;
+
+  while (len > 0){
+    if ((n = send(fd, p, len, MSG_NOSIGNAL)) <= 0){
+      if ((n < 0) && (errno == EINTR))
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+/*
+  Function: recv_all
+
+  Receives the whole of a buffer from a socket.
+
+  Input:
+        int fd:     the socket
+        void *buf:  receives the bytes
+        size_t len: the number of bytes
+  Output:
+        Returns 0 on success and -1 if the connection failed or was closed
+*/
+static int recv_all(int fd, void *buf, size_t len){
+  char *p = (char *) buf;
+  ssize_t n;
+
+  while (len > 0){
+    if ((n = recv(fd, p, len, 0)) <= 0){
+      if ((n < 0) && (errno == EINTR))
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+/*
+  Function: print_workers
+
+  Prints the tiles calculated by each worker, and its throughput over the run, so that 
+  the scaling over the workers can be judged. The time each was busy is summed over its
+  connections, and includes the time on the network.
+
+  Input:
+        double seconds: the wall time of the run
+  Output:
+        None
+*/
+static void print_workers(double seconds){
+  struct worker *w;
+  uint64_t pixels;
+  int i;
+
+  pixels = 0;
+  for (i=0; i < s_workers_n; i++){
+    w = &s_workers[i];
+    pixels += atomic_load(&w->pixels);
+    printf("Worker %s: %llu tiles, %.2f Mpixels/s, %.2f Miterations/s, %.3f s busy%s\n",
+           w->addr, (unsigned long long) atomic_load(&w->tiles),
+           1e-6*atomic_load(&w->pixels)/seconds, 1e-6*atomic_load(&w->iterations)/seconds,
+           1e-9*atomic_load(&w->busy_ns), atomic_load(&w->lost) ? ", lost" : "");
+  }
+  printf("Workers: %.2f Mpixels/s from %d workers\n", 1e-6*pixels/seconds, s_workers_n);
+}
+
+
+/*
+  Function: calc_image
+
+  Splits the current frame into tiles, hands the frame to the output thread, and releases
+  the calculating threads. Returns once every tile of the frame has been calculated, 
+  although the frame may not have been written yet.
+
+  The image is divided into bands of s_tile_h rows, and each band into tiles of s_tile_w
+  columns. Every calculating thread owns a deque of tiles. The tiles are dealt out so that
+  each thread works down the image in step with the others, which lets the output thread
+  write rows as soon as possible. Once a thread has finished its own tiles, it steals half
+  of the remaining tiles of another thread.
+
+  With progressive rendering, the whole frame is first calculated in passes (see 
+  calculate_passes), and the tiles then only copy their values.
+
+  Input:
+          struct frame *frame: the place in the queue of the output thread for this frame
+  Output:
+          None (PNG data is computed during this time)
+*/
+void calc_image(struct frame *frame){
+  uint64_t start;
+  int i;
+
+  start = clock_ns();
+
+  // Look for the escape values of this frame in the cache
+  if (s_cache)
+    open_cache();
+
+  // A deep zoom needs the reference orbit before any pixel can be calculated
+  if (s_deep && (s_cache_in == NULL)){
+    s_reference_ns -= clock_ns();
+    build_reference();
+    s_reference_ns += clock_ns();
+  }
+
+  // Copy the pixels which mirror others of the view, rather than calculate them
+  find_symmetry();
+
+  // Calculate the frame in passes, from which the tiles are then copied
+  if (s_progressive && (s_cache_in == NULL))
+    calculate_passes(frame, start);
+
+  // The bands of each place in the queue are kept from one frame to the next
+  s_bands = frame->bands;
+  memset(s_bands, 0, s_bands_n*sizeof(struct band));
+  for (i=0; i < s_bands_n; i++){
+    atomic_init(&s_bands[i].escapes, NULL);
+    atomic_init(&s_bands[i].remaining, s_tiles_x);
+  }
+
+  // Pass the frame to the output thread, which will write its bands as they are finished
+  pthread_mutex_lock(&s_out_lock);
+  atomic_init(&frame->written, 0);
+  s_frame = frame;
+  s_frames_queued++;
+  pthread_cond_broadcast(&s_out_cond);
+  pthread_mutex_unlock(&s_out_lock);
+
+  run_tiles();
+  if (s_frames_queued == 1)
+    s_allocs_first = atomic_load(&s_allocs);
+
+  free(s_progress);
+  s_progress = NULL;
+}
+
+
+/*
+  Function: run_tiles
+
+  Deals out the tiles to the deques of the calculating threads, starts the threads, and 
+  waits for them to finish every tile.
+
+  Input:
+          None
+  Output:
+          None
+*/
+static void run_tiles(){
+  uint32_t per;
+  int i;
+
+  // Give each thread an equal share of the tile slots (see tile_of_slot)
+  s_slots_per = per = (s_tiles_n+NUM_THREADS-1)/NUM_THREADS;
+  for (i=0; i < NUM_THREADS; i++)
+    atomic_init(&s_deques[i].range, PACK_RANGE(i*per, (i+1)*per));
+
+  pthread_barrier_wait(&s_start);
+  pthread_barrier_wait(&s_done);
+}
+
+
+/*
+  Function: calculate_passes
+
+  Calculates the escape values of the frame into s_progress in passes (see PASSES), using
+  the calculating threads. After every pass but the last, a preview is written at the
+  resolution of the pass. From the second pass on, the tiles are taken in order of the
+  detail found by the pass before, so that the edges of the set are refined first.
+
+  Input:
+          struct frame *frame: the frame being calculated, which names the previews
+          uint64_t start:      the time the frame was started
+  Output:
+          None (s_progress holds the escape values of the frame)
+*/
+static void calculate_passes(struct frame *frame, uint64_t start){
+  uint32_t t;
+  int p;
+
+  if (((s_progress = (float *) malloc((size_t) s_width*s_height*sizeof(float))) == NULL) ||
+      ((s_order == NULL) && ((s_order = (uint32_t *) malloc(s_tiles_n*sizeof(uint32_t))) == NULL))){
+    printf("Error allocating the passes!\n");
+    exit(-1);
+  }
+
+  for (p=0; p < PASSES; p++){
+    s_pass_step = PASS_STEP >> p;
+    if (p == 0)
+      for (t=0; t < s_tiles_n; t++)
+        s_order[t] = t;
+    else
+      order_tiles(s_pass_step);
+
+    run_tiles();
+
+    if ((s_pass_step > 1) && s_output)
+      write_preview(frame, s_pass_step, start);
+  }
+  s_pass_step = 0;
+}
+
+
+/*
+  Function: order_tiles
+
+  Sorts the tiles into s_order for a pass with the given step, by the largest difference 
+  between neighbouring samples of the pass before, which are 2*step apart.
+
+  Input:
+          int step: the step between the samples of the pass
+  Output:
+          None
+*/
+struct tile_score{
+  float score;
+  uint32_t tile;
+};
+
+static int compare_scores(const void *a, const void *b){
+  float sa = ((const struct tile_score *) a)->score;
+  float sb = ((const struct tile_score *) b)->score;
+
+  return (sa < sb) - (sa > sb);
+}
+
+static void order_tiles(int step){
+  struct tile_score *scores;
+  const float *v;
+  uint32_t t, x, y, x0, y0, x1, y1, c = 2*step;
+  float d, m;
+
+  if ((scores = (struct tile_score *) malloc(s_tiles_n*sizeof(struct tile_score))) == NULL){
+    printf("Error allocating the passes!\n");
+    exit(-1);
+  }
+
+  for (t=0; t < s_tiles_n; t++){
+    x0 = (t % s_tiles_x)*s_tile_w;
+    y0 = (t / s_tiles_x)*s_tile_h;
+    x1 = (x0+s_tile_w > s_width) ? s_width : x0+s_tile_w;
+    y1 = (y0+s_tile_h > s_height) ? s_height : y0+s_tile_h;
+
+    // The samples inside the tile, and the next ones across and down
+    m = 0.0;
+    for (y = (y0+c-1)/c*c; y < y1; y += c){
+      v = &s_progress[(size_t) y*s_width];
+      for (x = (x0+c-1)/c*c; x < x1; x += c){
+        if (x+c < s_width){
+          d = fabsf(v[x+c] - v[x]);
+          m = (d > m) ? d : m;
+        }
+        if (y+c < s_height){
+          d = fabsf(v[x+(size_t)c*s_width] - v[x]);
+          m = (d > m) ? d : m;
+        }
+      }
+    }
+    scores[t] = (struct tile_score){m, t};
+  }
+
+  qsort(scores, s_tiles_n, sizeof(struct tile_score), compare_scores);
+  for (t=0; t < s_tiles_n; t++)
+    s_order[t] = scores[t].tile;
+  free(scores);
+}
+
+
+/*
+  Function: calculate_pass_tile
+
+  Calculates the samples of the current pass which lie in a tile into s_progress. These
+  are the pixels on the rows and columns which are multiples of s_pass_step, less those
+  on multiples of twice the step, which were found by the passes before.
+
+  Input: 
+        int tile: the tile number, counted across each band and then down the image
+  Output:
+        None
+*/
+static void calculate_pass_tile(int tile){
+  uint64_t start;
+  uint32_t x0, y0, w, h, y, xs, off, dx, step = s_pass_step;
+
+  x0 = (tile % s_tiles_x)*s_tile_w;
+  y0 = (tile / s_tiles_x)*s_tile_h;
+  w  = (x0+s_tile_w > s_width) ? s_width-x0 : s_tile_w;
+  h  = (y0+s_tile_h > s_height) ? s_height-y0 : s_tile_h;
+
+  start = clock_ns();
+  for (y = (y0+step-1)/step*step; y < y0+h; y += step){
+    // Skip the samples of the last pass, every other one of the rows it covered
+    if ((step < PASS_STEP) && (y % (2*step) == 0))
+      off = step, dx = 2*step;
+    else
+      off = 0, dx = step;
+    xs = x0 + (off + dx - x0 % dx) % dx;
+    if (xs < x0+w)
+      span_fn(y, xs, (x0+w-xs+dx-1)/dx, dx, 0, &s_progress[(size_t) y*s_width+xs]);
+  }
+  start = clock_ns() - start;
+  t_compute_ns += start;
+  t_stats->tiles++;
+}
+
+
+/*
+  Function: sweep_frames
+
+  Calculates frame f of the batch and the frames after it together, one exponent to a lane
+  of sweep_fn, when they are set up for the complex kernel. Up to s_sweep_width frames are
+  swept, as many as fit in SWEEP_WINDOWS band windows, and each is then read from its 
+  buffer in s_sweep_out as it comes to be written. A sweep of a single frame gains nothing,
+  so it is left to be calculated by itself.
+
+  Input:
+        uint32_t f: the frame number, which has been set up
+  Output:
+        None (frames s_sweep_first up to s_sweep_end are in s_sweep_out)
+*/
+static void sweep_frames(uint32_t f){
+  uint32_t k;
+
+  s_sweep_first = s_sweep_end = f;
+  if ((sweep_fn == NULL) || s_deep)
+    return;
+
+  // The frames after f share its kernel while their exponents are not integers
+  for (k=0; (k < s_sweep_width) && (f+k < s_frames) &&
+            ((uint64_t)(k+1)*s_height <= (uint64_t) SWEEP_WINDOWS*s_window*s_tile_h); k++){
+    set_frame(f+k);
+    if (int_power() != 0)
+      break;
+    s_sweep_r[k] = s_power_r;
+    s_sweep_i[k] = s_power_i;
+  }
+  set_frame(f);
+  if (k < 2)
+    return;
+
+  for (s_sweep_n=0; s_sweep_n < k; s_sweep_n++)
+    if (s_sweep_out[s_sweep_n] == NULL)
+      s_sweep_out[s_sweep_n] = (float *) grow(NULL, (size_t) s_width*s_height*sizeof(float));
+  run_tiles();
+  s_sweep_n = 0;
+  s_sweep_end = f+k;
+}
+
+
+/*
+  Function: calculate_sweep_tile
+
+  Calculates a tile of each frame of the sweep into its buffer in s_sweep_out.
+
+  Input:
+        int tile: the tile number, counted across each band and then down the image
+  Output:
+        None
+*/
+static void calculate_sweep_tile(int tile){
+  uint64_t start;
+  uint32_t x0, y0, w, h, y;
+
+  x0 = (tile % s_tiles_x)*s_tile_w;
+  y0 = (tile / s_tiles_x)*s_tile_h;
+  w  = (x0+s_tile_w > s_width) ? s_width-x0 : s_tile_w;
+  h  = (y0+s_tile_h > s_height) ? s_height-y0 : s_tile_h;
+
+  start = clock_ns();
+  for (y=y0; y < y0+h; y++)
+    sweep_fn(y, x0, w);
+  start = clock_ns() - start;
+  t_compute_ns += start;
+  t_stats->tiles++;
+}
+
+
+/*
+  Function: write_preview
+
+  Writes the samples of a pass to a PNG image at the resolution of the pass, named after 
+  the frame. The image is small, so it is written here with libpng rather than by the
+  output thread.
+
+  Input: 
+        struct frame *frame: the frame being calculated
+        int step:            the step between the samples of the pass
+        uint64_t start:      the time the frame was started
+  Output:
+        None
+*/
+static void write_preview(struct frame *frame, int step, uint64_t start){
+  char name[sizeof(frame->name)+32];
+  png_structp png;
+  png_infop info;
+  png_bytep vals;
+  png_FILE_p fp;
+  float *row;
+  uint32_t pw, ph, i, j;
+
+  pw = (s_width+step-1)/step;
+  ph = (s_height+step-1)/step;
+  snprintf(name, sizeof(name), "%s/Preview 1 in %d, %s", FOLDER, step*step,
+           frame->name + strlen(FOLDER) + 1);
+
+  if((fp = (png_FILE_p) fopen(name,"wb"))==NULL){
+    printf("File error creating file: %s\n", name);
+    _exit(-1);
+  }
+  if (((row = (float *) malloc(pw*sizeof(float))) == NULL) ||
+      ((vals = (png_bytep) malloc((size_t) pw*3*s_bit_depth/8 + sizeof(uint64_t))) == NULL)){
+    printf("Bad allocaion of row data!\n");
+    _exit(-1);
+  }
+  if (!(png=png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp) NULL, (png_error_ptr) NULL, (png_error_ptr) NULL))) {
+    printf("Oh No!!! Bad pointer png_ptr\n");
+    _exit(-1);
+  }
+  if (!(info=png_create_info_struct(png))) {
+    printf("Oh No!!! Bad pointer png_infop\n");
+    _exit(-1);
+  }
+  if (setjmp(png_jmpbuf(png)))
+    _abort("[write_preview] Error writing the preview");
+  png_init_io(png, fp);
+  png_set_compression_level(png, s_level);
+  png_set_IHDR(png, info, pw, ph, s_bit_depth, COLOR_TYPE, INTERLACING,
+               PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  png_write_info(png, info);
+
+  for (j=0; j < ph; j++){
+    for (i=0; i < pw; i++)
+      row[i] = s_progress[(size_t) j*step*s_width + i*step];
+    color_row(row, pw, vals);
+    png_write_row(png, vals);
+  }
+
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+  fclose((FILE *) fp);
+  free(row);
+  free(vals);
+
+  printf("Preview %ux%u after %.3f seconds: %s\n", pw, ph, 1e-9*(clock_ns() - start), name);
+}
+
+
+/*
+  Function: handle_pthread
+
+  For each frame, this function takes tiles from the deque of this thread, and steals from
+  the other threads once it is empty. Each tile is calculated with calculate_tile. When no
+  thread has any tiles left, the counts of the thread are added to the totals of the frame
+  and to its statistics, and the thread waits for the next frame. The function returns once s_quit is set.
+
+  Input: 
+        void *ptr_index: pointer to the int index of this thread, and its deque
+  Output:
+        NULL
+*/
+void *handle_pthread(void *ptr_index){
+  uint64_t start;
+  int self, tile;
+
+  self = *((int *) ptr_index);
+  t_stats = &s_stats[self];
+  t_remote_fd = -1;
+  t_remote_worker = (s_workers_n > 0) ? self % s_workers_n : 0;
+  place_thread(self);
+  pool_fill(&s_escape_pools[t_node], (size_t) s_width*s_tile_h*sizeof(float), s_escape_fill);
+
+  for(;;){
+    pthread_barrier_wait(&s_start);
+    if (s_quit){
+      if (t_remote_fd >= 0)
+        close(t_remote_fd);
+      free_scratch();
+      break;
+    }
+
+    while((tile = next_tile(self)) >= 0){
+      if (s_pass_step > 0)
+        calculate_pass_tile(s_order[tile]);
+      else if (s_sweep_n > 0)
+        calculate_sweep_tile(tile);
+      else
+        calculate_tile(tile);
+    }
+
+    // Add the counts of this thread to the totals
+    pthread_mutex_lock(&s_out_lock);
+    s_interior.cardioid += t_interior.cardioid;
+    s_interior.bulb += t_interior.bulb;
+    s_interior.period += t_interior.period;
+    s_rebases += t_rebases;
+    s_filled += t_filled;
+    s_refined += t_refined;
+    s_reused += t_reused;
+    s_mirrored += t_mirrored;
+    s_iters += t_iters;
+    s_compute_ns += t_compute_ns;
+    s_encode_ns += t_encode_ns;
+    pthread_mutex_unlock(&s_out_lock);
+    t_stats->interior.cardioid += t_interior.cardioid;
+    t_stats->interior.bulb += t_interior.bulb;
+    t_stats->interior.period += t_interior.period;
+    t_stats->iterations += t_iters;
+    t_stats->compute_ns += t_compute_ns;
+    t_stats->encode_ns += t_encode_ns;
+    t_interior = (struct interior_count){0};
+    t_rebases = t_filled = t_refined = t_reused = t_mirrored = 0;
+    t_iters = t_compute_ns = t_encode_ns = 0;
+
+    start = clock_ns();
+    pthread_barrier_wait(&s_done);
+    t_stats->idle_ns += clock_ns() - start;
+  }
+
+  return NULL;
+}
+
+
+/*
+  Function: tile_of_slot
+
+  Thread t is given the slots [t*per, (t+1)*per), where per is s_slots_per. Slot j of a 
+  thread maps to tile j*NUM_THREADS+t, so that every thread starts at the top of the image. 
+  As stolen slots keep this mapping, the threads continue to work down the image together.
+
+  Input: 
+        uint32_t slot: the slot taken from a deque
+  Output:
+        int: the tile number, or -1 if the slot is past the last tile
+*/
+static int tile_of_slot(uint32_t slot){
+  uint32_t tile;
+
+  tile = (slot % s_slots_per)*NUM_THREADS + slot/s_slots_per;
+  return (tile < s_tiles_n) ? (int) tile : -1;
+}
+
+
+/*
+  Function: next_tile
+
+  Finds the next tile for a thread. The first slot of its own deque is taken if there is one.
+  Otherwise the other deques are visited, starting at a random thread, and the last half of
+  the first non-empty one is moved to this thread's deque.
+
+  Both ends of a deque are packed into one word, so taking or stealing is a single compare 
+  and swap. No slot is ever returned to a deque, so the ranges can not suffer from ABA.
+
+  Input: 
+        int self: index of the calling thread
+  Output:
+        int: the tile number, or -1 once every deque is empty
+*/
+static int next_tile(int self){
+  uint64_t range, stolen, start;
+  uint32_t first, last, half;
+  unsigned int seed;
+  int i, victim, tile;
+
+  seed = (unsigned int) self*2654435761u + 1;
+
+  for(;;){
+    // Take the first slot of our own deque
+    range = atomic_load_explicit(&s_deques[self].range, memory_order_relaxed);
+    while (RANGE_FIRST(range) < RANGE_LAST(range)){
+      if (atomic_compare_exchange_weak(&s_deques[self].range, &range,
+                                       PACK_RANGE(RANGE_FIRST(range)+1, RANGE_LAST(range)))){
+        if ((tile = tile_of_slot(RANGE_FIRST(range))) >= 0)
+          return tile;
+        range = atomic_load_explicit(&s_deques[self].range, memory_order_relaxed);
+      }
+    }
+
+    // Steal the last half of the slots of another thread
+    start = clock_ns();
+    stolen = 0;
+    victim = (int)(rand_r(&seed) % NUM_THREADS);
+    for (i=0; (i < NUM_THREADS) && (stolen == 0); i++, victim = (victim+1) % NUM_THREADS){
+      if (victim == self)
+        continue;
+      range = atomic_load(&s_deques[victim].range);
+      while ((first = RANGE_FIRST(range)) < (last = RANGE_LAST(range))){
+        half = (last-first+1)/2;
+        if (atomic_compare_exchange_weak(&s_deques[victim].range, &range,
+                                         PACK_RANGE(first, last-half))){
+          stolen = PACK_RANGE(last-half, last);
+          break;
+        }
+      }
+    }
+    t_stats->steal_ns += clock_ns() - start;
+    if (stolen == 0)
+      return -1;
+    t_stats->steals++;
+    atomic_store(&s_deques[self].range, stolen);
+  }
+}
+
+
+/*
+  Function: calculate_tile
+
+  Calculates the escape values of a single tile into the buffer of its band, either in full
+  or by subdivision (see subdivide_tile), or reads them from the cache or the passes of
+  a progressive render. Pixels shared with the previous frame in the cache are copied, 
+  and only the others calculated (see reuse_tile). New values are
+  stored in the cache when it is in use. The tile is not started until its band is inside
+  the window of bands which may be held in memory.
+
+  The buffer is allocated by whichever tile of the band starts first. The thread which 
+  finishes the last tile of a band supersamples its edges with refine_band, when enabled,
+  colors and compresses its rows with encode_band, unless there is no output, and passes
+  them to the output thread. The time spent on each is
+  counted for the thread.
+
+  Input: 
+        int tile: the tile number, counted across each band and then down the image
+  Output:
+        None
+*/
+static void calculate_tile(int tile){
+  struct band *band;
+  float *escapes, *expected;
+  uint64_t start;
+  uint32_t b, x0, y0, w, h, y;
+
+  b  = tile / s_tiles_x;
+  x0 = (tile % s_tiles_x)*s_tile_w;
+  y0 = b*s_tile_h;
+  w  = (x0+s_tile_w > s_width) ? s_width-x0 : s_tile_w;
+  h  = (y0+s_tile_h > s_height) ? s_height-y0 : s_tile_h;
+  band = &s_bands[b];
+
+  wait_for_window(b);
+  start = clock_ns();
+
+  // Take the escape values of the band from the pool, unless another tile already has
+  if ((escapes = atomic_load(&band->escapes)) == NULL){
+    escapes = (float *) pool_get(&s_escape_pools[t_node], (size_t) s_width*s_tile_h*sizeof(float));
+    expected = NULL;
+    if (atomic_compare_exchange_strong(&band->escapes, &expected, escapes))
+      band->pool = &s_escape_pools[t_node];
+    else{
+      pool_put(&s_escape_pools[t_node], escapes);
+      escapes = expected;
+    }
+  }
+
+  if (s_cache_in != NULL)
+    for (y=0; y < h; y++)
+      memcpy(&escapes[y*s_width+x0], &s_cache_in[(size_t)(y0+y)*s_width+x0], w*sizeof(float));
+  else if (s_sweep_in != NULL)
+    for (y=0; y < h; y++)
+      memcpy(&escapes[y*s_width+x0], &s_sweep_in[(size_t)(y0+y)*s_width+x0], w*sizeof(float));
+  else if (s_progress != NULL)
+    for (y=0; y < h; y++)
+      memcpy(&escapes[y*s_width+x0], &s_progress[(size_t)(y0+y)*s_width+x0], w*sizeof(float));
+  else if (s_workers_n > 0){
+    if (!mirror_tile(escapes, y0, x0, w, h, 0))
+      remote_tile(escapes, y0, x0, w, h);
+  }
+  else if (s_prev != NULL)
+    reuse_tile(escapes, y0, x0, w, h);
+  else if (s_ms)
+    subdivide_tile(escapes, y0, x0, w, h);
+  else if (!mirror_tile(escapes, y0, x0, w, h, 1))
+    for (y=0; y < h; y++)
+      span_fn(y0+y, x0, w, 1, 0, &escapes[y*s_width+x0]);
+  keep_rows(escapes, y0, x0, w, h);
+
+  // Store the values in the cache
+  if (s_cache_out != NULL)
+    for (y=0; y < h; y++)
+      memcpy(&s_cache_out[(size_t)(y0+y)*s_width+x0], &escapes[y*s_width+x0], w*sizeof(float));
+  if (s_keyframe != NULL)
+    for (y=0; y < h; y++)
+      memcpy(&s_keyframe[(size_t)(y0+y)*s_width+x0], &escapes[y*s_width+x0], w*sizeof(float));
+  start = clock_ns() - start;
+  t_compute_ns += start;
+  t_stats->tiles++;
+  t_stats->band_ns[b] += start;
+  if (start < t_stats->tile_min_ns)
+    t_stats->tile_min_ns = start;
+  if (start > t_stats->tile_max_ns)
+    t_stats->tile_max_ns = start;
+
+  // The last tile of the band to finish refines and compresses it, and hands it to the output thread
+  if (atomic_fetch_sub(&band->remaining, 1) == 1){
+    if (s_ss){
+      start = clock_ns();
+      refine_band(band, escapes, b, h);
+      start = clock_ns() - start;
+      t_compute_ns += start;
+      t_stats->band_ns[b] += start;
+    }
+    if (s_output){
+      start = clock_ns();
+      encode_band(band, escapes, b, h);
+      t_encode_ns += clock_ns() - start;
+    }
+    pool_put(band->pool, escapes);
+
+    pthread_mutex_lock(&s_out_lock);
+    band->ready = 1;
+    pthread_cond_broadcast(&s_out_cond);
+    pthread_mutex_unlock(&s_out_lock);
+  }
+}
+
+
+/*
+  Function: wait_for_window
+
+  Waits until band b of the current frame is less than s_window bands past the next band
+  to be written, so that the threads can not run ahead of the output and hold more than 
+  s_window bands in memory.
+
+  This can not deadlock. The slots of a deque map to tiles in increasing order, so the 
+  tile a thread holds always comes before the tiles left in its deque. The tiles of the 
+  band being written are therefore either held by a thread, which is not waiting, or left
+  in a deque whose thread holds an earlier tile and is not waiting either.
+
+  Input: 
+        uint32_t b: the band of the tile about to be calculated
+  Output:
+        None
+*/
+static void wait_for_window(uint32_t b){
+  struct frame *frame = s_frame;
+  uint64_t start;
+
+  if (b < atomic_load(&frame->written) + s_window)
+    return;
+
+  start = clock_ns();
+  pthread_mutex_lock(&s_out_lock);
+  while (b >= atomic_load(&frame->written) + s_window)
+    pthread_cond_wait(&s_out_cond, &s_out_lock);
+  pthread_mutex_unlock(&s_out_lock);
+  t_stats->window_ns += clock_ns() - start;
+}
+
+
+/*
+  Function: subdivide_tile
+
+  Calculates a tile using Mariani-Silver subdivision. Only the border of the tile is 
+  calculated here, and the inside is left to subdivide_rect.
+
+  Input: 
+        float *escapes:  the escape values of the band holding the tile
+        int y0:          the first row of the band, and of the tile
+        int x0:          the first column of the tile
+        int w, h:        the size of the tile
+  Output:
+        None
+*/
+static void subdivide_tile(float *escapes, int y0, int x0, int w, int h){
+  span_fn(y0, x0, w, 1, 0, &escapes[x0]);
+  if (h > 1)
+    span_fn(y0+h-1, x0, w, 1, 0, &escapes[(h-1)*s_width+x0]);
+  if (h > 2){
+    span_fn(y0+1, x0, h-2, 0, 1, &escapes[s_width+x0]);
+    if (w > 1)
+      span_fn(y0+1, x0+w-1, h-2, 0, 1, &escapes[s_width+x0+w-1]);
+  }
+
+  subdivide_rect(escapes, y0, x0, 0, x0+w-1, h-1, 0);
+}
+
+
+/*
+  Function: subdivide_rect
+
+  Fills the inside of a rectangle whose border has already been calculated, when every
+  pixel of the border is in the set, or every pixel lies in the same escape band. Otherwise
+  the rectangle is split into four by a row and a column through its center, which are 
+  calculated, and each part is handled in turn.
+
+  A filled rectangle of the set is set to 1.0. A filled band of escaped pixels takes the 
+  bilinear interpolation of the values at its corners, which stays within the band.
+
+  As a guard against a part of the set, or a hole in it, lying wholly inside a uniform 
+  border, a rectangle is only filled once s_ms_guard of the rectangles holding it have also
+  had uniform borders. The row and column through each of those rectangles must then agree 
+  with the border as well. For a connected set one level is enough to detect a rectangle 
+  holding the whole set, while for other exponents the lines through the quarters are 
+  checked too. The lines are needed to split the rectangle anyway, so the guard only costs
+  the pixels of the lines when a rectangle is filled.
+
+  Input: 
+        float *escapes:  the escape values of the band holding the rectangle
+        int y0:          the first row of the band
+        int xa, ya:      the upper left corner of the rectangle, as a column and a row of the band
+        int xb, yb:      the lower right corner of the rectangle, included in the rectangle
+        int level:       the number of rectangles holding this one with uniform borders
+  Output:
+        None
+*/
+static void subdivide_rect(float *escapes, int y0, int xa, int ya, int xb, int yb, int level){
+  float *row;
+  double v00, v01, v10, v11, u, v;
+  int x, y, xm, ym, band, uniform;
+
+  // There is nothing inside the border
+  if ((xb-xa < 2) || (yb-ya < 2))
+    return;
+
+  // Test whether the border lies in a single band
+  band = escape_band(escapes[ya*s_width+xa]);
+  uniform = 1;
+  for (x=xa; (x <= xb) && uniform; x++)
+    uniform = (escape_band(escapes[ya*s_width+x]) == band) &&
+              (escape_band(escapes[yb*s_width+x]) == band);
+  for (y=ya+1; (y < yb) && uniform; y++)
+    uniform = (escape_band(escapes[y*s_width+xa]) == band) &&
+              (escape_band(escapes[y*s_width+xb]) == band);
+
+  if (uniform && (level >= s_ms_guard)){
+    v00 = escapes[ya*s_width+xa];
+    v01 = escapes[ya*s_width+xb];
+    v10 = escapes[yb*s_width+xa];
+    v11 = escapes[yb*s_width+xb];
+    for (y=ya+1; y < yb; y++){
+      row = &escapes[y*s_width];
+      v = (double)(y-ya)/(yb-ya);
+      for (x=xa+1; x < xb; x++){
+        u = (double)(x-xa)/(xb-xa);
+        row[x] = (band < 0) ? 1.0 :
+          (1.0-v)*((1.0-u)*v00 + u*v01) + v*((1.0-u)*v10 + u*v11);
+      }
+    }
+    t_filled += (uint64_t)(xb-xa-1)*(yb-ya-1);
+    return;
+  }
+
+  // Small rectangles are not worth splitting again
+  if ((xb-xa <= MS_MIN) || (yb-ya <= MS_MIN)){
+    for (y=ya+1; y < yb; y++)
+      span_fn(y0+y, xa+1, xb-xa-1, 1, 0, &escapes[y*s_width+xa+1]);
+    return;
+  }
+
+  // Split the rectangle, calculating the new borders
+  xm = (xa+xb)/2;
+  ym = (ya+yb)/2;
+  span_fn(y0+ym, xa+1, xb-xa-1, 1, 0, &escapes[ym*s_width+xa+1]);
+  span_fn(y0+ya+1, xm, ym-ya-1, 0, 1, &escapes[(ya+1)*s_width+xm]);
+  span_fn(y0+ym+1, xm, yb-ym-1, 0, 1, &escapes[(ym+1)*s_width+xm]);
+
+  level = uniform ? level+1 : 0;
+  subdivide_rect(escapes, y0, xa, ya, xm, ym, level);
+  subdivide_rect(escapes, y0, xm, ya, xb, ym, level);
+  subdivide_rect(escapes, y0, xa, ym, xm, yb, level);
+  subdivide_rect(escapes, y0, xm, ym, xb, yb, level);
+}
+
+
+/*
+  Function: escape_band
+
+  Finds the escape band of a pixel, the whole part of the smoothed iteration count modN 
+  which is recovered from the escape value by inverting escape_value.
+
+  Input: 
+        double v: the escape value of the pixel
+  Output:
+        int: the escape band of the pixel, or -1 if it is in the set
+*/
+static int escape_band(double v){
+  if (v >= 1.0)
+    return -1;
+  return (int) exp(v*v*log((double) s_depth));
+}
+
+
+/*
+  Function: handle_output
+
+  This function writes the frames to their PNG images in order, using write_frame, or 
+  passes over them with discard_frame when there is no output. Each frame is waited for 
+  until calc_image has passed it on, and its place in the queue is freed once it has been
+  written. A tile of the tile server is handed to the requests waiting for it.
+
+  Input: 
+        void *unused: required by pthread
+  Output:
+        NULL
+*/
+void *handle_output(void *unused){
+  struct frame *frame;
+  uint32_t f;
+
+  place_thread(-1);
+  for (f=0; f < s_frames; f++){
+    frame = &s_queue[f % FRAMES_QUEUED];
+
+    pthread_mutex_lock(&s_out_lock);
+    while (s_frames_queued <= f)
+      pthread_cond_wait(&s_out_cond, &s_out_lock);
+    pthread_mutex_unlock(&s_out_lock);
+
+    if (s_output)
+      write_frame(frame);
+    else
+      discard_frame(frame);
+    if (frame->tile != NULL)
+      finish_tile(frame);
+
+    pthread_mutex_lock(&s_out_lock);
+    s_frames_written++;
+    pthread_cond_broadcast(&s_out_cond);
+    pthread_mutex_unlock(&s_out_lock);
+  }
+  return NULL; // Required from pthread
+}
+
+
+/*
+  Function: write_frame
+
+  This function creates the PNG image of a frame. The rows of each band have already been
+  filtered and compressed by the calculating threads into a piece of a single zlib stream
+  (see encode_band), so this thread only has to write them out in order. The stream is 
+  written as a series of IDAT chunks: the zlib header, one chunk for each band, and the 
+  Adler-32 checksum of the whole image, which is combined from the checksums of the bands.
+
+  Each band written moves the window of bands the calculating threads may work on (see 
+  wait_for_window). The time taken is added to s_write_ns, less the time spent waiting 
+  for the bands.
+
+  Input: 
+        struct frame *frame: the frame to write
+  Output:
+        None
+*/
+static void write_frame(struct frame *frame){
+  static png_byte idat[5] = {'I', 'D', 'A', 'T', '\0'};
+  static png_byte iend[5] = {'I', 'E', 'N', 'D', '\0'};
+  png_byte header[2], trailer[4];
+  struct band *band;
+  png_FILE_p fp;
+  png_infop info_ptr;
+  uLong adler;
+  uint64_t start, waited;
+  uint32_t b;
+
+  start = clock_ns();
+  waited = 0;
+
+  // A tile of the tile server is written to memory
+  if (frame->tile != NULL)
+    fp = (png_FILE_p) open_memstream(&frame->png, &frame->png_len);
+  else
+    fp = (png_FILE_p) fopen(frame->name,"wb");
+  if(fp==NULL){
+    printf("File error creating file: %s\n", frame->name);
+    _exit(-1);
+  }
+
+  // Initialize the PNG file which will hold the Mandelbrot image
+  if (!(png_ptr=png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp) NULL, (png_error_ptr) NULL, (png_error_ptr) NULL))) {
+    printf("Oh No!!! Bad pointer png_ptr\n");
+    _exit(-1);
+  }
+  if (!(info_ptr=png_create_info_struct(png_ptr))) {
+    printf("Oh No!!! Bad pointer png_infop\n");
+    _exit(-1);
+  }
+  if (setjmp(png_jmpbuf(png_ptr)))
+    _abort("[write_png_file] Error during init_io");
+  png_init_io(png_ptr,fp);
+  if (setjmp(png_jmpbuf(png_ptr)))
+    _abort("[write_png_file] Error during set IHDR");
+  // Set the type of png file based on the defaults, the specified size, and bit depth
+  png_set_IHDR(png_ptr, info_ptr, s_width, s_height,
+               s_bit_depth, COLOR_TYPE, INTERLACING,
+               PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+  if (setjmp(png_jmpbuf(png_ptr)))
+    _abort("[write_png_file] Error during write info");
+  png_write_info(png_ptr,info_ptr);
+
+  if (setjmp(png_jmpbuf(png_ptr)))
+    _abort("[write_png_file] Error during write IDAT");
+
+  // The zlib header: deflate with a 32K window, and the level used
+  header[0] = 0x78;
+  header[1] = (s_level < 2) ? 0x00 : (s_level < 6) ? 0x40 : (s_level == 6) ? 0x80 : 0xC0;
+  header[1] += 31 - (header[0]*256 + header[1]) % 31;
+  png_write_chunk(png_ptr, idat, header, sizeof(header));
+
+  adler = adler32(0L, Z_NULL, 0);
+  for (b=0; b < s_bands_n; b++){
+    band = &frame->bands[b];
+
+    waited -= clock_ns();
+    pthread_mutex_lock(&s_out_lock);
+    while (!band->ready)
+      pthread_cond_wait(&s_out_cond, &s_out_lock);
+    pthread_mutex_unlock(&s_out_lock);
+    waited += clock_ns();
+
+    png_write_chunk(png_ptr, idat, band->idat, band->idat_len);
+    adler = adler32_combine(adler, band->adler, (z_off_t) band->raw_len);
+    if (band->idat_size == s_idat_pool.size)
+      pool_put(&s_idat_pool, band->idat);
+    else
+      free(band->idat);
+
+    // Let the calculating threads move on to the next band
+    pthread_mutex_lock(&s_out_lock);
+    atomic_store(&frame->written, b+1);
+    pthread_cond_broadcast(&s_out_cond);
+    pthread_mutex_unlock(&s_out_lock);
+  }
+
+  // Write the checksum which ends the zlib stream, and the end of file for the PNG image
+  png_save_uint_32(trailer, (png_uint_32) adler);
+  png_write_chunk(png_ptr, idat, trailer, sizeof(trailer));
+  if (setjmp(png_jmpbuf(png_ptr)))
+    _abort("[write_png_file] Error during ending");
+  png_write_chunk(png_ptr, iend, NULL, 0);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  // Close the file
+  fclose((FILE *) fp);
+  s_write_ns += clock_ns() - start - waited;
+  s_out_wait_ns += waited;
+}
+
+
+/*
+  Function: discard_frame
+
+  Takes the place of write_frame when there is no output. The bands of the frame are 
+  waited for in order, so that the window of bands moves on as it would while writing.
+
+  Input: 
+        struct frame *frame: the frame to pass over
+  Output:
+        None
+*/
+static void discard_frame(struct frame *frame){
+  uint64_t start;
+  uint32_t b;
+
+  start = clock_ns();
+  pthread_mutex_lock(&s_out_lock);
+  for (b=0; b < s_bands_n; b++){
+    while (!frame->bands[b].ready)
+      pthread_cond_wait(&s_out_cond, &s_out_lock);
+    atomic_store(&frame->written, b+1);
+    pthread_cond_broadcast(&s_out_cond);
+  }
+  pthread_mutex_unlock(&s_out_lock);
+  s_out_wait_ns += clock_ns() - start;
+}
+
+
+/*
+  Function: write_json
+
+  Adds the timing of the run to the file s_json_path as a single line of JSON, so that
+  the runs of different builds can be compared. The times of the calculating threads are
+  summed over the threads.
+
+  Input: 
+        double seconds: the wall time of the run
+  Output:
+        None
+*/
+static void write_json(double seconds){
+  FILE *fp;
+
+  if ((fp = fopen(s_json_path, "a")) == NULL){
+    printf("File error opening: %s\n", s_json_path);
+    return;
+  }
+  fprintf(fp, "{\"kernel\": \"%s\", \"width\": %u, \"height\": %u, \"frames\": %u, "
+          "\"precision\": \"%s\", \"threads\": %u, \"pin\": \"%s\", \"nodes\": %u, "
+          "\"tile\": \"%ux%u\", \"output\": \"%s\", "
+          "\"wall_s\": %.6f, \"compute_s\": %.6f, \"encode_s\": %.6f, "
+          "\"write_s\": %.6f, \"reference_s\": %.6f, \"iterations\": %llu, "
+          "\"mpixels_per_s\": %.3f, \"miterations_per_s\": %.3f}\n",
+          s_kernel, s_width, s_height, s_frames, s_deep ? "perturbation" : s_precision_names[s_precision],
+          NUM_THREADS, s_pin_mode, s_nodes_n, s_tile_w, s_tile_h,
+          s_output_mode, seconds, 1e-9*s_compute_ns, 1e-9*s_encode_ns, 1e-9*s_write_ns,
+          1e-9*s_reference_ns, (unsigned long long) s_iters,
+          1e-6*s_frames*s_width*s_height/seconds, 1e-6*s_iters/seconds);
+  fclose(fp);
+}
+
+
+/*
+  Function: print_stats
+
+  Prints the statistics of the calculating threads and the output thread for the run, 
+  either as a summary or as a single line of JSON. When the calculating threads spent more
+  than a quarter of their time waiting for the window, the run is judged to be limited by
+  the output if the output thread spent longer writing than waiting for bands, and by the
+  encoding of the bands otherwise. When they spent more than a quarter of it stealing or 
+  waiting for the other threads it is limited by imbalance, and otherwise by whichever of
+  calculating or encoding took longer.
+
+  Input: 
+        double seconds: the wall time of the run
+  Output:
+        None
+*/
+static void print_stats(double seconds){
+  struct thread_stats all, *t;
+  uint64_t *band_ns, calculated, slowest;
+  const char *limit;
+  double capacity;
+  int json, i, k;
+  uint32_t b;
+
+  if ((band_ns = (uint64_t *)calloc(s_bands_n, sizeof(uint64_t))) == NULL){
+    printf("Error allocating the statistics!\n");
+    return;
+  }
+
+  // Add up the threads
+  memset(&all, 0, sizeof(all));
+  all.tile_min_ns = UINT64_MAX;
+  for (i=0; i < NUM_THREADS; i++){
+    t = &s_stats[i];
+    all.tiles += t->tiles;
+    all.compute_ns += t->compute_ns;
+    all.encode_ns += t->encode_ns;
+    all.steals += t->steals;
+    all.steal_ns += t->steal_ns;
+    all.window_ns += t->window_ns;
+    all.idle_ns += t->idle_ns;
+    all.escaped += t->escaped;
+    all.min_r += t->min_r;
+    all.depth += t->depth;
+    all.interior.cardioid += t->interior.cardioid;
+    all.interior.bulb += t->interior.bulb;
+    all.interior.period += t->interior.period;
+    if (t->tile_min_ns < all.tile_min_ns)
+      all.tile_min_ns = t->tile_min_ns;
+    if (t->tile_max_ns > all.tile_max_ns)
+      all.tile_max_ns = t->tile_max_ns;
+    for (k=0; k < HIST_BINS; k++)
+      all.hist[k] += t->hist[k];
+    for (b=0; b < s_bands_n; b++)
+      band_ns[b] += t->band_ns[b];
+  }
+  if (all.tiles == 0)
+    all.tile_min_ns = 0;
+  calculated = all.escaped + all.interior.cardioid + all.interior.bulb + all.interior.period +
+               all.min_r + all.depth;
+  for (slowest=0, b=1; b < s_bands_n; b++)
+    if (band_ns[b] > band_ns[slowest])
+      slowest = b;
+
+  capacity = 1e9*seconds*NUM_THREADS;
+  if (all.window_ns > 0.25*capacity)
+    limit = (s_write_ns > s_out_wait_ns) ? "output" : "encoding";
+  else if (all.steal_ns + all.idle_ns > 0.25*capacity)
+    limit = "imbalance";
+  else
+    limit = (all.encode_ns > all.compute_ns) ? "encoding" : "compute";
+
+  json = (strcmp(s_stats_mode, "json") == 0);
+  if (json){
+    printf("{\"pixels\": {\"calculated\": %llu, \"escaped\": %llu, \"cardioid\": %llu, "
+           "\"bulb\": %llu, \"periodic\": %llu, \"min_r\": %llu, \"depth\": %llu}, \"histogram\": [",
+           (unsigned long long) calculated, (unsigned long long) all.escaped,
+           (unsigned long long) all.interior.cardioid, (unsigned long long) all.interior.bulb,
+           (unsigned long long) all.interior.period, (unsigned long long) all.min_r,
+           (unsigned long long) all.depth);
+    for (k=0; k < HIST_BINS; k++)
+      printf("%s%llu", (k > 0) ? ", " : "", (unsigned long long) all.hist[k]);
+    printf("], \"threads\": [");
+    for (i=0; i < NUM_THREADS; i++){
+      t = &s_stats[i];
+      printf("%s{\"tiles\": %llu, \"tile_min_s\": %.6f, \"tile_max_s\": %.6f, \"compute_s\": %.6f, "
+             "\"encode_s\": %.6f, \"iterations\": %llu, \"steals\": %llu, \"steal_s\": %.6f, "
+             "\"window_s\": %.6f, \"idle_s\": %.6f, \"cpu\": %d, \"node\": %d}", (i > 0) ? ", " : "",
+             (unsigned long long) t->tiles, (t->tiles > 0) ? 1e-9*t->tile_min_ns : 0.0,
+             1e-9*t->tile_max_ns, 1e-9*t->compute_ns, 1e-9*t->encode_ns,
+             (unsigned long long) t->iterations, (unsigned long long) t->steals,
+             1e-9*t->steal_ns, 1e-9*t->window_ns, 1e-9*t->idle_ns, t->cpu, t->node);
+    }
+    printf("], \"band_s\": [");
+    for (b=0; b < s_bands_n; b++)
+      printf("%s%.6f", (b > 0) ? ", " : "", 1e-9*band_ns[b]);
+    printf("], \"output_wait_s\": %.6f, \"output_write_s\": %.6f, \"allocations\": %llu, "
+           "\"allocations_after_first\": %llu, \"limited_by\": \"%s\"}\n",
+           1e-9*s_out_wait_ns, 1e-9*s_write_ns, (unsigned long long) atomic_load(&s_allocs),
+           (unsigned long long)(atomic_load(&s_allocs) - s_allocs_first), limit);
+  }
+  else{
+    printf("Pixels calculated: %llu, %llu escaped, %llu interior, %llu below MIN_R, %llu reached DEPTH\n",
+           (unsigned long long) calculated, (unsigned long long) all.escaped,
+           (unsigned long long)(all.interior.cardioid + all.interior.bulb + all.interior.period),
+           (unsigned long long) all.min_r, (unsigned long long) all.depth);
+    printf("Iterations of the escaped pixels:\n");
+    for (k=0; k < HIST_BINS; k++)
+      if (all.hist[k] > 0)
+        printf("  %10llu to %10llu: %llu (%.1f%%)\n", 1ULL << k, (2ULL << k) - 1,
+               (unsigned long long) all.hist[k], 100.0*all.hist[k]/all.escaped);
+    for (i=0; i < NUM_THREADS; i++){
+      t = &s_stats[i];
+      printf("Thread %d: %llu tiles of %.3f to %.3f ms, %.3f s compute, %.3f s encode, "
+             "%.3f s stealing (%llu steals), %.3f s waiting for the window, %.3f s idle",
+             i, (unsigned long long) t->tiles, (t->tiles > 0) ? 1e-6*t->tile_min_ns : 0.0,
+             1e-6*t->tile_max_ns, 1e-9*t->compute_ns, 1e-9*t->encode_ns, 1e-9*t->steal_ns,
+             (unsigned long long) t->steals, 1e-9*t->window_ns, 1e-9*t->idle_ns);
+      if (t->cpu >= 0)
+        printf(", on CPU %d of node %d", t->cpu, t->node);
+      printf("\n");
+    }
+
+    // The scaling across nodes, from the rate of iterations of their threads
+    for (k=0; s_pin && (k < MAX_NODES); k++){
+      struct thread_stats node = {0};
+      uint32_t n = 0;
+
+      for (i=0; i < NUM_THREADS; i++)
+        if (s_stats[i].node == k){
+          n++;
+          node.tiles += s_stats[i].tiles;
+          node.iterations += s_stats[i].iterations;
+          node.compute_ns += s_stats[i].compute_ns;
+          node.window_ns += s_stats[i].window_ns;
+        }
+      if (n > 0)
+        printf("Node %d: %u threads, %llu tiles, %.1f Miterations/s per thread, %.3f s waiting for the window\n",
+               k, n, (unsigned long long) node.tiles,
+               (node.compute_ns > 0) ? 1e3*node.iterations/node.compute_ns : 0.0, 1e-9*node.window_ns);
+    }
+    printf("Bands: %.3f ms on average, the slowest is band %llu at %.3f ms\n",
+           1e-6*all.compute_ns/s_bands_n, (unsigned long long) slowest, 1e-6*band_ns[slowest]);
+    printf("Output thread: %.3f s waiting for bands, %.3f s writing\n",
+           1e-9*s_out_wait_ns, 1e-9*s_write_ns);
+    printf("Allocations: %llu buffers, %llu of them after the first frame\n",
+           (unsigned long long) atomic_load(&s_allocs),
+           (unsigned long long)(atomic_load(&s_allocs) - s_allocs_first));
+    printf("Limited by: %s\n", limit);
+  }
+  free(band_ns);
+}
+
+
+/*
+  Function: clock_ns
+
+  Input: 
+        None
+  Output:
+        uint64_t: the time of the monotonic clock in nanoseconds
+*/
+static uint64_t clock_ns(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+
+/*
+  Function: pool_get
+
+  Takes a buffer from a pool, allocating one when the pool is empty. Should the size of 
+  the buffers change, the free buffers are released first.
+
+  Input:
+        struct pool *pool: the pool
+        size_t size:       the size of the buffer
+  Output:
+        void *: the buffer, aligned to a cache line
+*/
+static void *pool_get(struct pool *pool, size_t size){
+  void *buf;
+
+  pthread_mutex_lock(&pool->lock);
+  if (size != pool->size){
+    pool_free(pool);
+    pool->size = size;
+  }
+  if ((buf = pool->free) != NULL)
+    pool->free = *(void **) buf;
+  pthread_mutex_unlock(&pool->lock);
+  if (buf != NULL)
+    return buf;
+
+  if ((buf = aligned_alloc(64, (size + 63) & ~(size_t) 63)) == NULL){
+    printf("Bad allocaion of band data!\n");
+    _exit(-1);
+  }
+  atomic_fetch_add(&s_allocs, 1);
+  return buf;
+}
+
+
+/*
+  Function: pool_put
+
+  Gives a buffer back to its pool.
+
+  Input:
+        struct pool *pool: the pool the buffer was taken from
+        void *buf:         the buffer
+  Output:
+        None
+*/
+static void pool_put(struct pool *pool, void *buf){
+  pthread_mutex_lock(&pool->lock);
+  *(void **) buf = pool->free;
+  pool->free = buf;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+  Function: pool_fill
+
+  Sets the size of the buffers of a pool, and adds n new buffers to it. The buffers are 
+  written as they are allocated, so that their pages are placed on the NUMA node of the 
+  calling thread.
+
+  Input:
+        struct pool *pool: the pool
+        size_t size:       the size of the buffers
+        uint32_t n:        the number of buffers to add
+  Output:
+        None
+*/
+static void pool_fill(struct pool *pool, size_t size, uint32_t n){
+  void *buf, *first, *last;
+
+  first = last = NULL;
+  for (; n > 0; n--){
+    if ((buf = aligned_alloc(64, (size + 63) & ~(size_t) 63)) == NULL){
+      printf("Bad allocaion of band data!\n");
+      _exit(-1);
+    }
+    memset(buf, 0, size);
+    atomic_fetch_add(&s_allocs, 1);
+    *(void **) buf = first;
+    if (first == NULL)
+      last = buf;
+    first = buf;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (size != pool->size){
+    pool_free(pool);
+    pool->size = size;
+  }
+  if (last != NULL){
+    *(void **) last = pool->free;
+    pool->free = first;
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+  Function: pool_free
+
+  Releases the free buffers of a pool. Called with the lock of the pool held, or once the
+  run is over.
+
+  Input:
+        struct pool *pool: the pool
+  Output:
+        None
+*/
+static void pool_free(struct pool *pool){
+  void *buf;
+
+  while ((buf = pool->free) != NULL){
+    pool->free = *(void **) buf;
+    free(buf);
+  }
+}
+
+
+/*
+  Function: grow
+
+  Grows a buffer of scratch space, counting the allocation.
+
+  Input:
+        void *buf:   the buffer, or NULL
+        size_t size: the new size
+  Output:
+        void *: the buffer, which may have moved
+*/
+static void *grow(void *buf, size_t size){
+  if ((buf = realloc(buf, size)) == NULL){
+    printf("Bad allocaion of band data!\n");
+    _exit(-1);
+  }
+  atomic_fetch_add(&s_allocs, 1);
+  return buf;
+}
+
+
+/*
+  Function: free_scratch
+
+  Releases the scratch space of a calculating thread, as it ends.
+
+  Input:
+        None
+  Output:
+        None
+*/
+static void free_scratch(){
+  free(t_scratch.raw);
+  free(t_scratch.row);
+  free(t_scratch.prev);
+  free(t_scratch.refined);
+  free(t_scratch.samples);
+  if (t_scratch.z_ready)
+    deflateEnd(&t_scratch.z);
+  memset(&t_scratch, 0, sizeof(t_scratch));
+}
+
+
+/*
+  Function: count_cpus
+
+  Finds the number of calculating threads for -t auto: the online CPUs which the process 
+  may run on, limited by the CPU quota of its cgroup, rounded up. The quota is read from 
+  cpu.max under cgroup v2, or from cpu.cfs_quota_us and cpu.cfs_period_us under v1.
+
+  Input:
+        None
+  Output:
+        uint32_t: the number of threads, at least one
+*/
+static uint32_t count_cpus(){
+  char line[512], path[640];
+  long long quota, period;
+  cpu_set_t set;
+  uint32_t n;
+  FILE *fp;
+
+  n = (uint32_t) sysconf(_SC_NPROCESSORS_ONLN);
+  if ((sched_getaffinity(0, sizeof(set), &set) == 0) && ((uint32_t) CPU_COUNT(&set) < n))
+    n = (uint32_t) CPU_COUNT(&set);
+
+  // Find the cgroup v2 of the process, in the unified hierarchy
+  snprintf(path, sizeof(path), "/sys/fs/cgroup/cpu.max");
+  if ((fp = fopen("/proc/self/cgroup", "r")) != NULL){
+    while (fgets(line, sizeof(line), fp) != NULL)
+      if (strncmp(line, "0::", 3) == 0){
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", (strcmp(line+3, "/") == 0) ? "" : line+3);
+        break;
+      }
+    fclose(fp);
+  }
+
+  quota = period = -1;
+  if ((fp = fopen(path, "r")) != NULL){
+    // "max 100000" when there is no quota
+    if (fscanf(fp, "%lld %lld", &quota, &period) != 2)
+      quota = -1;
+    fclose(fp);
+  }
+  else if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL){
+    if (fscanf(fp, "%lld", &quota) != 1)
+      quota = -1;
+    fclose(fp);
+    if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL){
+      if (fscanf(fp, "%lld", &period) != 1)
+        period = -1;
+      fclose(fp);
+    }
+  }
+  if ((quota > 0) && (period > 0) && ((uint32_t)((quota + period-1)/period) < n))
+    n = (uint32_t)((quota + period-1)/period);
+
+  return (n < 1) ? 1 : n;
+}
+
+
+/*
+  Function: find_cpus
+
+  Lists the CPUs the process may run on in s_cpus, ordered by their NUMA node as read from
+  /sys/devices/system/node, and finds the number of nodes the calculating threads will
+  span. CPUs which belong to no node listed there are put last, as node 0.
+
+  Input:
+        None
+  Output:
+        Returns 0 on success and -1 on failure
+*/
+static int find_cpus(){
+  char path[64], list[4096];
+  cpu_set_t allowed, node, placed;
+  int c, k, used[MAX_NODES];
+  uint32_t i;
+  FILE *fp;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+    printf("Error finding the CPUs of the process!\n");
+    return -1;
+  }
+  if (((s_cpus = (int *)malloc(CPU_COUNT(&allowed)*sizeof(int))) == NULL) ||
+      ((s_cpu_nodes = (int *)malloc(CPU_COUNT(&allowed)*sizeof(int))) == NULL)){
+    printf("Error allocating the CPUs!\n");
+    return -1;
+  }
+
+  CPU_ZERO(&placed);
+  s_cpus_n = 0;
+  for (k=0; k <= MAX_NODES; k++){
+    CPU_ZERO(&node);
+    if (k < MAX_NODES){
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", k);
+      if ((fp = fopen(path, "r")) == NULL)
+        continue;
+      if ((fgets(list, sizeof(list), fp) == NULL) || (parse_cpulist(list, &node) != 0))
+        CPU_ZERO(&node);
+      fclose(fp);
+    }
+    for (c=0; c < CPU_SETSIZE; c++)
+      if (CPU_ISSET(c, &allowed) && !CPU_ISSET(c, &placed) && ((k == MAX_NODES) || CPU_ISSET(c, &node))){
+        CPU_SET(c, &placed);
+        s_cpus[s_cpus_n] = c;
+        s_cpu_nodes[s_cpus_n++] = (k < MAX_NODES) ? k : 0;
+      }
+  }
+
+  memset(used, 0, sizeof(used));
+  for (i=0; i < NUM_THREADS; i++)
+    used[s_cpu_nodes[i % s_cpus_n]] = 1;
+  for (s_nodes_n=0, k=0; k < MAX_NODES; k++)
+    s_nodes_n += used[k];
+  return 0;
+}
+
+
+/*
+  Function: parse_cpulist
+
+  Reads a list of CPUs in the form of the kernel, such as 0-15,32-47.
+
+  Input:
+        const char *list: the list
+        cpu_set_t *set:   receives the CPUs of the list
+  Output:
+        Returns 0 on success and -1 on failure
+*/
+static int parse_cpulist(const char *list, cpu_set_t *set){
+  long first, last;
+  char *end;
+
+  CPU_ZERO(set);
+  while ((*list >= '0') && (*list <= '9')){
+    first = last = strtol(list, &end, 10);
+    if (*end == '-')
+      last = strtol(end+1, &end, 10);
+    if ((first < 0) || (last < first) || (last >= CPU_SETSIZE))
+      return -1;
+    for (; first <= last; first++)
+      CPU_SET(first, set);
+    list = (*end == ',') ? end+1 : end;
+  }
+  return 0;
+}
+
+
+/*
+  Function: place_thread
+
+  Binds the calling thread to its CPU when pinning is on, and sets t_node to its node. The
+  output thread takes the last CPU, should there be more CPUs than calculating threads.
+
+  Input:
+        int self: the index of a calculating thread, or -1 for the output thread
+  Output:
+        None
+*/
+static void place_thread(int self){
+  cpu_set_t set;
+  int cpu;
+
+  t_node = 0;
+  if (self >= 0)
+    s_stats[self].cpu = -1, s_stats[self].node = 0;
+  if (!s_pin || ((self < 0) && (NUM_THREADS >= s_cpus_n)))
+    return;
+
+  cpu = (self < 0) ? s_cpus_n-1 : self % s_cpus_n;
+  CPU_ZERO(&set);
+  CPU_SET(s_cpus[cpu], &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    return;
+  t_node = s_cpu_nodes[cpu];
+  if (self >= 0)
+    s_stats[self].cpu = s_cpus[cpu], s_stats[self].node = t_node;
+}
+
+
+/*
+  Function: encode_band
+
+  Colors, filters and compresses the rows of a band, on the calculating thread which 
+  finished its last tile, so that the bands of an image are compressed in parallel.
+
+  Each band is compressed on its own as raw deflate data, ended with a sync flush so that
+  it finishes on a byte boundary and the bands can simply be joined. The last band of the
+  image finishes the stream instead. The Adler-32 checksum of the filtered rows is kept so
+  that write_frame can combine the checksums of the bands.
+
+  The filters Up, Average and Paeth need the row above, which belongs to another band for 
+  the first row of a band. That row is filtered with Sub instead, or by None and Sub when 
+  the filter is adaptive.
+
+  Input: 
+        struct band *band:    the band to compress, which receives the compressed data
+        const float *escapes: the escape values of the band
+        uint32_t b:           the band number
+        uint32_t h:           the number of rows in the band
+  Output:
+        None
+*/
+static void encode_band(struct band *band, const float *escapes, uint32_t b, uint32_t h){
+  struct scratch *sc = &t_scratch;
+  png_bytep row, prev, t;
+  size_t rowbytes, size;
+  uint32_t y, i, bpp;
+  int flush, ret;
+
+  // The scratch rows of this thread are sized for a whole band
+  rowbytes = (size_t) s_width*3*s_bit_depth/8;
+  band->raw_len = h*(rowbytes+1);
+  if (sc->size < s_tile_h*(rowbytes+1)){
+    sc->size = s_tile_h*(rowbytes+1);
+    sc->raw = (png_bytep) grow(sc->raw, sc->size);
+    sc->row = (png_bytep) grow(sc->row, rowbytes + sizeof(uint64_t));
+    sc->prev = (png_bytep) grow(sc->prev, rowbytes + sizeof(uint64_t));
+  }
+  row = sc->row;
+  prev = sc->prev;
+
+  bpp = 3*s_bit_depth/8;
+  i = 0;
+  for (y=0; y < h; y++){
+    color_row(&escapes[y*s_width], s_width, row);
+    for (; (i < band->refined_n) && (band->refined[i] < (y+1)*s_width); i++)
+      color_samples(&band->samples[(size_t) i*s_ss*s_ss], &row[(band->refined[i]-y*s_width)*bpp]);
+    filter_row(row, (y > 0) ? prev : NULL, &sc->raw[y*(rowbytes+1)], s_filter);
+    t = prev, prev = row, row = t;
+  }
+  band->adler = adler32(adler32(0L, Z_NULL, 0), sc->raw, band->raw_len);
+
+  // The deflate stream of the thread is reset for each band
+  if (!sc->z_ready){
+    memset(&sc->z, 0, sizeof(sc->z));
+    if (deflateInit2(&sc->z, s_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+      printf("Error starting the compression!\n");
+      _exit(-1);
+    }
+    atomic_fetch_add(&s_allocs, 1);
+    sc->z_ready = 1;
+  }
+  else
+    deflateReset(&sc->z);
+
+  // Compress the rows, growing the output beyond the buffer of the pool until the flush is complete
+  size = s_idat_size;
+  band->idat = (unsigned char *) pool_get(&s_idat_pool, size);
+  sc->z.next_in = sc->raw;
+  sc->z.avail_in = band->raw_len;
+  sc->z.next_out = band->idat;
+  sc->z.avail_out = size;
+  flush = (b == s_bands_n-1) ? Z_FINISH : Z_SYNC_FLUSH;
+  for (;;){
+    ret = deflate(&sc->z, flush);
+    if ((flush == Z_FINISH) ? (ret == Z_STREAM_END) : ((ret == Z_OK) && (sc->z.avail_out > 0)))
+      break;
+    if ((ret != Z_OK) && (ret != Z_BUF_ERROR)){
+      printf("Error compressing the image!\n");
+      _exit(-1);
+    }
+    band->idat = (unsigned char *) grow(band->idat, 2*size);
+    sc->z.next_out = band->idat + size - sc->z.avail_out;
+    sc->z.avail_out += size;
+    size *= 2;
+  }
+  band->idat_len = size - sc->z.avail_out;
+  band->idat_size = size;
+}
+
+
+/*
+  Function: filter_row
+
+  Applies a PNG filter to a row, writing the filter type followed by the filtered bytes. 
+  For the adaptive filter every type is tried, and the one with the smallest sum of the
+  absolute values of its bytes, taken as signed, is kept.
+
+  Input: 
+        png_const_bytep row:  the bytes of the row
+        png_const_bytep prev: the bytes of the row above, or NULL if it is not available
+        png_bytep out:        the filtered row, one byte longer than the row
+        int type:             the filter type, or PNG_ADAPTIVE
+  Output:
+        uint64_t: the sum of the absolute values of the filtered bytes
+*/
+static uint64_t filter_row(png_const_bytep row, png_const_bytep prev, png_bytep out, int type){
+  size_t k, n, bpp;
+  int a, b, c, p, pa, pb, pc, best;
+  uint64_t sum, least;
+
+  n = (size_t) s_width*3*s_bit_depth/8;
+  bpp = 3*s_bit_depth/8;
+
+  if ((prev == NULL) && (type >= PNG_FILTER_VALUE_UP) && (type <= PNG_FILTER_VALUE_PAETH))
+    type = PNG_FILTER_VALUE_SUB;
+
+  if (type == PNG_ADAPTIVE){
+    best = PNG_FILTER_VALUE_NONE;
+    least = UINT64_MAX;
+    for (type=PNG_FILTER_VALUE_NONE; type <= PNG_FILTER_VALUE_PAETH; type++){
+      if ((prev == NULL) && (type > PNG_FILTER_VALUE_SUB))
+        break;
+      if ((sum = filter_row(row, prev, out, type)) < least)
+        least = sum, best = type;
+    }
+    return (best == type-1) ? least : filter_row(row, prev, out, best);
+  }
+
+  // The bytes of the first pixel have no pixel to their left
+  out[0] = (png_byte) type;
+  out++;
+  for (k=0; k < bpp; k++){
+    b = prev ? prev[k] : 0;
+    out[k] = (png_byte)(row[k] - ((type == PNG_FILTER_VALUE_UP) || (type == PNG_FILTER_VALUE_PAETH) ? b :
+                                  (type == PNG_FILTER_VALUE_AVG) ? (b >> 1) : 0));
+  }
+
+  switch (type){
+  case PNG_FILTER_VALUE_SUB:
+    for (k=bpp; k < n; k++)
+      out[k] = (png_byte)(row[k] - row[k-bpp]);
+    break;
+  case PNG_FILTER_VALUE_UP:
+    for (k=bpp; k < n; k++)
+      out[k] = (png_byte)(row[k] - prev[k]);
+    break;
+  case PNG_FILTER_VALUE_AVG:
+    for (k=bpp; k < n; k++)
+      out[k] = (png_byte)(row[k] - ((row[k-bpp] + prev[k]) >> 1));
+    break;
+  case PNG_FILTER_VALUE_PAETH:
+    for (k=bpp; k < n; k++){
+      a = row[k-bpp], b = prev[k], c = prev[k-bpp];
+      pa = abs(b-c);
+      pb = abs(a-c);
+      pc = abs(a+b-2*c);
+      p = ((pa <= pb) && (pa <= pc)) ? a : (pb <= pc) ? b : c;
+      out[k] = (png_byte)(row[k] - p);
+    }
+    break;
+  default:
+    memcpy(out, row, n);
+    break;
+  }
+
+  sum = 0;
+  for (k=0; k < n; k++)
+    sum += abs((signed char) out[k]);
+  return sum;
+}
+
+
+/*
+  Function: refine_band
+
+  Finds the pixels of a band which lie on an edge, where the escape value of a neighbour in
+  the band differs by more than s_ss_threshold or only one of the two is inside the set, and
+  samples each again on a grid of s_ss x s_ss points covering the pixel. Each point is 
+  jittered within its cell of the grid by a hash of the pixel, so that the samples do not 
+  alias with regular detail, yet are the same on every run.
+
+  The rows above and below the band are not compared, as they may not have been calculated.
+  An edge running exactly along the boundary of two bands is therefore only refined where
+  it also crosses a row of either band.
+
+  Input: 
+        struct band *band:    the band, which receives the refined pixels and their samples
+        const float *escapes: the escape values of the band
+        uint32_t b:           the band number
+        uint32_t h:           the number of rows in the band
+  Output:
+        None
+*/
+static inline int differs(float a, float b){
+  return ((a >= 1.0f) != (b >= 1.0f)) || (fabsf(a - b) > s_ss_threshold);
+}
+
+static void refine_band(struct band *band, const float *escapes, uint32_t b, uint32_t h){
+  const float *v;
+  uint64_t z;
+  uint32_t i, k, x, y, n, g = s_ss;
+  double px, py;
+
+  // Every pixel of a band may be refined, while the samples grow as they are needed
+  if (t_scratch.refined_cap < s_width*s_tile_h){
+    t_scratch.refined_cap = s_width*s_tile_h;
+    t_scratch.refined = (uint32_t *) grow(t_scratch.refined, t_scratch.refined_cap*sizeof(uint32_t));
+  }
+  band->refined = t_scratch.refined;
+  n = 0;
+  for (y=0; y < h; y++){
+    v = &escapes[y*s_width];
+    for (x=0; x < s_width; x++){
+      if (((x > 0) && differs(v[x], v[x-1])) || ((x+1 < s_width) && differs(v[x], v[x+1])) ||
+          ((y > 0) && differs(v[x], escapes[(y-1)*s_width+x])) ||
+          ((y+1 < h) && differs(v[x], escapes[(y+1)*s_width+x])))
+        band->refined[n++] = y*s_width + x;
+    }
+  }
+
+  band->refined_n = n;
+  if (t_scratch.samples_cap < (size_t) n*g*g){
+    t_scratch.samples_cap = (2*t_scratch.samples_cap > (size_t) n*g*g) ?
+                            2*t_scratch.samples_cap : (size_t) n*g*g;
+    t_scratch.samples = (float *) grow(t_scratch.samples, t_scratch.samples_cap*sizeof(float));
+  }
+  band->samples = t_scratch.samples;
+  for (i=0; i < n; i++){
+    x = band->refined[i] % s_width;
+    y = band->refined[i] / s_width + b*s_tile_h;
+    for (k=0; k < g*g; k++){
+      // A SplitMix64 hash of the pixel and sample gives the jitter in each direction
+      z = (((uint64_t) y << 32) | x) * (SS_MAX*SS_MAX) + k + 0x9E3779B97F4A7C15ULL;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      z ^= z >> 31;
+      px = x - 0.5 + ((k % g) + (z >> 40)*0x1p-24)/g;
+      py = y - 0.5 + ((k / g) + ((z >> 16) & 0xFFFFFF)*0x1p-24)/g;
+      band->samples[(size_t) i*g*g + k] = escape_fn(px, py);
+    }
+  }
+  t_refined += n;
+}
+
+
+/*
+  Function: color_samples
+
+  Colors a refined pixel with the average of the colors of its samples, taken from the 
+  palette lookup table, rounding each channel to the nearest value.
+
+  Input: 
+        const float *samples: the s_ss*s_ss escape values of the pixel
+        png_bytep px:         the pixel in the row, at the bit depth of the image
+  Output:
+        None
+*/
+static void color_samples(const float *samples, png_bytep px){
+  png_bytep c;
+  uint32_t sum[3] = {0, 0, 0};
+  uint32_t k, j, n = s_ss*s_ss;
+  int32_t index;
+  float v;
+
+  // Clamped as in color_row, so NaN takes the first entry of the table
+  for (k=0; k < n; k++){
+    v = samples[k]*LUT_SIZE;
+    index = (v >= 0.0f) ? ((v < LUT_SIZE) ? (int32_t) v : LUT_SIZE) : 0;
+    c = (png_bytep) &s_lut[index];
+    for (j=0; j < 3; j++)
+      sum[j] += (s_bit_depth == 8) ? c[j] : (c[2*j] << 8) | c[2*j+1];
+  }
+  for (j=0; j < 3; j++){
+    sum[j] = (sum[j] + n/2)/n;
+    if (s_bit_depth == 8)
+      px[j] = (png_byte) sum[j];
+    else{
+      px[2*j] = (png_byte)(sum[j] >> 8);
+      px[2*j+1] = (png_byte) sum[j];
+    }
+  }
+}
+
+
+/*
+  Function: color_row
+
+  This function is the colorizing stage. It takes the escape values of a row and finds the
+  proper color of each pixel from the palette lookup table, which is already converted to
+  the bit depth of the image.
+
+  The escape values are scaled to table indices in groups, in a loop simple enough for the 
+  compiler to vectorize. Each pixel is then copied from the table with one 8 byte store,
+  which may run into the next pixel, so the row must have 8 spare bytes.
+
+  The body is built for each bit depth as color_row_8 and color_row_16, so that the size 
+  of a pixel is a constant, and color_row is set to one of them once the depth is known.
+
+  Input: 
+        const float *escapes: the escape values of the pixels in the row
+        uint32_t n:           the number of pixels in the row
+        png_bytep vals:       the bytes of the row, with 8 bytes to spare
+        uint32_t bpp:         the bytes per pixel, 3 or 6
+  Output:
+        None
+*/
+static inline __attribute__((always_inline))
+void color_row_depth(const float *escapes, uint32_t n, png_bytep vals, uint32_t bpp){
+  int32_t index[64];
+  float v;
+  uint32_t j, k, m;
+
+  for (j=0; j < n; j+=64){
+    m = (n-j < 64) ? n-j : 64;
+
+    // Pixels in the set (1.0) take the last entry of the table, and NaN the first
+    for (k=0; k < m; k++){
+      v = escapes[j+k]*LUT_SIZE;
+      index[k] = (v >= 0.0f) ? ((v < LUT_SIZE) ? (int32_t) v : LUT_SIZE) : 0;
+    }
+
+    for (k=0; k < m; k++)
+      memcpy(&vals[(j+k)*bpp], &s_lut[index[k]], sizeof(uint64_t));
+  }
+}
+
+static void color_row_8(const float *escapes, uint32_t n, png_bytep vals){
+  color_row_depth(escapes, n, vals, 3);
+}
+
+static void color_row_16(const float *escapes, uint32_t n, png_bytep vals){
+  color_row_depth(escapes, n, vals, 6);
+}
+
+
+/*
+  Function: build_palette
+
+  Fills the lookup table used by color_row from the named palette, at the bit depth of the
+  image. Each entry is colored at the center of the range of escape values it covers, and
+  the last entry, for the pixels in the set, is black.
+
+  Input: 
+        const char *name: one of classic, gray or fire
+  Output:
+        Returns 0 on success and -1 if the palette is unknown
+*/
+static int build_palette(const char *name){
+  static const struct palette palettes[] = {
+    {"classic", palette_classic},
+    {"gray",    palette_gray},
+    {"fire",    palette_fire},
+  };
+  png_byte px[sizeof(uint64_t)];
+  int i, p;
+
+  for (p=0; p < sizeof(palettes)/sizeof(palettes[0]); p++)
+    if (strcmp(name, palettes[p].name) == 0)
+      break;
+  if (p == sizeof(palettes)/sizeof(palettes[0]))
+    return -1;
+
+  for (i=0; i <= LUT_SIZE; i++){
+    memset(px, 0, sizeof(px));
+    if (i < LUT_SIZE)
+      palettes[p].color((i+0.5)/LUT_SIZE, px);
+    memcpy(&s_lut[i], px, sizeof(uint64_t));
+  }
+  return 0;
+}
+
+
+/*
+  Writes a color with components in [0,1] at the bit depth of the image, most significant
+  byte first as PNG requires
+*/
+static void put_rgb(png_bytep px, double r, double g, double b){
+  double c[3] = {r, g, b};
+  uint32_t k, v;
+
+  for (k=0; k < 3; k++){
+    c[k] = (c[k] < 0.0) ? 0.0 : (c[k] > 1.0) ? 1.0 : c[k];
+    if (s_bit_depth == 8)
+      px[k] = (png_byte) lrint(c[k]*0xFF);
+    else{
+      v = (uint32_t) lrint(c[k]*0xFFFF);
+      px[2*k] = (png_byte)(v >> 8);
+      px[2*k+1] = (png_byte)(v & 0xFF);
+    }
+  }
+}
+
+
+/*
+  The original colors of the generator. For the eight bit encoding, there are three 
+  png_bytes of color data, whereas the sixteen bit encoding has 6 png_bytes
+*/
+static void palette_classic(double v, png_bytep px){
+  if (s_bit_depth == 8){
+    px[0]=0xFF-(png_byte)(v*0xFF);
+    px[1]=0xFF-(png_byte)(v*0x77);
+    px[2]=0xFF-(png_byte)(v*0xFF);
+  }
+  else{
+    px[0]=0xDD-(png_byte)(v*0xAA);
+    px[1]=0xFF-(png_byte)(v*0xFF);
+    px[2]=0xFF-(png_byte)(v*0xFF);
+    px[3]=0xFF-(png_byte)(v*0xFF);
+    px[4]=0xFF-(png_byte)(v*0x77);
+    px[5]=0xFF-(png_byte)(v*0xFF);
+  }
+}
+
+
+// White far from the set, darkening towards it
+static void palette_gray(double v, png_bytep px){
+  put_rgb(px, 1.0-v, 1.0-v, 1.0-v);
+}
+
+
+// Black body colors, from white through yellow and red to black at the set
+static void palette_fire(double v, png_bytep px){
+  double t = 1.0-v;
+
+  put_rgb(px, 3.0*t, 3.0*t-1.0, 3.0*t-2.0);
+}
+
+
+/*
+  Function: open_cache
+
+  Looks for the escape values of the current frame in the cache, using the hash of the
+  parameters which affect them. If a file is found with a matching header, it is mapped to
+  s_cache_in. Otherwise a temporary file is created and mapped to s_cache_out, to be 
+  filled as the frame is calculated. Problems with the cache are reported, and the frame 
+  is then calculated without it.
+
+  Input: 
+        None
+  Output:
+        None (s_cache_in or s_cache_out is set)
+*/
+static void open_cache(){
+  struct cache_header *key = &s_cache_key;
+  struct stat st;
+  uint64_t hash;
+  size_t k;
+  int fd;
+
+  // Every byte of the key is hashed and compared, so clear the padding as well
+  memset(key, 0, sizeof(*key));
+  memcpy(key->magic, CACHE_MAGIC, sizeof(key->magic));
+  key->width = s_width;
+  key->height = s_height;
+  key->center_r[0] = s_center_dd_r.hi, key->center_r[1] = s_center_dd_r.lo;
+  key->center_i[0] = s_center_dd_i.hi, key->center_i[1] = s_center_dd_i.lo;
+  key->scale = s_scale;
+  key->power_r = s_power_r;
+  key->power_i = s_power_i;
+  key->escape = s_escape;
+  key->min_r = s_min_r;
+  key->depth = s_depth;
+  key->branch = s_branch;
+  key->filled = s_ms;
+  key->deep = s_deep;
+  key->precision = s_precision;
+
+  // FNV-1a hash of the key
+  hash = 14695981039346656037ull;
+  for (k=0; k < sizeof(*key); k++)
+    hash = (hash ^ ((unsigned char *) key)[k])*1099511628211ull;
+
+  s_cache_size = sizeof(*key) + (size_t) s_width*s_height*sizeof(float);
+  snprintf(s_cache_path, sizeof(s_cache_path), "%s/%016llx.esc", CACHE_FOLDER,
+           (unsigned long long) hash);
+
+  // Map the file if it holds this frame
+  if ((fd = open(s_cache_path, O_RDONLY)) >= 0){
+    if ((fstat(fd, &st) == 0) && (st.st_size == s_cache_size) &&
+        ((s_cache_map = mmap(NULL, s_cache_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED)){
+      if (memcmp(s_cache_map, key, sizeof(*key)) == 0){
+        close(fd);
+        s_cache_in = (const float *)((char *) s_cache_map + sizeof(*key));
+        return;
+      }
+      munmap(s_cache_map, s_cache_size);
+    }
+    close(fd);
+  }
+
+  // Otherwise reuse what can be of the last frame, and create a new file for this frame
+  if (!s_progressive && (s_workers_n == 0))
+    open_previous();
+  snprintf(s_cache_temp, sizeof(s_cache_temp), "%s.%d", s_cache_path, (int) getpid());
+  if ((fd = open(s_cache_temp, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0){
+    printf("Unable to create cache file %s: %s\n", s_cache_temp, strerror(errno));
+    return;
+  }
+  if ((ftruncate(fd, s_cache_size) != 0) ||
+      ((s_cache_map = mmap(NULL, s_cache_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)){
+    printf("Unable to map cache file %s: %s\n", s_cache_temp, strerror(errno));
+    close(fd);
+    unlink(s_cache_temp);
+    return;
+  }
+  close(fd);
+  s_cache_out = (float *)((char *) s_cache_map + sizeof(*key));
+}
+
+
+/*
+  Function: close_cache
+
+  Releases the cache file of the frame which has just been calculated. A new file has its
+  header written last and is then renamed into place, so an incomplete file is never found 
+  by open_cache.
+
+  Input: 
+        None
+  Output:
+        None
+*/
+static void close_cache(){
+  char temp[64];
+  FILE *fp;
+
+  if (s_cache_in != NULL){
+    munmap(s_cache_map, s_cache_size);
+    s_cache_in = NULL;
+  }
+  if (s_prev != NULL){
+    munmap(s_prev_map, s_prev_size);
+    s_prev = NULL;
+  }
+  if (s_cache_out != NULL){
+    memcpy(s_cache_map, &s_cache_key, sizeof(s_cache_key));
+    munmap(s_cache_map, s_cache_size);
+    s_cache_out = NULL;
+    if (rename(s_cache_temp, s_cache_path) != 0){
+      printf("Unable to write cache file %s: %s\n", s_cache_path, strerror(errno));
+      unlink(s_cache_temp);
+      return;
+    }
+    printf("Escape values written to the cache: %s\n", s_cache_path);
+
+    // This is now the last frame, for the next frame to reuse
+    snprintf(temp, sizeof(temp), "%s.%d", CACHE_LAST, (int) getpid());
+    if ((fp = fopen(temp, "w")) != NULL){
+      fprintf(fp, "%s\n", s_cache_path);
+      if ((fclose(fp) != 0) || (rename(temp, CACHE_LAST) != 0))
+        unlink(temp);
+    }
+  }
+}
+
+
+/*
+  Function: open_previous
+
+  Maps the last frame written to the cache to s_prev, if its pixels can be reused by the
+  current frame: it must have the same exponent, limits and subdivision, a scale differing
+  by a power of two of at most PREV_ZOOM, and a corner on the grid of the finer of the two
+  frames. Nothing is mapped otherwise.
+
+  Input: 
+        None
+  Output:
+        None (s_prev is set, along with the mapping of the pixels)
+*/
+static void open_previous(){
+  const struct cache_header *prev;
+  struct stat st;
+  double ratio, fine, ox, oy;
+  FILE *fp;
+  int fd, k;
+
+  if ((fp = fopen(CACHE_LAST, "r")) == NULL)
+    return;
+  if (fscanf(fp, "%63s", s_prev_path) != 1){
+    fclose(fp);
+    return;
+  }
+  fclose(fp);
+
+  if ((fd = open(s_prev_path, O_RDONLY)) < 0)
+    return;
+  if ((fstat(fd, &st) != 0) || (st.st_size < sizeof(*prev)) ||
+      ((s_prev_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)){
+    close(fd);
+    return;
+  }
+  close(fd);
+  s_prev_size = st.st_size;
+  prev = (const struct cache_header *) s_prev_map;
+
+  // The scale must change by a power of two
+  ratio = s_scale/prev->scale;
+  k = (int) lround(log2(ratio));
+  if ((memcmp(prev->magic, CACHE_MAGIC, sizeof(prev->magic)) != 0) ||
+      (s_prev_size != sizeof(*prev) + (size_t) prev->width*prev->height*sizeof(float)) ||
+      (prev->power_r != s_power_r) || (prev->power_i != s_power_i) ||
+      (prev->escape != s_escape) || (prev->min_r != s_min_r) || (prev->depth != s_depth) ||
+      (prev->branch != s_branch) || (prev->filled != s_ms) || (prev->deep != s_deep) ||
+      (prev->precision != s_precision) ||
+      (abs(k) > PREV_ZOOM) || (fabs(ratio/ldexp(1.0, k) - 1.0) > 1e-12)){
+    munmap(s_prev_map, s_prev_size);
+    return;
+  }
+
+  // The offset of the corner from the last corner, in steps of the finer scale
+  fine = fmin(s_scale, prev->scale);
+  ox = (dd_to_d(dd_sub(s_center_dd_r, (dd_t){prev->center_r[0], prev->center_r[1]}))
+        - 0.5*(s_scale*s_width - prev->scale*prev->width))/fine;
+  oy = (dd_to_d(dd_sub((dd_t){prev->center_i[0], prev->center_i[1]}, s_center_dd_i))
+        + 0.5*(prev->scale*prev->height - s_scale*s_height))/fine;
+  if ((fabs(ox - nearbyint(ox)) > PREV_EPS) || (fabs(oy - nearbyint(oy)) > PREV_EPS) ||
+      (fabs(ox) > 1e15) || (fabs(oy) > 1e15)){
+    munmap(s_prev_map, s_prev_size);
+    return;
+  }
+
+  s_prev_a = (k > 0) ? (int64_t) 1 << k : 1;
+  s_prev_b = (k < 0) ? (int64_t) 1 << -k : 1;
+  s_prev_ox = (int64_t) nearbyint(ox);
+  s_prev_oy = (int64_t) nearbyint(oy);
+  s_prev_w = prev->width;
+  s_prev_h = prev->height;
+  s_prev = (const float *)((const char *) s_prev_map + sizeof(*prev));
+}
+
+
+/*
+  Function: reuse_tile
+
+  Fills a tile from the previous frame where its pixels lie on the same points, and
+  calculates the rest. In each row of the tile, the shared pixels are every s_prev_b'th
+  pixel of a single run. Those before and after the run are calculated as spans, and the 
+  gaps within it as s_prev_b-1 spans with a step of s_prev_b pixels.
+
+  Input: 
+        float *escapes:  the escape values of the band holding the tile
+        int y0:          the first row of the band, and of the tile
+        int x0:          the first column of the tile
+        int w, h:        the size of the tile
+  Output:
+        None
+*/
+static inline int64_t floor_div(int64_t a, int64_t b){
+  return (a >= 0) ? a/b : -((-a + b - 1)/b);
+}
+
+static void reuse_tile(float *escapes, int y0, int x0, int w, int h){
+  const int64_t a = s_prev_a, b = s_prev_b;
+  const float *src;
+  float *out;
+  int64_t fy, lo, hi, xf, xl, r, q;
+  int y;
+
+  // The columns of the tile which lie inside the previous frame
+  lo = -floor_div(s_prev_ox, a);
+  hi = floor_div(b*(s_prev_w-1) - s_prev_ox, a);
+  lo = (lo > x0) ? lo : x0;
+  hi = (hi < x0+w-1) ? hi : x0+w-1;
+
+  // The first and last of these on the grid of the previous frame
+  r = (s_prev_ox + a*lo) % b;
+  xf = lo + ((r < 0) ? -r : (r > 0) ? b-r : 0);
+  xl = (hi >= xf) ? xf + (hi-xf)/b*b : xf-1;
+
+  for (y=0; y < h; y++){
+    out = &escapes[y*s_width];
+    fy = s_prev_oy + a*(y0+y);
+    if ((xl < xf) || (fy < 0) || (fy % b != 0) || (fy/b >= s_prev_h)){
+      span_fn(y0+y, x0, w, 1, 0, &out[x0]);
+      continue;
+    }
+
+    src = &s_prev[(size_t)(fy/b)*s_prev_w];
+    for (q=xf; q <= xl; q+=b)
+      out[q] = src[(s_prev_ox + a*q)/b];
+    t_reused += (xl-xf)/b + 1;
+
+    if (xf > x0)
+      span_fn(y0+y, x0, xf-x0, 1, 0, &out[x0]);
+    if (xl < x0+w-1)
+      span_fn(y0+y, xl+1, x0+w-1-xl, 1, 0, &out[xl+1]);
+    for (q=1; (q < b) && (xf+q <= xl); q++)
+      span_fn(y0+y, xf+q, (xl-xf-q)/b + 1, b, 0, &out[xf+q]);
+  }
+}
+
+
+/*
+  Function: find_symmetry
+
+  Finds the mirrors of the frame which can be used (see s_sym_my), and makes room for the
+  rows which are copied. The kernels place pixel p at the center plus s_scale*(p - n/2),
+  which is the exact negation of the place of pixel n-p only when the center is zero, so
+  a mirror is only used then, and each copied pixel is the one the kernel would calculate.
+  The frames read from the cache or the previous frame, or calculated in passes, have no
+  use for it, and neither do subdivided frames, whose filled pixels depend on the tiles.
+
+  Input:
+        None
+  Output:
+        None (s_mirror is set when either mirror is used)
+*/
+static int64_t mirror_axis(dd_t center, double c, uint32_t n){
+  // Both the double and double-double centers must be zero, as either may place the pixels
+  return ((center.hi == 0.0) && (center.lo == 0.0) && (c == 0.0)) ? n : -1;
+}
+
+static void find_symmetry(){
+  size_t size, i;
+
+  s_mirror = 0;
+  s_sym_my = s_sym_mx = -1;
+  if (!s_sym || (s_power_i != 0.0) || (s_cache_in != NULL) || (s_sweep_in != NULL) ||
+      (s_prev != NULL) || s_progressive || s_ms)
+    return;
+
+  // The half turn only maps the rows onto themselves along with the mirror, for odd exponents
+  s_sym_my = mirror_axis(s_center_dd_i, s_center_i, s_height);
+  if ((s_power_n & 1) != 0)
+    s_sym_mx = mirror_axis(s_center_dd_r, s_center_r, s_width);
+  if ((s_sym_my < 0) && (s_sym_mx < 0))
+    return;
+  s_mirror = 1;
+
+  // The rows copied from lie between the mirror of the last row and the axis
+  if (s_sym_my >= 0){
+    s_sym_y0 = (s_sym_my >= s_height) ? s_sym_my-(s_height-1) : 0;
+    size = (size_t)((s_sym_my-1)/2 - s_sym_y0 + 1)*s_width*sizeof(float);
+    if (size > s_sym_size)
+      s_sym_rows = (float *) grow(s_sym_rows, s_sym_size = size);
+  }
+  size = (size_t) s_height*s_tiles_x;
+  if (size > s_sym_done_n)
+    s_sym_done = (atomic_uchar *) grow(s_sym_done, (s_sym_done_n = size)*sizeof(atomic_uchar));
+  for (i=0; i < size; i++)
+    atomic_init(&s_sym_done[i], 0);
+}
+
+
+/*
+  Function: mirror_tile
+
+  Fills a tile using the symmetry of the view. A row whose mirror about the real axis is
+  finished is copied from it. Otherwise the pixels whose mirror in the same row is finished,
+  either earlier in the tile or in a tile to its left, are copied and the rest calculated.
+  Without partial, the tile is only filled when every row of it can be copied, as for the
+  tiles which are sent to a worker whole.
+
+  Input:
+        float *escapes:  the escape values of the band holding the tile
+        int y0:          the first row of the band, and of the tile
+        int x0:          the first column of the tile
+        int w, h:        the size of the tile
+        int partial:     set if the rows may be calculated in part
+  Output:
+        Returns 1 if the tile was filled, and 0 if it must be calculated
+*/
+static inline int row_ready(int y, int x0){
+  int64_t sy = s_sym_my - y;
+
+  return (s_sym_my >= 0) && (sy >= 0) && (sy < y) &&
+         atomic_load_explicit(&s_sym_done[(size_t) sy*s_tiles_x + x0/s_tile_w], memory_order_acquire);
+}
+
+static inline int pixel_ready(int y, int x, int x0){
+  int64_t sx = s_sym_mx - x;
+
+  return (s_sym_mx >= 0) && (sx >= 0) && (sx < x) && ((sx >= x0) ||
+         atomic_load_explicit(&s_sym_done[(size_t) y*s_tiles_x + sx/s_tile_w], memory_order_acquire));
+}
+
+static int mirror_tile(float *escapes, int y0, int x0, int w, int h, int partial){
+  float *out;
+  int x, y, a;
+
+  if (!s_mirror)
+    return 0;
+  if (!partial){
+    for (y=0; (y < h) && row_ready(y0+y, x0); y++);
+    if (y < h)
+      return 0;
+  }
+
+  for (y=0; y < h; y++){
+    out = &escapes[y*s_width];
+    if (row_ready(y0+y, x0)){
+      memcpy(&out[x0], &s_sym_rows[(size_t)(s_sym_my-(y0+y)-s_sym_y0)*s_width+x0], w*sizeof(float));
+      t_mirrored += w;
+      continue;
+    }
+
+    // Calculate each run of pixels with no finished mirror, then copy the run after it
+    for (x=x0; x < x0+w; ){
+      for (a=x; (a < x0+w) && !pixel_ready(y0+y, a, x0); a++);
+      if (a > x)
+        span_fn(y0+y, x, a-x, 1, 0, &out[x]);
+      for (x=a; (x < x0+w) && pixel_ready(y0+y, x, x0); x++)
+        out[x] = out[s_sym_mx-x];
+      t_mirrored += x-a;
+    }
+  }
+  return 1;
+}
+
+
+/*
+  Function: keep_rows
+
+  Keeps the rows of a tile which are mirrored into other rows in s_sym_rows, and flags every
+  row of the tile as finished, once its escape values are all in the band.
+
+  Input:
+        const float *escapes: the escape values of the band holding the tile
+        int y0:               the first row of the band, and of the tile
+        int x0:               the first column of the tile
+        int w, h:             the size of the tile
+  Output:
+        None
+*/
+static void keep_rows(const float *escapes, int y0, int x0, int w, int h){
+  int64_t y;
+
+  if (!s_mirror)
+    return;
+  for (y=y0; y < y0+h; y++){
+    if ((s_sym_my >= 0) && (y >= s_sym_y0) && (2*y < s_sym_my))
+      memcpy(&s_sym_rows[(size_t)(y-s_sym_y0)*s_width+x0], &escapes[(y-y0)*s_width+x0], w*sizeof(float));
+    atomic_store_explicit(&s_sym_done[(size_t) y*s_tiles_x + x0/s_tile_w], 1, memory_order_release);
+  }
+}
+
+
+/*
+  Function: calculate_span_scalar
+
+  Calculates the escape values of n pixels starting at (x0, y), one pixel at a time using 
+  escape_fn. This is used when no vector kernel is available. The pixels run in steps of
+  dx columns and dy rows, (1, 0) for a row and (0, 1) for a column, and the results are 
+  stored as far apart as the pixels would be in a row of s_width values. A column can then
+  be written straight into the rows of a band, or every other pixel into a row.
+
+  Input: 
+        int y:        row number of the first pixel
+        int x0:       column of the first pixel
+        int n:        number of pixels to calculate
+        int dx, dy:   the step from one pixel to the next
+        float *out:   array to hold the results
+  Output:
+        None
+*/
+static void calculate_span_scalar(int y, int x0, int n, int dx, int dy, float *out){
+  int j;
+
+  for(j=0; j < n; j++)
+    out[j*(dx+dy*s_width)] = escape_fn(x0+j*dx, y+j*dy);
+}
+
+
+/*
+  Vector kernels (see mandel_simd.h) for each instruction set available on x86-64
+*/
+#if defined(__x86_64__) && defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#define VEC_WIDTH   2
+#define VEC_NAME(n) n##_sse2
+#define VEC_ANY(m)  _mm_movemask_pd((__m128d)(m))
+#define VEC_ANY_F(m) _mm_movemask_ps((__m128)(m))
+#include "mandel_simd.h"
+#undef VEC_WIDTH
+#undef VEC_NAME
+#undef VEC_ANY
+#undef VEC_ANY_F
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define VEC_WIDTH   4
+#define VEC_NAME(n) n##_avx2
+#define VEC_ANY(m)  _mm256_movemask_pd((__m256d)(m))
+#define VEC_ANY_F(m) _mm256_movemask_ps((__m256)(m))
+#include "mandel_simd.h"
+#undef VEC_WIDTH
+#undef VEC_NAME
+#undef VEC_ANY
+#undef VEC_ANY_F
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,fma")
+#define VEC_WIDTH   8
+#define VEC_NAME(n) n##_avx512
+#define VEC_ANY(m)  _mm512_test_epi64_mask((__m512i)(m), (__m512i)(m))
+#define VEC_ANY_F(m) _mm512_test_epi32_mask((__m512i)(m), (__m512i)(m))
+#include "mandel_simd.h"
+#undef VEC_WIDTH
+#undef VEC_NAME
+#undef VEC_ANY
+#undef VEC_ANY_F
+#pragma GCC pop_options
+#endif
+
+
+/*
+  The kernels for each instruction set, widest first, with the span function for each 
+  kind of exponent, and the float and double-double span functions for integer exponents.
+  supported tests whether the CPU can run the kernels, and is NULL for the instruction sets
+  every CPU has. The sweep functions calculate width exponents at once, for the complex 
+  exponents only. The scalar kernels have no float or sweep version.
+*/
+struct kernel{
+  const char *name;
+  int (*supported)();
+  void (*span[KINDS])(int y, int x0, int n, int dx, int dy, float *out);
+  void (*span_float)(int y, int x0, int n, int dx, int dy, float *out);
+  void (*span_dd)(int y, int x0, int n, int dx, int dy, float *out);
+  void (*sweep[KINDS])(int y, int x0, int n);
+  int width;
+};
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static int supports_avx512(){
+  return __builtin_cpu_supports("avx512f");
+}
+
+static int supports_avx2(){
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+static const struct kernel s_kernels[] = {
+#if defined(__x86_64__) && defined(__GNUC__)
+  {"avx512", supports_avx512,
+   {calculate_span_int_avx512, calculate_span_point_avx512, calculate_span_exponent_avx512},
+   calculate_span_int_float_avx512, calculate_span_int_dd_avx512,
+   {NULL, calculate_sweep_point_avx512, calculate_sweep_exponent_avx512}, 8},
+  {"avx2",   supports_avx2,
+   {calculate_span_int_avx2, calculate_span_point_avx2, calculate_span_exponent_avx2},
+   calculate_span_int_float_avx2, calculate_span_int_dd_avx2,
+   {NULL, calculate_sweep_point_avx2, calculate_sweep_exponent_avx2}, 4},
+  {"sse2",   NULL,
+   {calculate_span_int_sse2, calculate_span_point_sse2, calculate_span_exponent_sse2},
+   calculate_span_int_float_sse2, calculate_span_int_dd_sse2,
+   {NULL, calculate_sweep_point_sse2, calculate_sweep_exponent_sse2}, 2},
+#endif
+  {"scalar", NULL,
+   {calculate_span_scalar, calculate_span_scalar, calculate_span_scalar},
+   NULL, calculate_span_scalar, {NULL, NULL, NULL}, 1},
+};
+
+
+/*
+  Function: select_kernel
+
+  Sets span_fn to the kernel for the given instruction set, the kind of exponent of the
+  frame (s_kind) and its precision (s_precision), from s_kernels, and sweep_fn to its sweep. Without a float kernel
+  the precision becomes double. "auto" picks the widest instruction set supported by the
+  CPU at runtime, and s_kernel is updated to the name of the chosen kernel.
+
+  Input: 
+        const char *name: one of auto, scalar, sse2, avx2 or avx512
+  Output:
+        Returns 0 on success and -1 if the kernel is unknown or not supported by the CPU
+*/
+static int select_kernel(const char *name){
+  const struct kernel *k;
+  int auto_pick = (strcmp(name, "auto") == 0);
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+#endif
+  for (k = s_kernels; k < s_kernels + sizeof(s_kernels)/sizeof(s_kernels[0]); k++){
+    if (!auto_pick && (strcmp(name, k->name) != 0))
+      continue;
+    if ((k->supported != NULL) && !k->supported()){
+      if (auto_pick)
+        continue;
+      return -1;
+    }
+    span_fn = k->span[s_kind];
+    sweep_fn = k->sweep[s_kind];
+    s_sweep_width = (k->width < MAX_SWEEP) ? k->width : MAX_SWEEP;
+    if ((s_precision == PREC_FLOAT) && (k->span_float != NULL))
+      span_fn = k->span_float;
+    else if (s_precision == PREC_FLOAT)
+      s_precision = PREC_DOUBLE;
+    else if (s_precision == PREC_DD)
+      span_fn = k->span_dd;
+    s_kernel = k->name;
+    return 0;
+  }
+  return -1;
+}
+
+/*
+  Function: calculate_escape
+
+  This is the function which tests each point to find if it is in the fractal and if not, the escape
+  from that set. 
+
+  ------------------------------------------------------------------------
+  Background:
+  ------------------------------------------------------------------------
+  For this, the following basic recursive definition of the fractal is used, assuming
+  the complex value c is the point being tested. The Mandelbrot set is traditionally defined for (a+bi) = 2.
+
+  Base Case:
+  Z(0) = c
+  Recursive Case:
+  Z(N+1) = Z(N)^(a+bi)+c
+
+  The fractal is defined to be the set of points C for which the following limit is held.
+
+  lim N->Inf |Z(N)| < bound, bound > 0, bound element of the Reals.
+
+  For the Mandelbrot set [(a+bi) = 2] is independant of the value of the bound, given that b >= 2.
+
+  Traditionally, the Mandelbrot fractal is displayed as a colorful image. This is obtained by noting the 
+  value of N and |Z(N)| for the first value that is larger than the bound. The following formula is used 
+  to generate a value in the range (0,1), based on the Taylor expansion shown at
+  http://linas.org/art-gallery/escape/escape.html.
+
+  modN = N + 1 - log(log(|Z(N)|)) / log(r^a * e^(-b * theta))
+  
+  The justification of the final term is shown below. The returned value is modN divided by the 
+  maximum number of iterations allowed by the program.
+
+  ------------------------------------------------------------------------
+  Implementation:
+  ------------------------------------------------------------------------
+  The recursive case can be solved using the following expressions:
+
+  Define The Following:
+                Z(N)        = r e^(i * theta)       -> Polar form of a complex number
+                Coefficient = r^a * e^(-b * theta)  = Coe 
+                Angle       = a * theta + b * ln(r) = Ang
+
+  From these definitions, we can write the recursive form in an easily calculable form, 
+         where Re{Z} is the real component of Z and Im{Z} is the imaginary component of Z:
+                Re{Z(N+1)} = Coe * cos ( Ang ) + Re{c}
+                Im{Z(N+1)} = Coe * sin ( Ang ) + Im{c}
+
+  Now, we convert the value Z(N+1) from Standard Form to Polar Form:
+                Z(N+1) = r e^(i * theta)
+                r      = Sqrt(Re{Z(N+1)}*Re{Z(N+1)}+Im{Z(N+1)}*Im{Z(N+1)})
+                theta  = arctan2(Re{Z(N+1)}, Im{Z(N+1)})
+
+  In order to save us from using the square root function, we can use the following modifications
+                Z(N+1) = Sqrt(rsq) * e^(i * theta)
+                rsq    = Re{Z(N+1)}*Re{Z(N+1)}+Im{Z(N+1)}*Im{Z(N+1)}
+                theta  = arctan2(Re{Z(N+1)}, Im{Z(N+1)})
+
+  For this to b used, we also must modify the original definitions:
+                Z(N)        = Sqrt(rsq) * e^(i * theta)
+                Coefficient = rsq^(a/2) * e^(-b * theta)    = Coe 
+                Angle       = a * theta + 1/2 * b * ln(rsq) = Ang
+
+  ------------------------------------------------------------------------
+  Branch Cuts:
+  ------------------------------------------------------------------------
+  One more discussion must be had before generating using these formulas, and that involves branch cuts.
+  Branch cuts are important when discussing the value returned by the arctangent function. The function is
+  defined such that:
+
+       tan(x) = y <==> arctan(y) = x
+
+  However, the following is true of the tangent function:
+       tan(x) = tan(x + 2*pi) = tan(x + 4*pi) = tan(x - 2*pi) = .... = tan(x+2*pi*i), i-> integer
+
+  The arctangent function traditionally returns a value in the range (-pi, pi]. However, due to the property
+  of the tangent function, the value returned by the arctangent function can be in any range (x-pi, x+pi]
+  for any value of x. The range returned is known as the branch, and the extreme values of the range are
+  known as the branch cut (Note that in polar form, the angles x+pi and x-pi are coincident in the polar plane).
+
+  Unfortunately for complex exponentiation, the choice of which value of x to use to center the range
+  will affect the result that is obtained in a very meaningful way (Consider the formula above for Coe)
+
+  For the generation of fractals, there are many ways to pick a meaningful branch. Below are two methods
+
+  1. x = -b
+           Use the imaginary component of the exponent to set the branch 
+
+  2. x = Arg(c)
+           Use the argument of the original point to determine the branch
+
+
+  General Statements on branch cut:
+  Generally I have used this modified exponent "Multibrot" set generator for three general cases
+  and have the following generalizations about the "best" branch cut mode
+
+  1. Integer values of a and b=0 (ie. Z(N+1) = Z(N)^4 + C)
+      Here the branch cut method makes little to no difference
+
+  2. Small values for b and a=2 ((ie. Z(N+1) = Z(N)^(2+0.01i) + C))
+      I find the images look best with the first method of branch cut (flag not set)
+
+  3. Non-integer values of a and b=0
+     I have liked the images with the second method of the branch cut (flag is set)
+  
+  ------------------------------------------------------------------------
+  Interior Points:
+  ------------------------------------------------------------------------
+  Points inside the set would run for all DEPTH iterations. Most of them are drawn to an 
+  attracting cycle, which is found with Brent's method: the orbit is saved whenever N is a
+  power of two, and compared to each following point. Once a point is within PERIOD_EPS of
+  the saved one, the orbit has entered a cycle of length at most N and the point is inside.
+
+  ------------------------------------------------------------------------
+  Function:
+  ------------------------------------------------------------------------
+  The function is built for each branch mode, as calculate_escape_point and 
+  calculate_escape_exponent, so that the iteration loop does not test the mode.
+
+  Input: 
+        double x,y: The coordinates of the point in pixels of the PNG image, which need not
+                    be whole for the samples of a refined pixel
+        int branch: If set, the function will calculate the branch cut for the arctangent
+                    function using the argument of the initial point (r e ^ (i theta)). If not, 
+                    the branch cut will be based on the complex component of the exponent in
+                    the recursive definition of the fractal.
+  Output:
+        double: a pointer to the bytes which will be used to write a single row of the PNG image
+*/
+static inline __attribute__((always_inline))
+double calculate_escape(double x, double y, const int branch){
+  double reV, imV, a, b;
+  double rsq, th, coe, ang, pa, pb;
+  double br = 0.0;
+  int i, check;
+
+  /*
+  if (x+y > 0)
+    return ((double) x) /((double) s_width); 
+  */
+
+  reV = s_center_r + s_scale*(x - 0.5*s_width);
+  imV = s_center_i + s_scale*(0.5*s_height - y);
+
+  a = reV, b = imV;
+  rsq = a*a + b*b;
+
+  if (rsq < s_min_r){
+    t_stats->min_r++;
+    return 1.0;
+  }
+  else{
+    i=0;
+    th = atan2(b,a);
+
+    if (branch){
+      br = th;
+      while (br > (M_PI-s_power_i))
+        br -= 2*M_PI;
+      while (br < (-1.*s_power_i-M_PI))
+        br += 2*M_PI;
+    }
+
+  }
+
+  pa = a, pb = b;
+  check = 1;
+
+  for(; i < s_depth; i++){
+// Perform a branch cut for the complex exponential    
+    if (branch){
+      while (th > (br+M_PI))
+        th -= 2.0*M_PI;
+      while (th < (br-M_PI))
+        th += 2.0*M_PI;
+    }
+    else{
+      while (th > (M_PI-s_power_i))
+        th -= 2*M_PI;
+      while (th < (-1.*s_power_i-M_PI))
+        th += 2*M_PI;
+    }
+
+    coe = pow(rsq, s_power_r/2.)*exp(-1.0*s_power_i*th);
+    ang = s_power_r*th+0.5*s_power_i*log(rsq);
+
+    a = coe*cos(ang)+reV;
+    b = coe*sin(ang)+imV;
+
+    rsq = a*a + b*b;
+    th = atan2(b,a);
+
+    if (rsq < s_min_r){
+      t_iters += i+1;
+      t_stats->min_r++;
+      return 1.0;
+    }
+
+    if (rsq >= s_escape) {
+      t_iters += i+1;
+      count_escape(i);
+      coe = pow(rsq, s_power_r/2.)*exp(-1.0*s_power_i*th);
+      return escape_value(i, rsq, log(2.0*log(coe)/log(rsq)));
+    }
+
+    // If the orbit has returned to the point saved at the last power of two, it is periodic
+    if ((a-pa)*(a-pa) + (b-pb)*(b-pb) < PERIOD_EPS){
+      t_iters += i+1;
+      t_interior.period++;
+      return 1.0;
+    }
+    if (i+1 == check){
+      pa = a, pb = b;
+      check <<= 1;
+    }
+  }
+  t_iters += s_depth;
+  t_stats->depth++;
+  return 1.00;
+}
+
+double calculate_escape_point(double x, double y){
+  return calculate_escape(x, y, 1);
+}
+
+double calculate_escape_exponent(double x, double y){
+  return calculate_escape(x, y, 0);
+}
+
+
+/*
+  Function: count_escape
+
+  Counts an escaped pixel in the statistics of the thread, and in the histogram of the
+  iteration counts.
+
+  Input: 
+        int i: the iteration on which the point escaped, counted from 0
+  Output:
+        None
+*/
+static inline void count_escape(int i){
+  t_stats->escaped++;
+  t_stats->hist[31 - __builtin_clz((unsigned int) i+1)]++;
+}
+
+
+/*
+  Function: escape_value
+
+  Finds the smoothed escape value of a pixel from the iteration and squared magnitude at
+  which it escaped, as described for calculate_escape.
+
+  Input: 
+        int i:      the iteration on which the point escaped
+        double rsq: the square of |Z(N)| at the escape
+        double log_p: the log of the effective exponent of the final step, 2*log(Coe)/log(rsq),
+                      which is s_log_power for integer exponents
+  Output:
+        double: The escape value of the pixel in the range [0,1]
+*/
+static double escape_value(int i, double rsq, double log_p){
+  double r;
+
+  r = 2.0 - log(0.5*log(rsq)) / log_p;
+  r += (double) i;
+  r = log(r)/log((double) s_depth);
+  r = pow(r,0.5);
+  // A point far outside the set escapes so fast that the log above is negative, giving NaN
+  if (!(r >= 0.0))
+    return 0.0;
+  if (r > 1.0)
+    return 1.0;
+  return r;
+}
+
+
+/*
+  Function: calculate_escape_int
+
+  This is the equivalent of calculate_escape for exponents of the form (a+0i), where a is an
+  integer in the range [2, MAX_INT_POWER]. For these exponents the branch cut has no effect,
+  so Z(N)^a can be found by repeated complex multiplication (binary exponentiation) rather 
+  than through the polar form.
+
+  With b=0 the smooth coloring term reduces to:
+
+  modN = N + 1 - log(log(|Z(N)|)) / log(a)
+
+  so the value returned is identical to calculate_escape up to rounding.
+
+  For the standard Mandelbrot set (a=2), points inside the main cardioid or the period-2
+  bulb are found analytically before iterating. Other interior points are found by the
+  same cycle detection as calculate_escape.
+
+  Input: 
+        double x,y: The coordinates of the point in pixels of the PNG image
+  Output:
+        double: The escape value of the pixel in the range [0,1], 1 being inside the set
+*/
+double calculate_escape_int(double x, double y){
+  double reV, imV, a, b;
+  double rsq, pa, pb, ra, rb, sa, sb, t;
+  int i, n, check;
+
+  reV = s_center_r + s_scale*(x - 0.5*s_width);
+  imV = s_center_i + s_scale*(0.5*s_height - y);
+
+  a = reV, b = imV;
+  rsq = a*a + b*b;
+
+  if (rsq < s_min_r){
+    t_stats->min_r++;
+    return 1.0;
   }
-  // Create the pthreads and start them waiting for the rows to calculate
-  for (i=0; i < NUM_THREADS; i++){
-    pipefd.pipeRN = pipeRows[0];
-    pipefd.pipeRD = pipeRet[1];
-    if(pthread_create(&threads[i],NULL,handle_pthread,&pipefd) != 0){
-      printf("thread Error!\n");
-      _exit(-1);
+
+  // The main cardioid and the period-2 bulb of the Mandelbrot set can be tested directly
+  if (s_power_n == 2){
+    t = (a-0.25)*(a-0.25) + b*b;
+    if (t*(t+(a-0.25)) <= 0.25*b*b){
+      t_interior.cardioid++;
+      return 1.0;
+    }
+    if ((a+1.0)*(a+1.0) + b*b <= 0.0625){
+      t_interior.bulb++;
+      return 1.0;
     }
   }
 
-  // Pass the row numbers to the pthreads
-  for(j=0; j < s_height; j++){
-    if(write(pipeRows[1],&j,sizeof(int))!=sizeof(int)){
-      printf("Error writing: %d\n",j);
-      exit(-1);
+  sa = a, sb = b;
+  check = 1;
+
+  for(i=0; i < s_depth; i++){
+    // Find Z(N)^a, using the square directly for the standard Mandelbrot set
+    if (s_power_n == 2){
+      t = a*a - b*b;
+      b = 2.0*a*b;
+      a = t;
+    }
+    else{
+      ra = 1.0, rb = 0.0;
+      pa = a, pb = b;
+      for (n = s_power_n; n > 0; n >>= 1){
+        if (n & 1){
+          t  = ra*pa - rb*pb;
+          rb = ra*pb + rb*pa;
+          ra = t;
+        }
+        t  = pa*pa - pb*pb;
+        pb = 2.0*pa*pb;
+        pa = t;
+      }
+      a = ra, b = rb;
     }
-  }
 
-  // Write the end of row flag for each of the pthreads
-  for (i=0; i<NUM_THREADS; i++){
-    j=-1;
-    if(write(pipeRows[1],&j,sizeof(int))!=sizeof(int)){
-      printf("Error writing stop\n");
-      exit(-1);
+    a += reV;
+    b += imV;
+
+    rsq = a*a + b*b;
+
+    if (rsq < s_min_r){
+      t_iters += i+1;
+      t_stats->min_r++;
+      return 1.0;
     }
-  }
-  
-  // Await the termination of the pthreads in order to finish the PNG image
-  for (i=0; i<NUM_THREADS+1; i++){
-    if(pthread_join(threads[i],NULL)!=0){
-      printf("Error during thread join!\n");
-      _exit(-1);
+
+    if (rsq >= s_escape){
+      t_iters += i+1;
+      count_escape(i);
+      return escape_value(i, rsq, s_log_power);
+    }
+
+    // Test for a cycle against the point saved at the last power of two
+    if ((a-sa)*(a-sa) + (b-sb)*(b-sb) < PERIOD_EPS){
+      t_iters += i+1;
+      t_interior.period++;
+      return 1.0;
+    }
+    if (i+1 == check){
+      sa = a, sb = b;
+      check <<= 1;
     }
   }
+  t_iters += s_depth;
+  t_stats->depth++;
+  return 1.00;
 }
 
 
 /*
-  Function: handle_pthread
+  Function: calculate_escape_dd
 
-  This function will read row numbers from an input pipe. From these row numbers,
-  the function will use the calculate_row function to find the row data. After finding
-  the row data, the function will pass the result to the 
-  image writing thread using the output pipe.
+  The double-double version of calculate_escape_int (see mandel_dd.h), for views too deep 
+  for a double but not so deep as to need perturbation. The point is found from the center 
+  of the image, which holds all of its digits, and the cardioid and bulb tests are made in
+  double-double so that they hold close to their edges. The escape and cycle tests only 
+  need the high parts, and the cycles are found within the lesser of PERIOD_EPS and the 
+  square of the scale, so that the neighbouring pixels are still told apart. As for 
+  perturbation, the points are not tested against MIN_R, since no log is taken of them and
+  close to a minibrot every orbit passes near zero.
 
   Input: 
-        void *ptr_pipe: pointer to a struct ptr_pipe, 
-                        which hold the pointer to the input and output pipe file descriptors
+        double x,y: The coordinates of the point in pixels of the PNG image
   Output:
-        NULL
+        double: The escape value of the pixel in the range [0,1], 1 being inside the set
 */
-void *handle_pthread(void *ptr_pipe){
-  struct pipes pp;
-  struct row_data rowD;
-  int value;
-  
-  // Initialize pipes and value
-  pp = *((struct pipes *) ptr_pipe);
-  value=0;
-
-  // Take the row numbers passed in the pipe and calculate the color the entire row
-  while(value>=0){
-    if(read(pp.pipeRN, &value, sizeof(int))!=sizeof(int)){
-      printf("Read Error!!\n");
-      exit(-1);
+double calculate_escape_dd(double x, double y){
+  dd_t reV, imV, a, b, pa, pb, ra, rb, sa, sb, t, u;
+  double rsq, da, db, eps;
+  int i, n, check;
+
+  reV = dd_add_d(s_center_dd_r, s_scale*(x - 0.5*s_width));
+  imV = dd_add_d(s_center_dd_i, s_scale*(0.5*s_height - y));
+
+  a = reV, b = imV;
+
+  if (s_power_n == 2){
+    u = dd_add_d(a, -0.25);
+    t = dd_add(dd_sqr(u), dd_sqr(b));
+    if (dd_sub(dd_mul(t, dd_add(t, u)), dd_mul_d(dd_sqr(b), 0.25)).hi <= 0.0){
+      t_interior.cardioid++;
+      return 1.0;
+    }
+    if (dd_add_d(dd_add(dd_sqr(dd_add_d(a, 1.0)), dd_sqr(b)), -0.0625).hi <= 0.0){
+      t_interior.bulb++;
+      return 1.0;
+    }
+  }
+
+  eps = fmin(PERIOD_EPS, s_scale*s_scale);
+  sa = a, sb = b;
+  check = 1;
+
+  for(i=0; i < s_depth; i++){
+    if (s_power_n == 2){
+      t = dd_sub(dd_sqr(a), dd_sqr(b));
+      b = dd_mul_d(dd_mul(a, b), 2.0);
+      a = t;
     }
-    // If the value is less than zero, the image is done, otherwise continue calculating the row data
-    if (value >= 0){
-      // Calculate the values in the row and keep them with the row number
-      rowD.vals = calculate_row(value);
-      rowD.row_number = value;
-      // Pass the row data to the thread which is writing the row
-      if(write(pp.pipeRD, &rowD, sizeof(struct row_data))!=sizeof(struct row_data)){
-        printf("Error writing the row data!!\n");
-        exit(-1);
+    else{
+      ra = dd_from(1.0), rb = dd_from(0.0);
+      pa = a, pb = b;
+      for (n = s_power_n; n > 0; n >>= 1){
+        if (n & 1){
+          t  = dd_sub(dd_mul(ra, pa), dd_mul(rb, pb));
+          rb = dd_add(dd_mul(ra, pb), dd_mul(rb, pa));
+          ra = t;
+        }
+        t  = dd_sub(dd_sqr(pa), dd_sqr(pb));
+        pb = dd_mul_d(dd_mul(pa, pb), 2.0);
+        pa = t;
       }
+      a = ra, b = rb;
+    }
+
+    a = dd_add(a, reV);
+    b = dd_add(b, imV);
+
+    rsq = a.hi*a.hi + b.hi*b.hi;
+
+    if (rsq >= s_escape){
+      t_iters += i+1;
+      count_escape(i);
+      return escape_value(i, rsq, s_log_power);
+    }
+
+    da = dd_sub(a, sa).hi;
+    db = dd_sub(b, sb).hi;
+    if (da*da + db*db < eps){
+      t_iters += i+1;
+      t_interior.period++;
+      return 1.0;
+    }
+    if (i+1 == check){
+      sa = a, sb = b;
+      check <<= 1;
     }
   }
-  return NULL;
+  t_iters += s_depth;
+  t_stats->depth++;
+  return 1.00;
 }
 
 
 /*
-  Function: handle_output
+  Function: calculate_escape_quad
 
-  This function will read row data from the fractal calculating pthreads. As the pthreads
-  calculate the row data, they will pass the data using the row_data struct, allowing the 
-  data for the row, and the row number, to be passed to the thread using this function.
-  At such time, this thread will save the row data in an array. After saving the PNG image
-  will be written, keeping track of proper row numbers. As the image is printed, the memory
-  will be released, allowing the overall program a smaller overhead.
+  The reference for the precision check (see check_precision): calculate_escape_dd in quad
+  precision, with the 113 bit significand of __float128, which the compiler emulates.
 
   Input: 
-        void *row_data_pipe: pointer to the file descriptor of the pipe for the row data
+        double x,y: The coordinates of the point in pixels of the PNG image
   Output:
-        NULL
+        double: The escape value of the pixel in the range [0,1], 1 being inside the set
 */
-void *handle_output(void *row_data_pipe){
-  int next_row;
-  int read_pipe;
-  png_bytep *rows;
-  struct row_data read_data;
+static double calculate_escape_quad(double x, double y){
+  __float128 reV, imV, a, b, pa, pb, ra, rb, sa, sb, t;
+  double rsq, eps;
+  int i, n, check;
 
-  read_pipe = *((int *) row_data_pipe);
+  reV = (__float128) s_center_dd_r.hi + s_center_dd_r.lo + (__float128) s_scale*(x - 0.5*s_width);
+  imV = (__float128) s_center_dd_i.hi + s_center_dd_i.lo + (__float128) s_scale*(0.5*s_height - y);
+
+  a = reV, b = imV;
+  if (s_power_n == 2){
+    t = (a-0.25Q)*(a-0.25Q) + b*b;
+    if ((t*(t+(a-0.25Q)) <= 0.25Q*b*b) || ((a+1)*(a+1) + b*b <= 0.0625Q))
+      return 1.0;
+  }
 
-  // Make an array to hold the data for the individual rows 
-  //  and initilize all of the pointers to NULL
-  rows = (png_bytep *)malloc(sizeof(png_bytep)*s_height);
-  for (next_row=0; next_row<s_height; next_row++)
-    rows[next_row]=NULL;
+  eps = fmin(PERIOD_EPS, s_scale*s_scale);
+  sa = a, sb = b;
+  check = 1;
 
-  /*
-    Read the row data from one of the thread that are calculating the image.
-    Once this data has been read, add the row data to the image, using the given row number. 
-    Next, use the array to write the next row in the image, until the first break in 
-    the image is found. At this point, start again with reading data from the from the 
-    calculation threads.
-   */
-  next_row = 0;
-  while(next_row != s_height){
-    if(read(read_pipe, &read_data, sizeof(struct row_data)) != sizeof(struct row_data)){
-      printf("Error reading return values\n");
-      exit(-1);
+  for(i=0; i < s_depth; i++){
+    ra = 1, rb = 0;
+    pa = a, pb = b;
+    for (n = s_power_n; n > 0; n >>= 1){
+      if (n & 1){
+        t  = ra*pa - rb*pb;
+        rb = ra*pb + rb*pa;
+        ra = t;
+      }
+      t  = pa*pa - pb*pb;
+      pb = 2*pa*pb;
+      pa = t;
     }
-    // Save row data
-    rows[read_data.row_number]=read_data.vals;
-    
-    // Write as many rows as is possible, with the current information
-    while(rows[next_row] != NULL){
-      png_write_row(png_ptr,rows[next_row]); // Write image row
-      free(rows[next_row]);
-      rows[next_row]=NULL;
-      next_row++;
+    a = ra + reV;
+    b = rb + imV;
+
+    rsq = (double)(a*a + b*b);
+    if (rsq >= s_escape)
+      return escape_value(i, rsq, s_log_power);
+    if ((double)((a-sa)*(a-sa) + (b-sb)*(b-sb)) < eps)
+      return 1.0;
+    if (i+1 == check){
+      sa = a, sb = b;
+      check <<= 1;
     }
   }
-  free(rows);
-  return NULL; // Required from pthread
+  return 1.00;
 }
 
 
 /*
-  Function: calculate_row
+  Function: check_precision
 
-  This function takes a row number and calculates the value of the fractal at each pixel in the row.
-  With this value, the proper color is found and converted using the proper bit depth.
+  Renders the first frame with the kernel of each precision (-q check), and compares the 
+  escape values to a reference found in quad precision by calculate_escape_quad. For each
+  precision the time, the mean and largest error, and the share of pixels wrong by more 
+  than CHECK_ERROR are printed. The reference is slow, so the check is best made on a 
+  small image of the view.
 
-  Preprocessor Flags:
-        EIGHT_BIT: If this flag is set, the function will calculate the pixels using an 
-                   eight bit color scheme. If the flag is not set, the pixels will be calculated
-                   using a sixteen bit scheme
-  Input: 
-        int i: row number for the row that this function is computing
+  A reference whose pixels all have the same value, as when no pixel escapes within the
+  depth, tests nothing, so the share of interior pixels of the reference is printed as well.
+  Below AUTO_SCALE the default depth leaves most pixels interior, and -D auto is advised.
+
+  Input:
+        None
   Output:
-        png_bytep: a pointer to the bytes which will be used to write a single row of the PNG image
+        Returns 0 if the precision chosen by auto has no more than CHECK_SHARE of its pixels
+        wrong, and -1 otherwise, or if the reference is uniform
 */
-png_bytep calculate_row(int i){
-  png_bytep vals;
-  double result;
-  int j, start, ii;
+static int check_precision(){
+  struct thread_stats stats;
+  enum precision chosen, p;
+  uint64_t start, wrong;
+  float *ref, *img;
+  double err, sum, max;
+  uint64_t interior;
+  uint32_t x, y;
+  int fail = 0, uniform = 1;
 
-  // Allocate space to store the row data
-  if ((vals = (png_bytep) malloc(s_width*sizeof(png_byte)*(BIT_DEPTH/8)*3)) == NULL){
-    printf("Bad allocaion of row data!\n");
-    _exit(-1);
+  if (s_kind != KIND_INT){
+    printf("The precision check needs an integer exponent\n");
+    return -1;
   }
+  if (((ref = (float *) malloc((size_t) s_width*s_height*sizeof(float))) == NULL) ||
+      ((img = (float *) malloc((size_t) s_width*s_height*sizeof(float))) == NULL)){
+    printf("Error allocating the precision check!\n");
+    return -1;
+  }
+  memset(&stats, 0, sizeof(stats));
+  t_stats = &stats;
+  chosen = s_deep ? PRECISIONS : s_precision;
 
+  start = clock_ns();
+  for (y=0; y < s_height; y++)
+    for (x=0; x < s_width; x++)
+      ref[(size_t) y*s_width+x] = calculate_escape_quad(x, y);
+  printf("Reference in quad precision: %ux%u pixels in %.3f s\n", s_width, s_height,
+         1e-9*(clock_ns() - start));
 
-  for(j=0; j < s_width; j++){
-    // Calculate the result
-    result = calculate_escape(j, i);
-
-    // Find the start of the correct pixel
-    start = j*3*BIT_DEPTH/8;
+  interior = 0;
+  for (x=0; x < s_width*s_height; x++){
+    interior += (ref[x] >= 1.0f);
+    uniform &= (ref[x] == ref[0]);
+  }
+  printf("Interior pixels of the reference: %.3f%%\n", 100.0*interior/(s_width*s_height));
+  if ((s_depth_name == NULL) && (s_scale < AUTO_SCALE))
+    printf("Warning: the depth is the default %d below a scale of %.0e, try -D auto\n",
+           s_depth, AUTO_SCALE);
+  if (uniform){
+    printf("Every pixel of the reference has the same value, so there is nothing to check\n");
+    free(ref);
+    free(img);
+    return -1;
+  }
 
-    // If the pixel is in the set (recurses to the limit), set the pixel to black
-    if (result >= 1.0){
-      for(ii=0;ii<((BIT_DEPTH/8)*3); ii++) 
-        vals[start++]=0x00;
+  for (p=0; p < PRECISIONS; p++){
+    s_precision = p;
+    escape_fn = (p == PREC_DD) ? calculate_escape_dd : calculate_escape_int;
+    select_kernel(s_kernel_name);
+    if (s_precision != p){
+      printf("%-14s no %s kernel\n", s_precision_names[p], s_kernel);
+      continue;
     }
 
-    /* 
-       Here we use the value returned by the calculat_escape function to determine
-       the color of the pixel. For the eight bit encoding, there are three png_bytes of 
-       color data, whereas the sixteen bit encoding has 6 png_bytes
-    */ 
-#ifdef EIGHT_BIT
-    else {
-      vals[start++]=0xFF-(png_byte)(result*0xFF);
-      vals[start++]=0xFF-(png_byte)(result*0x77);
-      vals[start]=0xFF-(png_byte)(result*0xFF);
-    }
-#else
-    else{
-      vals[start++]=0xDD-(png_byte)(result*0xAA);
-      vals[start++]=0xFF-(png_byte)(result*0xFF);
-      vals[start++]=0xFF-(png_byte)(result*0xFF);
-      vals[start++]=0xFF-(png_byte)(result*0xFF);
-      vals[start++]=0xFF-(png_byte)(result*0x77);
-      vals[start]=0xFF-(png_byte)(result*0xFF);
-        
-    }
-#endif
+    start = clock_ns();
+    for (y=0; y < s_height; y++)
+      span_fn(y, 0, s_width, 1, 0, &img[(size_t) y*s_width]);
+    start = clock_ns() - start;
 
+    sum = max = 0.0;
+    wrong = 0;
+    for (x=0; x < s_width*s_height; x++){
+      err = fabs(img[x] - ref[x]);
+      sum += err;
+      max = fmax(max, err);
+      wrong += (err > CHECK_ERROR);
+    }
+    printf("%-14s %.3f s, mean error %.2e, largest error %.2e, %.3f%% of pixels wrong%s\n",
+           s_precision_names[p], 1e-9*start, sum/(s_width*s_height), max,
+           100.0*wrong/(s_width*s_height), (p == chosen) ? " (chosen by auto)" : "");
+    if ((p == chosen) && (wrong > CHECK_SHARE*s_width*s_height))
+      fail = 1;
   }
-  return vals;
-}
+  if (chosen == PRECISIONS)
+    printf("auto uses perturbation for this view\n");
+  if (fail)
+    printf("The precision chosen by auto has more than %.1f%% of its pixels wrong\n", 100.0*CHECK_SHARE);
 
-/*
-  Function: calculate_escape
+  free(ref);
+  free(img);
+  return fail ? -1 : 0;
+}
 
-  This is the function which tests each point to find if it is in the fractal and if not, the escape
-  from that set. 
 
+/*
   ------------------------------------------------------------------------
-  Background:
+  Deep Zoom (Perturbation):
   ------------------------------------------------------------------------
-  For this, the following basic recursive definition of the fractal is used, assuming
-  the complex value c is the point being tested. The Mandelbrot set is traditionally defined for (a+bi) = 2.
+  Below a scale of about 1e-14 the coordinates of neighbouring pixels can no longer be told
+  apart as doubles. Instead, a single reference orbit Z(N) is found in double-double 
+  precision for the center of the image C, and each pixel c = C + dc is iterated as the 
+  difference d(N) = z(N) - Z(N), which is small enough to be held as a double:
 
-  Base Case:
-  Z(0) = c
-  Recursive Case:
-  Z(N+1) = Z(N)^(a+bi)+c
+  Integer exponents:
+                d(N+1) = (Z+d)^a - Z^a + dc = Sum[k=1..a] (a choose k) Z^(a-k) d^k + dc
 
-  The fractal is defined to be the set of points C for which the following limit is held.
+  Complex exponents (writing w = d/Z):
+                d(N+1) = Z^a * ((1+w)^(a+bi) - 1) + dc
+                       = Z^a * expm1((a+bi) * log1p(w)) + dc
 
-  lim N->Inf |Z(N)| < bound, bound > 0, bound element of the Reals.
+  where the argument of log1p(w) is moved by a multiple of 2*pi, so that the angle of the 
+  pixel's own point stays within its branch cut.
 
-  For the Mandelbrot set [(a+bi) = 2] is independant of the value of the bound, given that b >= 2.
+  For integer exponents, the first iterations are skipped by a series approximation
+                d(N) = A(N) dc + B(N) dc^2 + C(N) dc^3
+  with coefficients found along the reference orbit. Iterations are skipped until the 
+  cubic term is larger than SA_EPS times the linear term for the corner pixels.
 
-  Traditionally, the Mandelbrot fractal is displayed as a colorful image. This is obtained by noting the 
-  value of N and |Z(N)| for the first value that is larger than the bound. The following formula is used 
-  to generate a value in the range (0,1), based on the Taylor expansion shown at
-  http://linas.org/art-gallery/escape/escape.html.
+  When |z(N)| < |d(N)|, or the reference orbit has escaped, the difference would lose its 
+  precision (a glitch). The pixel is then rebased onto the start of the reference orbit,
+  Z(0) = 0, by setting d(N) = z(N).
 
-  modN = N + 1 - log(log(|Z(N)|)) / log(r^a * e^(-b * theta))
-  
-  The justification of the final term is shown below. The returned value is modN divided by the 
-  maximum number of iterations allowed by the program.
+  The orbits are indexed from Z(0) = 0, so that Z(1) = C is the base case of the recursion.
 
-  ------------------------------------------------------------------------
-  Implementation:
-  ------------------------------------------------------------------------
-  The recursive case can be solved using the following expressions:
+  No log is taken of a point itself, only of 1+w, so points are not tested against MIN_R.
+  Close to a minibrot every orbit passes near zero, and the test would mark them all inside.
+*/
 
-  Define The Following:
-                Z(N)        = r e^(i * theta)       -> Polar form of a complex number
-                Coefficient = r^a * e^(-b * theta)  = Coe 
-                Angle       = a * theta + b * ln(r) = Ang
+/*
+  Function: build_reference
 
-  From these definitions, we can write the recursive form in an easily calculable form, 
-         where Re{Z} is the real component of Z and Im{Z} is the imaginary component of Z:
-                Re{Z(N+1)} = Coe * cos ( Ang ) + Re{c}
-                Im{Z(N+1)} = Coe * sin ( Ang ) + Im{c}
+  Finds the reference orbit for the center of the image in double-double precision, and 
+  for integer exponents the coefficients of the series approximation. The orbit is saved
+  as doubles in s_ref, REF_STRIDE values per iteration: Re{Z}, Im{Z}, Re{Z^a}, Im{Z^a} and
+  the angle of Z within the branch cut of the center.
 
-  Now, we convert the value Z(N+1) from Standard Form to Polar Form:
-                Z(N+1) = r e^(i * theta)
-                r      = Sqrt(Re{Z(N+1)}*Re{Z(N+1)}+Im{Z(N+1)}*Im{Z(N+1)})
-                theta  = arctan2(Re{Z(N+1)}, Im{Z(N+1)})
+  Input:
+        None
+  Output:
+        None (s_ref, s_ref_n, s_sa_skip and s_sa are set)
+*/
+static void build_reference(){
+  dd_t zr, zi, pr, pi, tr, ti, rsq, th, lr, coe, ang, sn, cs;
+  double *ref, fr, fi, f1r, f1i, f2r, f2i, f3r, f3i, ar, ai, br, bi, cr, ci;
+  double nar, nai, nbr, nbi, ncr, nci, dmax, t, brc;
+  int k, n, j;
 
-  In order to save us from using the square root function, we can use the following modifications
-                Z(N+1) = Sqrt(rsq) * e^(i * theta)
-                rsq    = Re{Z(N+1)}*Re{Z(N+1)}+Im{Z(N+1)}*Im{Z(N+1)}
-                theta  = arctan2(Re{Z(N+1)}, Im{Z(N+1)})
+  // The orbit is kept from one frame to the next, unless it needs to be longer
+  if (s_ref_cap < s_depth+2){
+    free(s_ref);
+    if ((s_ref = (double *) malloc(((size_t) s_depth+2)*REF_STRIDE*sizeof(double))) == NULL){
+      printf("Error allocating the reference orbit!\n");
+      exit(-1);
+    }
+    s_ref_cap = s_depth+2;
+    atomic_fetch_add(&s_allocs, 1);
+  }
 
-  For this to b used, we also must modify the original definitions:
-                Z(N)        = Sqrt(rsq) * e^(i * theta)
-                Coefficient = rsq^(a/2) * e^(-b * theta)    = Coe 
-                Angle       = a * theta + 1/2 * b * ln(rsq) = Ang
+  // The binomial coefficients used by the integer exponent recursion
+  for (j=0; j <= s_power_n; j++)
+    s_binom[j] = (j == 0) ? 1.0 : s_binom[j-1]*(s_power_n-j+1)/j;
+  for (; j <= 3; j++)
+    s_binom[j] = 0.0;
 
-  ------------------------------------------------------------------------
-  Branch Cuts:
-  ------------------------------------------------------------------------
-  One more discussion must be had before generating using these formulas, and that involves branch cuts.
-  Branch cuts are important when discussing the value returned by the arctangent function. The function is
-  defined such that:
+  // The branch cut of the center, as used by calculate_escape
+  brc = -1.0*s_power_i;
+  if (s_branch){
+    brc = atan2(dd_to_d(s_center_dd_i), dd_to_d(s_center_dd_r));
+    brc -= 2.0*M_PI*floor((brc + s_power_i + M_PI)/(2.0*M_PI));
+  }
 
-       tan(x) = y <==> arctan(y) = x
+  dmax = s_scale*sqrt(0.25*s_width*s_width + 0.25*s_height*s_height);
+  ar = ai = br = bi = cr = ci = 0.0;
+  s_sa_skip = 0;
 
-  However, the following is true of the tangent function:
-       tan(x) = tan(x + 2*pi) = tan(x + 4*pi) = tan(x - 2*pi) = .... = tan(x+2*pi*i), i-> integer
+  zr = zi = dd_from(0.0);
+  th = dd_from(0.0);
+  ref = s_ref;
+  for (k=0; k <= s_depth; k++, ref += REF_STRIDE){
+    ref[0] = dd_to_d(zr);
+    ref[1] = dd_to_d(zi);
+    ref[4] = dd_to_d(th);
 
-  The arctangent function traditionally returns a value in the range (-pi, pi]. However, due to the property
-  of the tangent function, the value returned by the arctangent function can be in any range (x-pi, x+pi]
-  for any value of x. The range returned is known as the branch, and the extreme values of the range are
-  known as the branch cut (Note that in polar form, the angles x+pi and x-pi are coincident in the polar plane).
+    // Find Z^a, by multiplication for integer exponents and the polar form otherwise
+    if (s_power_n > 0){
+      pr = dd_from(1.0), pi = dd_from(0.0);
+      tr = zr, ti = zi;
+      for (n = s_power_n; n > 0; n >>= 1){
+        if (n & 1){
+          lr = dd_sub(dd_mul(pr, tr), dd_mul(pi, ti));
+          pi = dd_add(dd_mul(pr, ti), dd_mul(pi, tr));
+          pr = lr;
+        }
+        lr = dd_sub(dd_sqr(tr), dd_sqr(ti));
+        ti = dd_mul_d(dd_mul(tr, ti), 2.0);
+        tr = lr;
+      }
+    }
+    else if (k == 0)
+      pr = pi = dd_from(0.0);
+    else{
+      rsq = dd_add(dd_sqr(zr), dd_sqr(zi));
+      lr = dd_log(rsq);
+      coe = dd_exp(dd_sub(dd_mul_d(lr, 0.5*s_power_r), dd_mul_d(th, s_power_i)));
+      ang = dd_add(dd_mul_d(th, s_power_r), dd_mul_d(lr, 0.5*s_power_i));
+      dd_sincos(ang, &sn, &cs);
+      pr = dd_mul(coe, cs);
+      pi = dd_mul(coe, sn);
+    }
+    ref[2] = dd_to_d(pr);
+    ref[3] = dd_to_d(pi);
 
-  Unfortunately for complex exponentiation, the choice of which value of x to use to center the range
-  will affect the result that is obtained in a very meaningful way (Consider the formula above for Coe)
+    // Advance the series approximation while the cubic term remains negligible
+    if ((s_power_n > 0) && (s_sa_skip == k)){
+      fr = ref[0], fi = ref[1];
+      f3r = 1.0, f3i = 0.0;
+      for (j=3; j < s_power_n; j++){
+        t = f3r*fr - f3i*fi;
+        f3i = f3r*fi + f3i*fr;
+        f3r = t;
+      }
+      // f1 = a Z^(a-1), f2 = (a choose 2) Z^(a-2), f3 = (a choose 3) Z^(a-3)
+      f2r = (s_power_n > 2) ? f3r*fr - f3i*fi : 1.0;
+      f2i = (s_power_n > 2) ? f3r*fi + f3i*fr : 0.0;
+      f1r = (f2r*fr - f2i*fi)*s_power_n;
+      f1i = (f2r*fi + f2i*fr)*s_power_n;
+      f2r *= s_binom[2], f2i *= s_binom[2];
+      f3r *= s_binom[3], f3i *= s_binom[3];
 
-  For the generation of fractals, there are many ways to pick a meaningful branch. Below are two methods
+      ncr = f1r*cr - f1i*ci + 2.0*((f2r*ar - f2i*ai)*br - (f2r*ai + f2i*ar)*bi);
+      nci = f1r*ci + f1i*cr + 2.0*((f2r*ar - f2i*ai)*bi + (f2r*ai + f2i*ar)*br);
+      t = ar*ar - ai*ai;
+      fi = 2.0*ar*ai;
+      ncr += (f3r*t - f3i*fi)*ar - (f3r*fi + f3i*t)*ai;
+      nci += (f3r*t - f3i*fi)*ai + (f3r*fi + f3i*t)*ar;
+      nbr = f1r*br - f1i*bi + f2r*t - f2i*fi;
+      nbi = f1r*bi + f1i*br + f2r*fi + f2i*t;
+      nar = f1r*ar - f1i*ai + 1.0;
+      nai = f1r*ai + f1i*ar;
 
-  1. x = -b
-           Use the imaginary component of the exponent to set the branch 
+      if (hypot(ncr, nci)*dmax*dmax*dmax <= SA_EPS*hypot(nar, nai)*dmax){
+        ar = nar, ai = nai, br = nbr, bi = nbi, cr = ncr, ci = nci;
+        s_sa_skip = k+1;
+      }
+    }
 
-  2. x = Arg(c)
-           Use the argument of the original point to determine the branch
+    // Z(N+1) = Z(N)^a + C
+    zr = dd_add(pr, s_center_dd_r);
+    zi = dd_add(pi, s_center_dd_i);
 
+    if (s_power_n == 0){
+      th = dd_atan2(zi, zr);
+      t = floor((dd_to_d(th) - brc + M_PI)/(2.0*M_PI));
+      th = dd_sub(th, dd_mul_d(DD_2PI, t));
+    }
 
-  General Statements on branch cut:
-  Generally I have used this modified exponent "Multibrot" set generator for three general cases
-  and have the following generalizations about the "best" branch cut mode
+    if (dd_to_d(dd_add(dd_sqr(zr), dd_sqr(zi))) >= s_escape){
+      k++, ref += REF_STRIDE;
+      break;
+    }
+  }
+  ref[0] = dd_to_d(zr);
+  ref[1] = dd_to_d(zi);
+  ref[2] = ref[3] = 0.0;
+  ref[4] = dd_to_d(th);
+  s_ref_n = k+1;
 
-  1. Integer values of a and b=0 (ie. Z(N+1) = Z(N)^4 + C)
-      Here the branch cut method makes little to no difference
+  // The pixels must be able to take at least one step from the skipped iteration
+  if (s_sa_skip > s_ref_n-2)
+    s_sa_skip = (s_ref_n > 2) ? s_ref_n-2 : 0;
+  s_sa[0] = ar, s_sa[1] = ai, s_sa[2] = br, s_sa[3] = bi, s_sa[4] = cr, s_sa[5] = ci;
+}
 
-  2. Small values for b and a=2 ((ie. Z(N+1) = Z(N)^(2+0.01i) + C))
-      I find the images look best with the first method of branch cut (flag not set)
 
-  3. Non-integer values of a and b=0
-     I have liked the images with the second method of the branch cut (flag is set)
-  
-  ------------------------------------------------------------------------
-  Function:
-  ------------------------------------------------------------------------
-  Preprocessor Flags:
-        BRANCH: If this flag is set, the function will calculate the branch cut for the arctangent
-                function using the argument of the initial point (r e ^ (i theta)). If not, the 
-                branch cut will be based on the complex component of the exponent in the recursive
-                definition of the fractal.
+/*
+  Function: calculate_escape_deep
+
+  Finds the escape value of a pixel by perturbation from the reference orbit found by
+  build_reference, as described above. The value returned is the same as that of 
+  calculate_escape or calculate_escape_int for the same point.
+
   Input: 
-        int x,y: The coordinates of the pixel being calculated in the PNG image
+        double x,y: The coordinates of the point in pixels of the PNG image
   Output:
-        double: a pointer to the bytes which will be used to write a single row of the PNG image
+        double: The escape value of the pixel in the range [0,1], 1 being inside the set
 */
-double calculate_escape(int x, int y){
-  double reV, imV, a, b;
-  double rsq, r, th, coe, ang;
-  int i;
-
-  /*
-  if (x+y > 0)
-    return ((double) x) /((double) s_width); 
-  */
-#ifdef BRANCH
-  double br;
-#endif
-
-  reV = cornerR+s_scale*x;
-  imV = cornerI-s_scale*y;
-
-  a = reV, b = imV;
-  rsq = a*a + b*b;
+double calculate_escape_deep(double x, double y){
+  double dcr, dci, dr, di, zr, zi, rsq, rr, ri, pr, pi, t;
+  double wr, wi, lr, li, u, v, em, sv, th, br;
+  const double *ref;
+  int k, m, j;
 
-  if (rsq < MIN_R)
-    i=DEPTH;
-  else{
-    i=0;
-    th = atan2(b,a);
+  dcr = s_scale*(x - 0.5*s_width);
+  dci = s_scale*(0.5*s_height - y);
 
-#ifdef BRANCH
-    br = th;
-    while (br > (M_PI-s_power_i))
-      br -= 2*M_PI;
-    while (br < (-1.*s_power_i-M_PI))
-      br += 2*M_PI;
-#endif
+  // The branch cut of this pixel, as used by calculate_escape
+  br = -1.0*s_power_i;
+  if (s_branch){
+    br = atan2(dd_to_d(s_center_dd_i) + dci, dd_to_d(s_center_dd_r) + dcr);
+    br -= 2.0*M_PI*floor((br + s_power_i + M_PI)/(2.0*M_PI));
+  }
 
+  // Skip the first iterations using the series approximation
+  k = m = s_sa_skip;
+  dr = di = 0.0;
+  if (k > 0){
+    rr = s_sa[2] + dcr*s_sa[4] - dci*s_sa[5];
+    ri = s_sa[3] + dcr*s_sa[5] + dci*s_sa[4];
+    t  = s_sa[0] + dcr*rr - dci*ri;
+    ri = s_sa[1] + dcr*ri + dci*rr;
+    rr = t;
+    dr = dcr*rr - dci*ri;
+    di = dcr*ri + dci*rr;
   }
 
-  for(; i < DEPTH; i++){
-// Perform a branch cut for the complex exponential    
-#ifdef BRANCH
-    while (th > (br+M_PI))
-      th -= 2.0*M_PI;
-    while (th < (br-M_PI))
-      th += 2.0*M_PI;
-#else
-    while (th > (M_PI-s_power_i))
-      th -= 2*M_PI;
-    while (th < (-1.*s_power_i-M_PI))
-      th += 2*M_PI;
-#endif
+  for (; k <= s_depth; k++){
+    // Rebase once the reference orbit has escaped
+    if (m == s_ref_n-1){
+      dr += s_ref[m*REF_STRIDE];
+      di += s_ref[m*REF_STRIDE+1];
+      m = 0;
+      t_rebases++;
+    }
+    ref = &s_ref[m*REF_STRIDE];
 
-    coe = pow(rsq, s_power_r/2.)*exp(-1.0*s_power_i*th);
-    ang = s_power_r*th+0.5*s_power_i*log(rsq);
+    if (s_power_n > 0){
+      // Horner's method on Sum[k=1..a] (a choose k) Z^(a-k) d^(k-1)
+      rr = 1.0, ri = 0.0;
+      pr = 1.0, pi = 0.0;
+      for (j = s_power_n-1; j > 0; j--){
+        t  = pr*ref[0] - pi*ref[1];
+        pi = pr*ref[1] + pi*ref[0];
+        pr = t;
+        t  = rr*dr - ri*di + s_binom[j]*pr;
+        ri = rr*di + ri*dr + s_binom[j]*pi;
+        rr = t;
+      }
+      t  = rr*dr - ri*di + dcr;
+      di = rr*di + ri*dr + dci;
+      dr = t;
+    }
+    else if (m == 0){
+      // From Z(0) = 0 the difference is the point itself, so use the polar form directly
+      rsq = dr*dr + di*di;
+      if (rsq == 0.0){
+        dr = dcr, di = dci;
+        m++;
+        continue;
+      }
+      th = atan2(di, dr);
+      th -= 2.0*M_PI*floor((th - br + M_PI)/(2.0*M_PI));
+      t = pow(rsq, s_power_r/2.)*exp(-1.0*s_power_i*th);
+      u = s_power_r*th+0.5*s_power_i*log(rsq);
+      dr = t*cos(u) + dcr;
+      di = t*sin(u) + dci;
+    }
+    else{
+      // w = d/Z, and log1p(w) with its angle moved within the branch cut of the pixel
+      t = ref[0]*ref[0] + ref[1]*ref[1];
+      wr = (dr*ref[0] + di*ref[1])/t;
+      wi = (di*ref[0] - dr*ref[1])/t;
+      lr = 0.5*log1p(2.0*wr + wr*wr + wi*wi);
+      li = atan2(wi, 1.0 + wr);
+      th = ref[4] + li;
+      li -= 2.0*M_PI*floor((th - br + M_PI)/(2.0*M_PI));
 
-    a = coe*cos(ang)+reV;
-    b = coe*sin(ang)+imV;
+      // expm1((a+bi)*log1p(w)), keeping the precision of small results
+      u = s_power_r*lr - s_power_i*li;
+      v = s_power_r*li + s_power_i*lr;
+      em = expm1(u);
+      sv = sin(0.5*v);
+      rr = em*cos(v) - 2.0*sv*sv;
+      ri = (em + 1.0)*sin(v);
 
-    rsq = a*a + b*b;
-    th = atan2(b,a);
+      t  = ref[2]*rr - ref[3]*ri + dcr;
+      di = ref[2]*ri + ref[3]*rr + dci;
+      dr = t;
+    }
+    m++;
 
-    if (rsq < MIN_R)
-      return 1.0;
+    zr = s_ref[m*REF_STRIDE] + dr;
+    zi = s_ref[m*REF_STRIDE+1] + di;
+    rsq = zr*zr + zi*zi;
 
-    if (rsq >= ESCAPE) {
-      coe = pow(rsq, s_power_r/2.)*exp(-1.0*s_power_i*th);
-      coe = 2.0*log(coe)/log(rsq);
-      r = 2.0 - log(0.5*log(rsq)) / log(coe);
-      r += (double) i;
-      r = log(r)/log((double) DEPTH);
-      r = pow(r,0.5);
-      if (r < 0.0)
-        return 0.0;
-      if (r > 1.0)
-        return 1.0;
-      return r;
+    // The first step gives Z(1) = c, which is not tested for escape
+    if ((k > 0) && (rsq >= s_escape)){
+      t_iters += k+1-s_sa_skip;
+      count_escape(k-1);
+      if (s_power_n > 0)
+        return escape_value(k-1, rsq, s_log_power);
+      t = pow(rsq, s_power_r/2.)*exp(-1.0*s_power_i*atan2(zi, zr));
+      return escape_value(k-1, rsq, log(2.0*log(t)/log(rsq)));
+    }
+
+    // Rebase when the point is closer to zero than to the reference
+    if (rsq < dr*dr + di*di){
+      dr = zr, di = zi;
+      m = 0;
+      t_rebases++;
     }
   }
+  t_iters += s_depth+1-s_sa_skip;
+  t_stats->depth++;
   return 1.00;
 }
 
@@ -0,0 +1,275 @@
+/*
+  mandel_dd.h
+
+  Double-double arithmetic, used where a double does not have the precision to hold the
+  position of a point. A value is kept as the unevaluated sum hi+lo of two doubles, with
+  |lo| <= ulp(hi)/2, which gives about 32 significant digits with the range of a double.
+
+  The basic operations follow Dekker, and the QD library of Hida, Li and Bailey. The
+  transcendental functions are found either by a short Taylor series after range reduction
+  (exp, sin, cos) or by a single Newton step from the double result (log, atan2).
+*/
+
+typedef struct{
+  double hi;
+  double lo;
+} dd_t;
+
+#define DD_PI      ((dd_t){3.141592653589793116e+00, 1.224646799147353207e-16})
+#define DD_PI_2    ((dd_t){1.570796326794896558e+00, 6.123233995736766036e-17})
+#define DD_2PI     ((dd_t){6.283185307179586232e+00, 2.449293598294706414e-16})
+#define DD_LN2     ((dd_t){6.931471805599452862e-01, 2.319046813846299558e-17})
+
+
+static inline dd_t dd_from(double d){
+  return (dd_t){d, 0.0};
+}
+
+static inline double dd_to_d(dd_t a){
+  return a.hi + a.lo;
+}
+
+// Sum of two doubles, exact when |a| >= |b|
+static inline dd_t dd_quick_two_sum(double a, double b){
+  double s = a + b;
+  return (dd_t){s, b - (s - a)};
+}
+
+// Exact sum of two doubles
+static inline dd_t dd_two_sum(double a, double b){
+  double s = a + b;
+  double bb = s - a;
+  return (dd_t){s, (a - (s - bb)) + (b - bb)};
+}
+
+// Exact product of two doubles
+static inline dd_t dd_two_prod(double a, double b){
+  double p = a * b;
+  return (dd_t){p, fma(a, b, -p)};
+}
+
+static inline dd_t dd_neg(dd_t a){
+  return (dd_t){-a.hi, -a.lo};
+}
+
+static inline dd_t dd_add(dd_t a, dd_t b){
+  dd_t s, t;
+
+  s = dd_two_sum(a.hi, b.hi);
+  t = dd_two_sum(a.lo, b.lo);
+  s.lo += t.hi;
+  s = dd_quick_two_sum(s.hi, s.lo);
+  s.lo += t.lo;
+  return dd_quick_two_sum(s.hi, s.lo);
+}
+
+static inline dd_t dd_sub(dd_t a, dd_t b){
+  return dd_add(a, dd_neg(b));
+}
+
+static inline dd_t dd_add_d(dd_t a, double b){
+  dd_t s;
+
+  s = dd_two_sum(a.hi, b);
+  s.lo += a.lo;
+  return dd_quick_two_sum(s.hi, s.lo);
+}
+
+static inline dd_t dd_mul(dd_t a, dd_t b){
+  dd_t p;
+
+  p = dd_two_prod(a.hi, b.hi);
+  p.lo += a.hi*b.lo + a.lo*b.hi;
+  return dd_quick_two_sum(p.hi, p.lo);
+}
+
+static inline dd_t dd_mul_d(dd_t a, double b){
+  dd_t p;
+
+  p = dd_two_prod(a.hi, b);
+  p.lo += a.lo*b;
+  return dd_quick_two_sum(p.hi, p.lo);
+}
+
+static inline dd_t dd_sqr(dd_t a){
+  dd_t p;
+
+  p = dd_two_prod(a.hi, a.hi);
+  p.lo += 2.0*a.hi*a.lo;
+  return dd_quick_two_sum(p.hi, p.lo);
+}
+
+static inline dd_t dd_div(dd_t a, dd_t b){
+  double q1, q2, q3;
+  dd_t r;
+
+  q1 = a.hi / b.hi;
+  r = dd_sub(a, dd_mul_d(b, q1));
+  q2 = r.hi / b.hi;
+  r = dd_sub(r, dd_mul_d(b, q2));
+  q3 = r.hi / b.hi;
+
+  r = dd_quick_two_sum(q1, q2);
+  return dd_add_d(r, q3);
+}
+
+static inline dd_t dd_div_d(dd_t a, double b){
+  return dd_div(a, dd_from(b));
+}
+
+static inline dd_t dd_ldexp(dd_t a, int e){
+  return (dd_t){ldexp(a.hi, e), ldexp(a.lo, e)};
+}
+
+static inline dd_t dd_sqrt(dd_t a){
+  double q;
+
+  if (a.hi <= 0.0)
+    return dd_from(0.0);
+  q = sqrt(a.hi);
+  return dd_add_d(dd_from(q), dd_to_d(dd_sub(a, dd_two_prod(q, q))) * (0.5/q));
+}
+
+
+/*
+  Parses a decimal number, such as -0.74364388703715870475219150611477, keeping all of the
+  digits which a double-double can hold. An exponent (e-20) may follow the digits.
+*/
+static inline dd_t dd_parse(const char *s){
+  dd_t r = dd_from(0.0);
+  int neg = 0, frac = -1, exp10 = 0, digits = 0;
+
+  while (*s == ' ')
+    s++;
+  if ((*s == '-') || (*s == '+'))
+    neg = (*s++ == '-');
+
+  for (; *s; s++){
+    if ((*s >= '0') && (*s <= '9')){
+      // Digits beyond the precision only change the exponent
+      if (digits < 34){
+        r = dd_add_d(dd_mul_d(r, 10.0), (double)(*s - '0'));
+        if (frac >= 0)
+          frac++;
+        if ((r.hi != 0.0) || (*s != '0'))
+          digits++;
+      }
+      else if (frac < 0)
+        exp10++;
+    }
+    else if ((*s == '.') && (frac < 0))
+      frac = 0;
+    else if ((*s == 'e') || (*s == 'E')){
+      exp10 += (int) strtol(s+1, NULL, 10);
+      break;
+    }
+    else
+      break;
+  }
+
+  if (frac > 0)
+    exp10 -= frac;
+  for (; exp10 > 0; exp10--)
+    r = dd_mul_d(r, 10.0);
+  for (; exp10 < 0; exp10++)
+    r = dd_div_d(r, 10.0);
+
+  return neg ? dd_neg(r) : r;
+}
+
+
+/*
+  Exponential function. After removing a multiple of ln(2), the argument is divided by 2^10
+  so that a short Taylor series of exp(r)-1 is exact, and the result is squared 10 times.
+*/
+static inline dd_t dd_exp(dd_t a){
+  dd_t r, s, t;
+  double k;
+  int i;
+
+  if (a.hi > 709.0)
+    return dd_from(INFINITY);
+  if (a.hi < -745.0)
+    return dd_from(0.0);
+
+  k = nearbyint(a.hi / DD_LN2.hi);
+  r = dd_ldexp(dd_sub(a, dd_mul_d(DD_LN2, k)), -10);
+
+  // s = exp(r)-1
+  s = t = r;
+  for (i=2; i <= 10; i++){
+    t = dd_div_d(dd_mul(t, r), (double) i);
+    s = dd_add(s, t);
+  }
+
+  // exp(2r)-1 = 2s + s^2
+  for (i=0; i < 10; i++)
+    s = dd_add(dd_mul_d(s, 2.0), dd_sqr(s));
+
+  return dd_ldexp(dd_add_d(s, 1.0), (int) k);
+}
+
+
+static inline dd_t dd_log(dd_t a){
+  dd_t x;
+
+  // One Newton step on exp(x) = a from the double logarithm
+  x = dd_from(log(a.hi));
+  return dd_add_d(dd_add(x, dd_mul(a, dd_exp(dd_neg(x)))), -1.0);
+}
+
+
+/*
+  Sine and cosine, reduced to [-pi/4, pi/4] by a multiple of pi/2 and found by Taylor series
+*/
+static inline void dd_sincos(dd_t a, dd_t *s, dd_t *c){
+  dd_t r, rr, t, sn, cs;
+  double q;
+  int i, n;
+
+  q = nearbyint(a.hi / DD_PI_2.hi);
+  r = dd_sub(a, dd_mul_d(DD_PI_2, q));
+  rr = dd_neg(dd_sqr(r));
+
+  sn = t = r;
+  for (i=3; i < 30; i+=2){
+    t = dd_div_d(dd_mul(t, rr), (double)((i-1)*i));
+    sn = dd_add(sn, t);
+  }
+  cs = t = dd_from(1.0);
+  for (i=2; i < 30; i+=2){
+    t = dd_div_d(dd_mul(t, rr), (double)((i-1)*i));
+    cs = dd_add(cs, t);
+  }
+
+  n = ((int) fmod(q, 4.0) + 4) & 3;
+  switch (n){
+  case 0: *s = sn, *c = cs;
+    break;
+  case 1: *s = cs, *c = dd_neg(sn);
+    break;
+  case 2: *s = dd_neg(sn), *c = dd_neg(cs);
+    break;
+  default: *s = dd_neg(cs), *c = sn;
+    break;
+  }
+}
+
+
+static inline dd_t dd_atan2(dd_t y, dd_t x){
+  dd_t r, z, s, c;
+
+  if ((x.hi == 0.0) && (y.hi == 0.0))
+    return dd_from(0.0);
+
+  // One Newton step from the double angle, using the point scaled to the unit circle
+  r = dd_sqrt(dd_add(dd_sqr(x), dd_sqr(y)));
+  x = dd_div(x, r);
+  y = dd_div(y, r);
+  z = dd_from(atan2(y.hi, x.hi));
+  dd_sincos(z, &s, &c);
+
+  if (fabs(x.hi) > fabs(y.hi))
+    return dd_add(z, dd_div(dd_sub(y, s), c));
+  return dd_sub(z, dd_div(dd_sub(x, c), s));
+}
@@ -0,0 +1,817 @@
+/*
+  mandel_simd.h
+
+  Template for the vectorized escape kernels. This file is included by mandel.c once for
+  every instruction set, inside a "#pragma GCC target" region, with the following defined:
+
+  VEC_WIDTH:  The number of doubles held by one vector (2 for SSE2, 4 for AVX2, 8 for AVX-512)
+  VEC_NAME:   Appends the instruction set to a name, ie. VEC_NAME(v_exp) -> v_exp_avx2
+  VEC_ANY:    Tests if any lane of a mask is set, using the instruction set's movemask or test
+  VEC_ANY_F:  The same for a mask of 32-bit lanes, as used by the float kernel
+
+  The kernels iterate VEC_WIDTH neighbouring pixels of a row together. Each lane is masked
+  off once its pixel has escaped or fallen below s_min_r, and the group of pixels is finished
+  when no lane remains active or s_depth has been reached. The escape values are then found
+  per lane with escape_value, exactly as the scalar kernels do. The interior tests of the
+  scalar kernels (cardioid, bulb and cycle detection) are applied to every lane.
+
+  The general kernel requires vector versions of log, exp, sin, cos and atan2. These follow
+  the polynomial approximations of the Cephes library and are accurate to a few ulp over
+  the range of values seen by the recursion.
+
+  The integer exponents also have a float kernel, with twice as many lanes, and a 
+  double-double kernel, for the views shallow or deep enough to need them (see the 
+  precision tiers in mandel.c).
+*/
+
+#define F(n) VEC_NAME(n)
+
+typedef double   F(vec_d) __attribute__((vector_size(VEC_WIDTH*8)));
+typedef int64_t  F(vec_i) __attribute__((vector_size(VEC_WIDTH*8)));
+typedef uint64_t F(vec_u) __attribute__((vector_size(VEC_WIDTH*8)));
+
+#define vd F(vec_d)
+#define vi F(vec_i)
+#define vu F(vec_u)
+
+// 2^52 + 2^51, adding this to a double rounds it to an integer held in the low mantissa bits
+#define V_MAGIC      6755399441055744.0
+#define V_MAGIC_BITS 0x4338000000000000LL
+#define V_SIGN_BIT   0x8000000000000000ULL
+
+static inline vd F(v_splat)(double d){
+  return ((vd){0}) + d;
+}
+
+// Return a where the mask is set, otherwise b
+static inline vd F(v_sel)(vi mask, vd a, vd b){
+  return (vd)((mask & (vi)a) | (~mask & (vi)b));
+}
+
+static inline int F(v_any)(vi mask){
+  return VEC_ANY(mask) != 0;
+}
+
+// Round to the nearest integer (|x| < 2^51), returning both the double and the integer
+static inline vd F(v_round)(vd x, vi *n){
+  vd r = x + V_MAGIC;
+  *n = (vi)r - V_MAGIC_BITS;
+  return r - V_MAGIC;
+}
+
+static inline vd F(v_floor)(vd x){
+  vi n;
+  vd r = F(v_round)(x, &n);
+  return F(v_sel)(r > x, r - 1.0, r);
+}
+
+static inline vd F(v_itod)(vi n){
+  return (vd)(n + V_MAGIC_BITS) - V_MAGIC;
+}
+
+
+/*
+  Natural logarithm for positive, normal arguments
+*/
+static inline vd F(v_log)(vd x){
+  vu bits = (vu) x;
+  vi e, small;
+  vd m, z, y, p, q, fe;
+
+  // Split x into m * 2^e with m in [0.5, 1)
+  e = (vi)((bits >> 52) & 0x7ff) - 1022;
+  m = (vd)((bits & 0x000fffffffffffffULL) | 0x3fe0000000000000ULL);
+
+  small = m < 0.70710678118654752440;
+  e += small;
+  m = F(v_sel)(small, m + m, m) - 1.0;
+
+  z = m*m;
+  p = ((((1.01875663804580931796E-4*m + 4.97494994976747001425E-1)*m
+         + 4.70579119878881725854E0)*m + 1.44989225341610930846E1)*m
+       + 1.79368678507819816313E1)*m + 7.70838733755885391666E0;
+  q = (((((m + 1.12873587189167450590E1)*m + 4.52279145837532221105E1)*m
+         + 8.29875266912776603211E1)*m + 7.11544750618563894466E1)*m
+       + 2.31251620126765340583E1);
+  y = m*(z*p/q);
+
+  fe = F(v_itod)(e);
+  y -= fe*2.121944400546905827679E-4;
+  y -= 0.5*z;
+  z = m + y;
+  return z + fe*0.693359375;
+}
+
+
+/*
+  Exponential function, clamped to the range of normal doubles
+*/
+static inline vd F(v_exp)(vd x){
+  vd fn, r, xx, px, qx;
+  vi n;
+
+  x = F(v_sel)(x > 709.0, F(v_splat)(709.0), x);
+  x = F(v_sel)(x < -708.0, F(v_splat)(-708.0), x);
+
+  // x = n*ln(2) + r, with |r| <= ln(2)/2
+  fn = F(v_round)(x*1.4426950408889634073599, &n);
+  r = x - fn*6.93145751953125E-1;
+  r -= fn*1.42860682030941723212E-6;
+
+  xx = r*r;
+  px = r*((1.26177193074810590878E-4*xx + 3.02994407707441961300E-2)*xx
+          + 9.99999999999999999910E-1);
+  qx = ((3.00198505138664455042E-6*xx + 2.52448340349684104192E-3)*xx
+        + 2.27265548208155028766E-1)*xx + 2.00000000000000000009E0;
+  r = px/(qx - px);
+  r = 1.0 + 2.0*r;
+
+  return r * (vd)((vu)(n + 1023) << 52);
+}
+
+
+/*
+  Sine and cosine of x, found together from a single range reduction to [-pi/4, pi/4]
+*/
+static inline void F(v_sincos)(vd x, vd *s, vd *c){
+  vd q, r, zz, sn, cs;
+  vi n, swap;
+
+  q = F(v_round)(x*0.63661977236758134308, &n);
+  r = x - q*1.57079625129699707031;
+  r -= q*7.54978941586159635335E-8;
+  r -= q*5.39030285815811905290E-15;
+
+  zz = r*r;
+  sn = r + r*zz*(((((1.58962301576546568060E-10*zz - 2.50507477628578072866E-8)*zz
+                    + 2.75573136213857245213E-6)*zz - 1.98412698295895385996E-4)*zz
+                  + 8.33333333332211858878E-3)*zz - 1.66666666666666307295E-1);
+  cs = 1.0 - 0.5*zz + zz*zz*(((((-1.13585365213876817300E-11*zz + 2.08757008419747316778E-9)*zz
+                                - 2.75573141792967388112E-7)*zz + 2.48015872888517045348E-5)*zz
+                              - 1.38888888888730564116E-3)*zz + 4.16666666666665929218E-2);
+
+  // Select the quadrant, swapping sine and cosine for odd quadrants
+  swap = (n & 1) != 0;
+  *s = (vd)((vu)F(v_sel)(swap, cs, sn) ^ ((vu)(n & 2) << 62));
+  *c = (vd)((vu)F(v_sel)(swap, sn, cs) ^ ((vu)((n + 1) & 2) << 62));
+}
+
+
+/*
+  Four quadrant arctangent, returning values in the range [-pi, pi]
+*/
+static inline vd F(v_atan2)(vd y, vd x){
+  vd t, z, r, y0, more;
+  vi big, mid;
+
+  t = (vd)((vu)y & ~V_SIGN_BIT) / (vd)((vu)x & ~V_SIGN_BIT);
+
+  big = t > 2.41421356237309504880;
+  mid = ~big & (t > 0.66);
+  y0   = F(v_sel)(big, F(v_splat)(M_PI_2), F(v_sel)(mid, F(v_splat)(M_PI_4), F(v_splat)(0.0)));
+  more = F(v_sel)(big, F(v_splat)(6.123233995736765886130E-17),
+                  F(v_sel)(mid, F(v_splat)(3.061616997868382943065E-17), F(v_splat)(0.0)));
+  t = F(v_sel)(big, -1.0/t, F(v_sel)(mid, (t - 1.0)/(t + 1.0), t));
+
+  z = t*t;
+  r = z*((((-8.750608600031904122785E-1*z - 1.615753718733365076637E1)*z
+           - 7.500855792314704667340E1)*z - 1.228866684490136173410E2)*z
+         - 6.485021904942025371773E1)
+    / (((((z + 2.485846490142306297962E1)*z + 1.650270098316988542046E2)*z
+         + 4.328810604912902668951E2)*z + 4.853903996359136964868E2)*z
+       + 1.945506571482613964425E2);
+  r = y0 + ((t*r + t) + more);
+
+  // Move into the left half plane and apply the sign of y
+  r = F(v_sel)(x < 0.0, (M_PI - r) + 1.2246467991473531772E-16, r);
+  return (vd)((vu)r | ((vu)y & V_SIGN_BIT));
+}
+
+
+/*
+  Load the points of the group of pixels starting g pixels into a span, which runs from 
+  (x0, y) in steps of dx columns and dy rows. The lanes past the end of the span are 
+  marked invalid.
+*/
+static inline vi F(v_load_points)(int y, int x0, int g, int n, int dx, int dy, vd *cr, vd *ci){
+  vd lane = {0};
+  int k;
+
+  for (k=0; k<VEC_WIDTH; k++)
+    lane[k] = (double) k;
+  *cr = s_center_r + s_scale*(x0+(g+lane)*dx - 0.5*s_width);
+  *ci = s_center_i + s_scale*(0.5*s_height - (y+(g+lane)*dy));
+  return lane < (double)(n-g);
+}
+
+
+/*
+  Add the lanes of a group found to be inside the set early to the interior counts, and
+  those which fell below s_min_r or reached s_depth to the statistics of the thread
+*/
+static inline void F(v_count_interior)(vi cardioid, vi bulb, vi period, vi min_r, vi depth){
+  int k;
+
+  for (k=0; k<VEC_WIDTH; k++){
+    t_interior.cardioid += (cardioid[k] != 0);
+    t_interior.bulb += (bulb[k] != 0);
+    t_interior.period += (period[k] != 0);
+    t_stats->min_r += (min_r[k] != 0);
+    t_stats->depth += (depth[k] != 0);
+  }
+}
+
+
+/*
+  Add the iterations of a group, counted per lane while the lane was active, to the total
+*/
+static inline void F(v_count_iterations)(vi iters){
+  int k;
+
+  for (k=0; k<VEC_WIDTH; k++)
+    t_iters += (uint64_t) iters[k];
+}
+
+
+/*
+  Function: calculate_span_int
+
+  Vectorized version of calculate_escape_int. Computes the escape values of the n pixels
+  starting at (x0, y), in steps of dx columns and dy rows, and stores them in out (see 
+  calculate_span_scalar).
+*/
+static void F(calculate_span_int)(int y, int x0, int n, int dx, int dy, float *out){
+  vd cr, ci, a, b, t, pa, pb, ra, rb, sa, sb, rsq, esc_rsq, esc_i;
+  vi active, esc, newly, cardioid, bulb, period, min_r, iters;
+  int g, i, k, m, check, stride;
+
+  stride = dx + dy*s_width;
+  for (g=0; g<n; g+=VEC_WIDTH){
+    active = F(v_load_points)(y, x0, g, n, dx, dy, &cr, &ci);
+    a = cr, b = ci;
+    rsq = a*a + b*b;
+
+    min_r = active & (rsq < s_min_r);
+    active &= ~min_r;
+    esc = period = cardioid = bulb = iters = (vi){0};
+    esc_rsq = esc_i = F(v_splat)(0.0);
+
+    // Mask off the lanes inside the main cardioid or the period-2 bulb
+    if (s_power_n == 2){
+      t = (a-0.25)*(a-0.25) + b*b;
+      cardioid = active & (t*(t+(a-0.25)) <= 0.25*b*b);
+      active &= ~cardioid;
+      bulb = active & ((a+1.0)*(a+1.0) + b*b <= 0.0625);
+      active &= ~bulb;
+    }
+
+    sa = a, sb = b;
+    check = 1;
+
+    for (i=0; (i < s_depth) && F(v_any)(active); i++){
+      iters -= active;
+      if (s_power_n == 2){
+        t = a*a - b*b;
+        b = 2.0*a*b;
+        a = t;
+      }
+      else{
+        ra = F(v_splat)(1.0), rb = F(v_splat)(0.0);
+        pa = a, pb = b;
+        for (m = s_power_n; m > 0; m >>= 1){
+          if (m & 1){
+            t  = ra*pa - rb*pb;
+            rb = ra*pb + rb*pa;
+            ra = t;
+          }
+          t  = pa*pa - pb*pb;
+          pb = 2.0*pa*pb;
+          pa = t;
+        }
+        a = ra, b = rb;
+      }
+
+      a += cr;
+      b += ci;
+      rsq = a*a + b*b;
+
+      // Record the lanes which have escaped on this iteration and mask them off
+      newly = active & (rsq >= s_escape);
+      esc_rsq = F(v_sel)(newly, rsq, esc_rsq);
+      esc_i = F(v_sel)(newly, F(v_splat)((double) i), esc_i);
+      esc |= newly;
+      active &= ~newly;
+      min_r |= active & (rsq < s_min_r);
+      active &= (rsq >= s_min_r);
+
+      // Mask off the lanes which have returned to the point saved at the last power of two
+      newly = active & ((a-sa)*(a-sa) + (b-sb)*(b-sb) < PERIOD_EPS);
+      period |= newly;
+      active &= ~newly;
+      if (i+1 == check){
+        sa = a, sb = b;
+        check <<= 1;
+      }
+    }
+
+    F(v_count_interior)(cardioid, bulb, period, min_r, active);
+    F(v_count_iterations)(iters);
+    for (k=0; (k < VEC_WIDTH) && (g+k < n); k++){
+      if (esc[k]){
+        count_escape((int) esc_i[k]);
+        out[(g+k)*stride] = escape_value((int) esc_i[k], esc_rsq[k], s_log_power);
+      }
+      else
+        out[(g+k)*stride] = 1.0;
+    }
+  }
+}
+
+
+/*
+  Function: calculate_span
+
+  Vectorized version of calculate_escape, for any complex exponent. Computes the escape
+  values of the n pixels starting at (x0, y), in steps of dx columns and dy rows, and 
+  stores them in out (see calculate_span_scalar). As for the scalar
+  kernel, it is built for each branch mode, as calculate_span_point and 
+  calculate_span_exponent.
+*/
+static inline __attribute__((always_inline))
+void F(calculate_span)(int y, int x0, int n, int dx, int dy, float *out, const int branch){
+  vd cr, ci, a, b, sa, sb, rsq, th, br, lr, coe, ang, sn, cs, esc_rsq, esc_th, esc_i;
+  vi active, esc, newly, period, min_r, iters;
+  int g, i, k, check, stride;
+
+  stride = dx + dy*s_width;
+  for (g=0; g<n; g+=VEC_WIDTH){
+    active = F(v_load_points)(y, x0, g, n, dx, dy, &cr, &ci);
+    a = cr, b = ci;
+    rsq = a*a + b*b;
+    th = F(v_atan2)(b, a);
+
+    // Move the angle into the range (-b-pi, pi-b)
+    br = th - 2.0*M_PI*F(v_floor)((th + s_power_i + M_PI)/(2.0*M_PI));
+
+    min_r = active & (rsq < s_min_r);
+    active &= ~min_r;
+    esc = period = iters = (vi){0};
+    esc_rsq = esc_th = esc_i = F(v_splat)(0.0);
+
+    sa = a, sb = b;
+    check = 1;
+
+    for (i=0; (i < s_depth) && F(v_any)(active); i++){
+      iters -= active;
+      // Perform a branch cut for the complex exponential
+      if (branch)
+        th -= 2.0*M_PI*F(v_floor)((th - br + M_PI)/(2.0*M_PI));
+      else
+        th -= 2.0*M_PI*F(v_floor)((th + s_power_i + M_PI)/(2.0*M_PI));
+
+      lr = F(v_log)(rsq);
+      coe = F(v_exp)(0.5*s_power_r*lr - s_power_i*th);
+      ang = s_power_r*th + 0.5*s_power_i*lr;
+      F(v_sincos)(ang, &sn, &cs);
+
+      a = coe*cs + cr;
+      b = coe*sn + ci;
+      rsq = a*a + b*b;
+      th = F(v_atan2)(b, a);
+
+      newly = active & (rsq >= s_escape);
+      esc_rsq = F(v_sel)(newly, rsq, esc_rsq);
+      esc_th = F(v_sel)(newly, th, esc_th);
+      esc_i = F(v_sel)(newly, F(v_splat)((double) i), esc_i);
+      esc |= newly;
+      active &= ~newly;
+      min_r |= active & (rsq < s_min_r);
+      active &= (rsq >= s_min_r);
+
+      newly = active & ((a-sa)*(a-sa) + (b-sb)*(b-sb) < PERIOD_EPS);
+      period |= newly;
+      active &= ~newly;
+      if (i+1 == check){
+        sa = a, sb = b;
+        check <<= 1;
+      }
+    }
+
+    F(v_count_interior)((vi){0}, (vi){0}, period, min_r, active);
+    F(v_count_iterations)(iters);
+    for (k=0; (k < VEC_WIDTH) && (g+k < n); k++){
+      if (esc[k]){
+        count_escape((int) esc_i[k]);
+        out[(g+k)*stride] = escape_value((int) esc_i[k], esc_rsq[k],
+                                log(2.0*log(pow(esc_rsq[k], s_power_r/2.)*exp(-1.0*s_power_i*esc_th[k]))
+                                    /log(esc_rsq[k])));
+      }
+      else
+        out[(g+k)*stride] = 1.0;
+    }
+  }
+}
+
+static void F(calculate_span_point)(int y, int x0, int n, int dx, int dy, float *out){
+  F(calculate_span)(y, x0, n, dx, dy, out, 1);
+}
+
+static void F(calculate_span_exponent)(int y, int x0, int n, int dx, int dy, float *out){
+  F(calculate_span)(y, x0, n, dx, dy, out, 0);
+}
+
+
+/*
+  Function: calculate_sweep
+
+  Version of calculate_span for a sweep of the exponent (see s_sweep_n). Each lane holds
+  the same pixel with the exponent of a different frame, so the point, and its angle, are
+  found once for all of the frames. The lanes of neighbouring exponents tend to escape 
+  together. Computes the escape values of the n pixels starting at (x0, y) for each of the
+  s_sweep_n exponents, and stores them in the buffer of the exponent in s_sweep_out. As for
+  calculate_span, it is built for each branch mode, as calculate_sweep_point and 
+  calculate_sweep_exponent.
+*/
+static inline __attribute__((always_inline))
+void F(calculate_sweep)(int y, int x0, int n, const int branch){
+  vd pr, pi, lane, cr, ci, a, b, sa, sb, rsq, th, br, lr, coe, ang, sn, cs, esc_rsq, esc_th, esc_i;
+  vi valid, active, esc, newly, period, min_r, iters;
+  size_t at;
+  int j, i, k, check;
+
+  // The lanes past the last exponent repeat the first, and are marked invalid
+  for (k=0; k<VEC_WIDTH; k++){
+    lane[k] = (double) k;
+    pr[k] = s_sweep_r[(k < s_sweep_n) ? k : 0];
+    pi[k] = s_sweep_i[(k < s_sweep_n) ? k : 0];
+  }
+  valid = lane < (double) s_sweep_n;
+  at = (size_t) y*s_width + x0;
+
+  for (j=0; j<n; j++){
+    cr = F(v_splat)(s_center_r + s_scale*(x0+j - 0.5*s_width));
+    ci = F(v_splat)(s_center_i + s_scale*(0.5*s_height - y));
+    a = cr, b = ci;
+    rsq = a*a + b*b;
+    th = F(v_atan2)(b, a);
+
+    // Move the angle into the range (-b-pi, pi-b)
+    br = th - 2.0*M_PI*F(v_floor)((th + pi + M_PI)/(2.0*M_PI));
+
+    min_r = valid & (rsq < s_min_r);
+    active = valid & ~min_r;
+    esc = period = iters = (vi){0};
+    esc_rsq = esc_th = esc_i = F(v_splat)(0.0);
+
+    sa = a, sb = b;
+    check = 1;
+
+    for (i=0; (i < s_depth) && F(v_any)(active); i++){
+      iters -= active;
+      // Perform a branch cut for the complex exponential
+      if (branch)
+        th -= 2.0*M_PI*F(v_floor)((th - br + M_PI)/(2.0*M_PI));
+      else
+        th -= 2.0*M_PI*F(v_floor)((th + pi + M_PI)/(2.0*M_PI));
+
+      lr = F(v_log)(rsq);
+      coe = F(v_exp)(0.5*pr*lr - pi*th);
+      ang = pr*th + 0.5*pi*lr;
+      F(v_sincos)(ang, &sn, &cs);
+
+      a = coe*cs + cr;
+      b = coe*sn + ci;
+      rsq = a*a + b*b;
+      th = F(v_atan2)(b, a);
+
+      newly = active & (rsq >= s_escape);
+      esc_rsq = F(v_sel)(newly, rsq, esc_rsq);
+      esc_th = F(v_sel)(newly, th, esc_th);
+      esc_i = F(v_sel)(newly, F(v_splat)((double) i), esc_i);
+      esc |= newly;
+      active &= ~newly;
+      min_r |= active & (rsq < s_min_r);
+      active &= (rsq >= s_min_r);
+
+      newly = active & ((a-sa)*(a-sa) + (b-sb)*(b-sb) < PERIOD_EPS);
+      period |= newly;
+      active &= ~newly;
+      if (i+1 == check){
+        sa = a, sb = b;
+        check <<= 1;
+      }
+    }
+
+    F(v_count_interior)((vi){0}, (vi){0}, period, min_r, active);
+    F(v_count_iterations)(iters);
+    for (k=0; k < s_sweep_n; k++){
+      if (esc[k]){
+        count_escape((int) esc_i[k]);
+        s_sweep_out[k][at+j] = escape_value((int) esc_i[k], esc_rsq[k],
+                                 log(2.0*log(pow(esc_rsq[k], pr[k]/2.)*exp(-1.0*pi[k]*esc_th[k]))
+                                     /log(esc_rsq[k])));
+      }
+      else
+        s_sweep_out[k][at+j] = 1.0;
+    }
+  }
+}
+
+static void F(calculate_sweep_point)(int y, int x0, int n){
+  F(calculate_sweep)(y, x0, n, 1);
+}
+
+static void F(calculate_sweep_exponent)(int y, int x0, int n){
+  F(calculate_sweep)(y, x0, n, 0);
+}
+
+
+/*
+  Function: calculate_span_int_float
+
+  The float version of calculate_span_int, which iterates 2*VEC_WIDTH pixels together. The
+  points are found in double and rounded, so that only the recursion loses precision. As
+  an attracting cycle of floats need not repeat exactly, the orbits are compared to the 
+  saved point within PERIOD_EPS_F rather than PERIOD_EPS.
+*/
+typedef float    F(vec_f)  __attribute__((vector_size(VEC_WIDTH*8)));
+typedef int32_t  F(vec_fi) __attribute__((vector_size(VEC_WIDTH*8)));
+
+#define vf  F(vec_f)
+#define vfi F(vec_fi)
+
+static inline vf F(vf_sel)(vfi mask, vf a, vf b){
+  return (vf)((mask & (vfi)a) | (~mask & (vfi)b));
+}
+
+static void F(calculate_span_int_float)(int y, int x0, int n, int dx, int dy, float *out){
+  vf cr = {0}, ci = {0}, lane = {0}, a, b, t, pa, pb, ra, rb, sa, sb, rsq, esc_rsq;
+  vfi active, esc, esc_i, newly, cardioid, bulb, period, min_r, iters;
+  float escape = (float) s_escape, min_rsq = (float) s_min_r;
+  int g, i, k, m, check, stride;
+
+  for (k=0; k<2*VEC_WIDTH; k++)
+    lane[k] = (float) k;
+  stride = dx + dy*s_width;
+  for (g=0; g<n; g+=2*VEC_WIDTH){
+    for (k=0; k<2*VEC_WIDTH; k++){
+      cr[k] = (float)(s_center_r + s_scale*(x0+(g+k)*dx - 0.5*s_width));
+      ci[k] = (float)(s_center_i + s_scale*(0.5*s_height - (y+(g+k)*dy)));
+    }
+    active = lane < (float)(n-g);
+    a = cr, b = ci;
+    rsq = a*a + b*b;
+
+    min_r = active & (rsq < min_rsq);
+    active &= ~min_r;
+    esc = esc_i = period = cardioid = bulb = iters = (vfi){0};
+    esc_rsq = (vf){0};
+
+    if (s_power_n == 2){
+      t = (a-0.25f)*(a-0.25f) + b*b;
+      cardioid = active & (t*(t+(a-0.25f)) <= 0.25f*b*b);
+      active &= ~cardioid;
+      bulb = active & ((a+1.0f)*(a+1.0f) + b*b <= 0.0625f);
+      active &= ~bulb;
+    }
+
+    sa = a, sb = b;
+    check = 1;
+
+    for (i=0; (i < s_depth) && (VEC_ANY_F(active) != 0); i++){
+      iters -= active;
+      if (s_power_n == 2){
+        t = a*a - b*b;
+        b = 2.0f*a*b;
+        a = t;
+      }
+      else{
+        ra = (vf){0} + 1.0f, rb = (vf){0};
+        pa = a, pb = b;
+        for (m = s_power_n; m > 0; m >>= 1){
+          if (m & 1){
+            t  = ra*pa - rb*pb;
+            rb = ra*pb + rb*pa;
+            ra = t;
+          }
+          t  = pa*pa - pb*pb;
+          pb = 2.0f*pa*pb;
+          pa = t;
+        }
+        a = ra, b = rb;
+      }
+
+      a += cr;
+      b += ci;
+      rsq = a*a + b*b;
+
+      newly = active & (rsq >= escape);
+      esc_rsq = F(vf_sel)(newly, rsq, esc_rsq);
+      esc_i = (newly & i) | (~newly & esc_i);
+      esc |= newly;
+      active &= ~newly;
+      min_r |= active & (rsq < min_rsq);
+      active &= (rsq >= min_rsq);
+
+      newly = active & ((a-sa)*(a-sa) + (b-sb)*(b-sb) < (float) PERIOD_EPS_F);
+      period |= newly;
+      active &= ~newly;
+      if (i+1 == check){
+        sa = a, sb = b;
+        check <<= 1;
+      }
+    }
+
+    for (k=0; k<2*VEC_WIDTH; k++){
+      t_interior.cardioid += (cardioid[k] != 0);
+      t_interior.bulb += (bulb[k] != 0);
+      t_interior.period += (period[k] != 0);
+      t_stats->min_r += (min_r[k] != 0);
+      t_stats->depth += (active[k] != 0);
+      t_iters += (uint64_t) iters[k];
+    }
+    for (k=0; (k < 2*VEC_WIDTH) && (g+k < n); k++){
+      if (esc[k]){
+        count_escape(esc_i[k]);
+        out[(g+k)*stride] = escape_value(esc_i[k], esc_rsq[k], s_log_power);
+      }
+      else
+        out[(g+k)*stride] = 1.0;
+    }
+  }
+}
+
+
+/*
+  Function: calculate_span_int_dd
+
+  The double-double version of calculate_span_int (see mandel_dd.h), for the views too 
+  deep for a double. Each value is held as a pair of vectors, the high and low parts. The 
+  points are found from the center of the image in double-double, as for calculate_escape_dd,
+  and the interior tests are made in double-double so that they hold close to the edge of
+  the cardioid. The escape and cycle tests only need the high parts, and there is no test
+  against MIN_R.
+*/
+typedef struct{
+  vd hi;
+  vd lo;
+} F(vec_dd);
+
+#define vdd F(vec_dd)
+
+// The exact product of two doubles needs a fused multiply-add, done lane by lane
+static inline vd F(v_fma)(vd a, vd b, vd c){
+  vd r;
+  int k;
+
+  for (k=0; k<VEC_WIDTH; k++)
+    r[k] = __builtin_fma(a[k], b[k], c[k]);
+  return r;
+}
+
+static inline vdd F(vdd_quick_two_sum)(vd a, vd b){
+  vd s = a + b;
+  return (vdd){s, b - (s - a)};
+}
+
+static inline vdd F(vdd_add)(vdd a, vdd b){
+  vd s, t, bb, e, f;
+
+  s = a.hi + b.hi;
+  bb = s - a.hi;
+  e = (a.hi - (s - bb)) + (b.hi - bb);
+  t = a.lo + b.lo;
+  bb = t - a.lo;
+  f = (a.lo - (t - bb)) + (b.lo - bb);
+  a = F(vdd_quick_two_sum)(s, e + t);
+  return F(vdd_quick_two_sum)(a.hi, a.lo + f);
+}
+
+static inline vdd F(vdd_add_d)(vdd a, vd b){
+  vd s, bb, e;
+
+  s = a.hi + b;
+  bb = s - a.hi;
+  e = (a.hi - (s - bb)) + (b - bb);
+  return F(vdd_quick_two_sum)(s, e + a.lo);
+}
+
+static inline vdd F(vdd_neg)(vdd a){
+  return (vdd){-a.hi, -a.lo};
+}
+
+static inline vdd F(vdd_mul)(vdd a, vdd b){
+  vd p = a.hi*b.hi;
+  return F(vdd_quick_two_sum)(p, F(v_fma)(a.hi, b.hi, -p) + (a.hi*b.lo + a.lo*b.hi));
+}
+
+static inline vdd F(vdd_sqr)(vdd a){
+  vd p = a.hi*a.hi;
+  return F(vdd_quick_two_sum)(p, F(v_fma)(a.hi, a.hi, -p) + 2.0*a.hi*a.lo);
+}
+
+static void F(calculate_span_int_dd)(int y, int x0, int n, int dx, int dy, float *out){
+  vdd cr, ci, a, b, t, pa, pb, ra, rb, sa, sb, u;
+  vd lane = {0}, rsq, da, db, esc_rsq, esc_i;
+  vi active, esc, newly, cardioid, bulb, period, min_r, iters;
+  double eps = fmin(PERIOD_EPS, s_scale*s_scale);
+  int g, i, k, m, check, stride;
+
+  for (k=0; k<VEC_WIDTH; k++)
+    lane[k] = (double) k;
+  stride = dx + dy*s_width;
+  for (g=0; g<n; g+=VEC_WIDTH){
+    cr = F(vdd_add_d)((vdd){F(v_splat)(s_center_dd_r.hi), F(v_splat)(s_center_dd_r.lo)},
+                      s_scale*(x0+(g+lane)*dx - 0.5*s_width));
+    ci = F(vdd_add_d)((vdd){F(v_splat)(s_center_dd_i.hi), F(v_splat)(s_center_dd_i.lo)},
+                      s_scale*(0.5*s_height - (y+(g+lane)*dy)));
+    active = lane < (double)(n-g);
+    a = cr, b = ci;
+    esc = min_r = period = cardioid = bulb = iters = (vi){0};
+    esc_rsq = esc_i = F(v_splat)(0.0);
+
+    if (s_power_n == 2){
+      u = F(vdd_add_d)(a, F(v_splat)(-0.25));
+      t = F(vdd_add)(F(vdd_sqr)(u), F(vdd_sqr)(b));
+      pb = F(vdd_sqr)(b);
+      t = F(vdd_add)(F(vdd_mul)(t, F(vdd_add)(t, u)), (vdd){-0.25*pb.hi, -0.25*pb.lo});
+      cardioid = active & (t.hi <= 0.0);
+      active &= ~cardioid;
+      u = F(vdd_add_d)(a, F(v_splat)(1.0));
+      t = F(vdd_add_d)(F(vdd_add)(F(vdd_sqr)(u), F(vdd_sqr)(b)), F(v_splat)(-0.0625));
+      bulb = active & (t.hi <= 0.0);
+      active &= ~bulb;
+    }
+
+    sa = a, sb = b;
+    check = 1;
+
+    for (i=0; (i < s_depth) && F(v_any)(active); i++){
+      iters -= active;
+      if (s_power_n == 2){
+        t = F(vdd_add)(F(vdd_sqr)(a), F(vdd_neg)(F(vdd_sqr)(b)));
+        b = F(vdd_mul)(a, b);
+        b = (vdd){2.0*b.hi, 2.0*b.lo};
+        a = t;
+      }
+      else{
+        ra = (vdd){F(v_splat)(1.0), F(v_splat)(0.0)}, rb = (vdd){F(v_splat)(0.0), F(v_splat)(0.0)};
+        pa = a, pb = b;
+        for (m = s_power_n; m > 0; m >>= 1){
+          if (m & 1){
+            t  = F(vdd_add)(F(vdd_mul)(ra, pa), F(vdd_neg)(F(vdd_mul)(rb, pb)));
+            rb = F(vdd_add)(F(vdd_mul)(ra, pb), F(vdd_mul)(rb, pa));
+            ra = t;
+          }
+          t  = F(vdd_add)(F(vdd_sqr)(pa), F(vdd_neg)(F(vdd_sqr)(pb)));
+          pb = F(vdd_mul)(pa, pb);
+          pb = (vdd){2.0*pb.hi, 2.0*pb.lo};
+          pa = t;
+        }
+        a = ra, b = rb;
+      }
+
+      a = F(vdd_add)(a, cr);
+      b = F(vdd_add)(b, ci);
+      rsq = a.hi*a.hi + b.hi*b.hi;
+
+      newly = active & (rsq >= s_escape);
+      esc_rsq = F(v_sel)(newly, rsq, esc_rsq);
+      esc_i = F(v_sel)(newly, F(v_splat)((double) i), esc_i);
+      esc |= newly;
+      active &= ~newly;
+
+      da = F(vdd_add)(a, F(vdd_neg)(sa)).hi;
+      db = F(vdd_add)(b, F(vdd_neg)(sb)).hi;
+      newly = active & (da*da + db*db < eps);
+      period |= newly;
+      active &= ~newly;
+      if (i+1 == check){
+        sa = a, sb = b;
+        check <<= 1;
+      }
+    }
+
+    F(v_count_interior)(cardioid, bulb, period, min_r, active);
+    F(v_count_iterations)(iters);
+    for (k=0; (k < VEC_WIDTH) && (g+k < n); k++){
+      if (esc[k]){
+        count_escape((int) esc_i[k]);
+        out[(g+k)*stride] = escape_value((int) esc_i[k], esc_rsq[k], s_log_power);
+      }
+      else
+        out[(g+k)*stride] = 1.0;
+    }
+  }
+}
+
+#undef vd
+#undef vi
+#undef vu
+#undef vf
+#undef vfi
+#undef vdd
+#undef V_MAGIC
+#undef V_MAGIC_BITS
+#undef V_SIGN_BIT
+#undef F
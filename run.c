@@ -13,7 +13,7 @@ int main(int argc, char **argv){
   char * c;
   clock_t start, end;
   struct tms t;
-  int i=0, max = 3;
+  int max = 3;
   double step = 0.001;
   double d = 0.0;
 
@@ -34,32 +34,36 @@ int main(int argc, char **argv){
   }
 
 
-  while(i<max){
-    if((start=times(&t))==(clock_t)-1){
+  if (max < 1)
+    return 0;
+
+  /*
+    Render all of the frames in a single batch, sweeping b from d in steps of step. The
+    frames share one process and thread pool, rather than starting mandel for each frame
+  */
+  if((start=times(&t))==(clock_t)-1){
+    printf("Bad clock!\n");
+    return -1;
+  }
+  switch(chPID=fork()){
+  case -1:
+    printf("Fork Failed!!\n");
+    return -1;
+  case 0:
+    c = (char *) malloc(3*32*sizeof(char));
+    sprintf(c,"%d",max);
+    sprintf(c+32,"%.5f",d);
+    sprintf(c+64,"%.5f",d+step*(max-1));
+    execlp("./mandel","mandel","-n",c,"-b",c+32,"-B",c+64, (char *) NULL);
+    return -1;
+  default:
+    wait(NULL);
+    if((end=times(&t))==(clock_t)-1){
       printf("Bad clock!\n");
       return -1;
     }
-    switch(chPID=fork()){
-    case -1:
-      printf("Fork Failed!!\n");
-      return -1;
-    case 0:
-      c = (char *) malloc(10*sizeof(char));
-      sprintf(c,"%.5f",d);
-      c[9]='\0';
-      execlp("./mandel","mandel","-b",(char *const)c, (char *) NULL);
-      return -1;
-    default:
-      wait(NULL);
-      if((end=times(&t))==(clock_t)-1){
-        printf("Bad clock!\n");
-        return -1;
-      }
-      i++;
-      d+=step;
-      end = end-start;
-      printf("Time: %.2f seconds\n",0.01 * (double)end);
-    }
+    end = end-start;
+    printf("Time: %.2f seconds, %.2f seconds per frame\n",0.01 * (double)end, 0.01 * (double)end/max);
   }
 
   return 0;